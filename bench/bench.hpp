@@ -0,0 +1,50 @@
+#pragma once
+#include "latency.hpp"
+#include <stdio.h>
+#include <string.h>
+
+/*
+    Shared harness for the benchmarks.
+    Every result is a case run at one payload size, reported as TSC cycles per packet, ns per packet and packets per second.
+    By default results are printed as a table. With --json, each result is one JSON object per line, with fixed keys:
+    {"bench": ..., "case": ..., "payload": ..., "cycles_per_pkt": ..., "ns_per_pkt": ..., "pps": ...}
+    so release gates can parse them without depending on the table layout.
+*/
+
+static const char *bench_name;
+static bool bench_json;
+
+static void bench_init(const char *name, int argc, char **argv)
+{
+    bench_name = name;
+    bench_json = argc > 1 && strcmp(argv[1], "--json") == 0;
+    tsc_calibrate();
+    if (!bench_json)
+    {
+        printf("== %s\n", name);
+        printf("%-28s %8s %14s %12s %14s\n", "case", "payload", "cycles/pkt", "ns/pkt", "pkts/s");
+    }
+}
+
+/* Run fn iters times and return the TSC cycles it took */
+template <typename F>
+static uint64_t bench_run(F fn, long iters)
+{
+    uint64_t start = tsc_now();
+    for (long i = 0; i < iters; ++i)
+        fn();
+    return tsc_now() - start;
+}
+
+/* Report cycles spent on pkts packets */
+static void bench_report(const char *name, size_t payload, uint64_t cycles, long pkts)
+{
+    double cycles_per_pkt = (double)cycles / pkts;
+    double ns_per_pkt = (double)tsc_to_ns(cycles) / pkts;
+    double pps = ns_per_pkt > 0 ? 1e9 / ns_per_pkt : 0;
+    if (bench_json)
+        printf("{\"bench\": \"%s\", \"case\": \"%s\", \"payload\": %zu, \"cycles_per_pkt\": %.1f, \"ns_per_pkt\": %.2f, \"pps\": %.0f}\n",
+               bench_name, name, payload, cycles_per_pkt, ns_per_pkt, pps);
+    else
+        printf("%-28s %8zu %14.1f %12.2f %14.0f\n", name, payload, cycles_per_pkt, ns_per_pkt, pps);
+}
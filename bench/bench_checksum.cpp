@@ -0,0 +1,57 @@
+#include "pkt_headers.hpp"
+#include "bench.hpp"
+#include <cstdlib>
+
+/*
+    Checksum micro-benchmark.
+    Reports cycles and ns per call for each checksum variant at payload sizes from 0 to 1460 bytes,
+    against compute_checksum, the original 16 bits at a time implementation.
+*/
+
+#define ITERS 200000
+
+static const size_t sizes[] = {0, 20, 64, 128, 256, 512, 576, 1024, 1280, 1460};
+
+static volatile uint32_t sink;
+alignas(64) static char src[2048];
+alignas(64) static char dst[2048];
+
+static void report(const char *name, size_t len, uint64_t cycles)
+{
+    bench_report(name, len, cycles, ITERS);
+}
+
+template <typename F>
+static uint64_t time_cycles(F fn)
+{
+    return bench_run(fn, ITERS);
+}
+
+int main(int argc, char **argv)
+{
+    for (size_t i = 0; i < sizeof(src); ++i)
+        src[i] = (char)rand();
+
+    bench_init("bench_checksum", argc, argv);
+    if (!bench_json)
+        printf("selected variant: %s\n", csum_impl_name());
+    for (size_t len : sizes)
+    {
+        report("compute_checksum", len, time_cycles([&] { sink += compute_checksum((unsigned short *)src, len); }));
+        report("scalar", len, time_cycles([&] { sink += csum_partial_scalar(src, len, 0); }));
+        if (csum_partial_sse42)
+            report("sse4.2", len, time_cycles([&] { sink += csum_partial_sse42(src, len, 0); }));
+        if (csum_partial_avx2)
+            report("avx2", len, time_cycles([&] { sink += csum_partial_avx2(src, len, 0); }));
+        report("memcpy+compute", len, time_cycles([&] {
+            memcpy(dst, src, len);
+            sink += compute_checksum((unsigned short *)dst, len);
+        }));
+        report("copy scalar", len, time_cycles([&] { sink += csum_copy_partial_scalar(dst, src, len, 0); }));
+        if (csum_copy_partial_sse42)
+            report("copy sse4.2", len, time_cycles([&] { sink += csum_copy_partial_sse42(dst, src, len, 0); }));
+        if (csum_copy_partial_avx2)
+            report("copy avx2", len, time_cycles([&] { sink += csum_copy_partial_avx2(dst, src, len, 0); }));
+    }
+    return 0;
+}
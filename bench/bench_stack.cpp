@@ -0,0 +1,111 @@
+#include "ef_send_tcp.hpp"
+#include "bench.hpp"
+#include <iostream>
+#include <unistd.h>
+
+/*
+    End to end benchmark of the stack over the loopback NIC.
+    The simulated peer runs in the same thread, so its work (parsing, acknowledging, echoing) is counted as well,
+    the results compare builds of the stack rather than predict numbers on a Solarflare card.
+    The loopback NIC offloads the checksums like ef_vi does, so neither the stack nor the peer sums payloads.
+    rx_poll:   frames queued by the peer, drained by ef_poll into an on_data handler (RX parse, checksum, ACK)
+    send:      ef_send, with the peer acknowledging every segment
+    send_read: ef_send of a message that the peer echoes, read back with ef_read
+    The _fixed cases run the same on the connection with a fixed_session of its endpoints set. The session leaves the
+    checksums to the NIC like the runtime path does on loopback, so they differ from the others by the compile-time
+    header and RX match alone.
+*/
+
+#define ITERS 50000
+#define RX_BURST 128 /* Frames queued by the peer at a time, below what the loopback wire holds */
+#define WARMUP 1000
+
+static const size_t sizes[] = {16, 64, 256, 1024, 1460};
+
+/* The default connection of ef_default_config, to the loopback peer */
+typedef fixed_session<0x000f535a4da1, 0x000f534be6b1, 0xc0a80d17, 0xc0a80d0a, 1234, 12345, 1460, CSUM_MODE::OFFLOAD> lab_session;
+
+static size_t received;
+static char buf[MAX_PAYLOAD_SIZE];
+static char out[MAX_PAYLOAD_SIZE];
+
+static void on_data(void *arg, const char *data, size_t len)
+{
+    (void)arg;
+    (void)data;
+    received += len;
+}
+
+static uint64_t rx_poll(size_t len, long pkts)
+{
+    struct ef_callbacks cbs = {on_data, NULL, NULL, NULL};
+    uint64_t cycles = 0;
+    ef_set_callbacks(&cbs);
+    for (long done = 0; done < pkts; done += RX_BURST)
+    {
+        for (int i = 0; i < RX_BURST; ++i)
+            nic_loopback_inject(buf, len);
+        received = 0;
+        uint64_t start = tsc_now();
+        while (received < RX_BURST * len)
+            ef_poll();
+        cycles += tsc_now() - start;
+    }
+    ef_set_callbacks(NULL);
+    return cycles;
+}
+
+static void send_read(size_t len)
+{
+    ef_send(buf, len);
+    size_t got = 0;
+    while (got < len)
+        got += ef_read(out, len - got);
+}
+
+/* Run fn with stdout sent to stderr, so the stack's progress messages stay out of the results */
+template <typename F>
+static void quiet(F fn)
+{
+    int saved = dup(STDOUT_FILENO);
+    std::cout.flush();
+    fflush(stdout);
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+    fn();
+    std::cout.flush();
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+}
+
+int main(int argc, char **argv)
+{
+    bench_init("bench_stack", argc, argv);
+    quiet([] {
+        ef_init_tcp_client(&nic_loopback);
+        ef_connect();
+    });
+
+    for (size_t len : sizes)
+    {
+        for (const struct fixed_ops *ops : {(const struct fixed_ops *)NULL, &lab_session::ops})
+        {
+            std::string sfx = ops ? "_fixed" : "";
+            ef_set_fixed(ops);
+            long rx_pkts = ITERS / RX_BURST * RX_BURST;
+            rx_poll(len, WARMUP / RX_BURST * RX_BURST);
+            bench_report(("rx_poll" + sfx).c_str(), len, rx_poll(len, rx_pkts), rx_pkts);
+
+            bench_run([&] { ef_send(buf, len); }, WARMUP);
+            bench_report(("send" + sfx).c_str(), len, bench_run([&] { ef_send(buf, len); }, ITERS), ITERS);
+
+            nic_loopback_set_echo(true);
+            bench_run([&] { send_read(len); }, WARMUP);
+            bench_report(("send_read" + sfx).c_str(), len, bench_run([&] { send_read(len); }, ITERS), ITERS);
+            nic_loopback_set_echo(false);
+        }
+        ef_set_fixed(NULL);
+    }
+    quiet([] { ef_disconnect(); });
+    return 0;
+}
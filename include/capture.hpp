@@ -0,0 +1,82 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <atomic>
+#include <thread>
+
+/*
+    Packet capture.
+    The thread running the stack copies every frame it sends or receives into a single producer single consumer ring,
+    with the TSC of the moment. That is one memcpy of up to snaplen bytes and two cache lines of bookkeeping, and the frame
+    is dropped (and counted) rather than waited for when the ring is full. Copying whole frames costs about as much as
+    the memcpy, a snaplen of 128 bytes (every header) keeps it to around ten ns for any frame.
+    A background thread drains the ring into a pcap file with nanosecond timestamps, written through an mmap
+    of the file that is grown as it fills up. The file is readable by tcpdump and Wireshark once capture_close returns.
+*/
+
+#define CAPTURE_SNAPLEN 1536                /* Most bytes kept of each frame, more than the largest frame the stack sends */
+#define CAPTURE_RING_SIZE 4096              /* Frames the ring holds, power of 2 */
+#define CAPTURE_FILE_GROW (64ull << 20)     /* The file is extended (and remapped) 64 MiB at a time */
+#define CAPTURE_IDLE_US 50                  /* The writer sleeps this long between passes over the ring */
+
+struct capture_slot
+{
+    uint64_t tsc;     /* When the frame was sent or received */
+    uint32_t len;     /* Length of the frame on the wire */
+    uint32_t caplen;  /* Bytes of it in data */
+    char data[CAPTURE_SNAPLEN];
+};
+
+struct capture
+{
+    struct capture_slot *slots;
+    /* Producer side, written by the stack */
+    alignas(64) std::atomic<uint64_t> added;
+    uint64_t removed_cache; /* Last value of removed seen by the producer, so a full ring is spotted without reading it */
+    uint32_t snaplen;       /* Bytes kept of each frame */
+    std::atomic<uint64_t> dropped;
+    /* Consumer side, written by the writer thread */
+    alignas(64) std::atomic<uint64_t> removed;
+    std::atomic<bool> running;
+    std::thread writer;
+    int fd;
+    char *map;
+    size_t map_len;
+    size_t file_len; /* Bytes of the file written so far */
+};
+
+/*
+ * Create the pcap file at path and start the writer thread, keeping up to snaplen bytes of each frame (at most
+ * CAPTURE_SNAPLEN). Returns 0, or -1 with errno set
+ */
+int capture_open(struct capture *cap, const char *path, uint32_t snaplen);
+/*
+ * Stop the writer thread once it has written every frame in the ring, trim the file and close it.
+ * Only the producer may call it, after its last capture_frame
+ */
+void capture_close(struct capture *cap);
+
+/*
+ * Copy a frame into the ring. Only one thread may capture into a ring
+ */
+static inline void capture_frame(struct capture *cap, const char *frame, uint32_t len, uint64_t tsc)
+{
+    uint64_t added = cap->added.load(std::memory_order_relaxed);
+    if (added - cap->removed_cache >= CAPTURE_RING_SIZE)
+    {
+        cap->removed_cache = cap->removed.load(std::memory_order_acquire);
+        if (added - cap->removed_cache >= CAPTURE_RING_SIZE)
+        {
+            // the writer counts frames it cannot write here too
+            cap->dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+    }
+    struct capture_slot *slot = &cap->slots[added & (CAPTURE_RING_SIZE - 1)];
+    slot->tsc = tsc;
+    slot->len = len;
+    slot->caplen = len < cap->snaplen ? len : cap->snaplen;
+    memcpy(slot->data, frame, slot->caplen);
+    cap->added.store(added + 1, std::memory_order_release);
+}
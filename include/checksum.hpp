@@ -0,0 +1,50 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+    Internet checksum engine.
+    Sums are one's complement sums of 16 bit words as they lie in memory (network order), kept unfolded in 32 bits,
+    so they can be combined with precomputed header sums and stored without byte swapping.
+    The widest variant the CPU supports (AVX2, SSE4.2, or 64-bit scalar) is picked on first use.
+*/
+
+typedef uint32_t (*csum_partial_fn)(const void *buf, size_t len, uint32_t sum);
+typedef uint32_t (*csum_copy_fn)(void *dst, const void *src, size_t len, uint32_t sum);
+
+/* Add len bytes starting at buf to a one's complement sum, without folding */
+uint32_t csum_partial(const void *buf, size_t len, uint32_t sum);
+
+/* Copy len bytes from src to dst and add them to a one's complement sum in the same pass */
+uint32_t csum_copy_partial(void *dst, const void *src, size_t len, uint32_t sum);
+
+/* Name of the variant selected for this CPU */
+const char *csum_impl_name(void);
+
+/* Fold a 32 bit one's complement sum to 16 bits */
+static inline uint16_t csum_fold(uint32_t sum)
+{
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    return (uint16_t)sum;
+}
+
+/* Add the sum of a block that starts offset bytes into the summed data, for data gathered from several buffers.
+   A block at an odd offset has each byte in the other half of its word, so its folded sum is byte swapped */
+static inline uint32_t csum_block_add(uint32_t sum, uint32_t block, size_t offset)
+{
+    if (offset & 1)
+    {
+        block = csum_fold(block);
+        block = ((block & 0xFF) << 8) | (block >> 8);
+    }
+    return sum + block;
+}
+
+/* Individual variants, for benchmarking. The SIMD ones are NULL when the CPU or compiler lacks support */
+uint32_t csum_partial_scalar(const void *buf, size_t len, uint32_t sum);
+uint32_t csum_copy_partial_scalar(void *dst, const void *src, size_t len, uint32_t sum);
+extern const csum_partial_fn csum_partial_sse42;
+extern const csum_partial_fn csum_partial_avx2;
+extern const csum_copy_fn csum_copy_partial_sse42;
+extern const csum_copy_fn csum_copy_partial_avx2;
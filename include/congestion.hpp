@@ -0,0 +1,54 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+    Congestion control interface.
+    The stack tells the algorithm of a connection about every ACK that covers new data, every loss found by
+    duplicate ACKs and every retransmission timeout, and only sends new data while the bytes in flight fit in
+    cwnd (and in the window of the peer). The algorithms keep their state in the connection's cc_state, so
+    connections can run different ones. cc_newreno (RFC 5681, RFC 6582) and cc_cubic (RFC 9438) are provided.
+    Windows are counted in bytes, and grow by whole segments of mss bytes.
+*/
+
+#define CC_INITIAL_SEGS 10          /* Initial window in segments (RFC 6928) */
+#define CC_MIN_SEGS 2               /* ssthresh never goes below this many segments */
+#define CC_CUBIC_C 0.4              /* CUBIC scaling constant, in segments per second cubed */
+#define CC_CUBIC_BETA 0.7           /* CUBIC multiplicative decrease */
+
+struct cc_state
+{
+    uint32_t mss;
+    uint32_t cwnd;          /* Bytes that may be in flight */
+    uint32_t ssthresh;      /* Slow start below this window, congestion avoidance above */
+    uint32_t bytes_acked;   /* Bytes acknowledged towards the next segment of growth in congestion avoidance */
+    bool recovering;        /* In fast recovery, the window is held until the data in flight at the loss is acknowledged */
+    /* CUBIC */
+    uint32_t w_max;         /* Window before the last reduction */
+    uint64_t epoch_ns;      /* Start of the current congestion avoidance epoch, 0 before the first ACK of it */
+    double k_s;             /* Time from the start of the epoch for the curve to reach w_max again, in seconds */
+    double w_est;           /* Window standard TCP would have reached since then, the floor of the cubic curve */
+    double w_inc;           /* Growth towards the curve not applied yet, in bytes */
+};
+
+struct cc_ops
+{
+    const char *name;
+    /* Start from the initial window, for a peer that takes segments of mss bytes */
+    void (*init)(struct cc_state *cc, uint32_t mss);
+    /* acked new bytes were acknowledged outside recovery, at now_ns with the smoothed RTT srtt_ns (0 before a sample) */
+    void (*on_ack)(struct cc_state *cc, uint32_t acked, uint64_t now_ns, uint64_t srtt_ns);
+    /* A segment was found lost by duplicate ACKs with flight bytes outstanding, fast recovery starts */
+    void (*on_loss)(struct cc_state *cc, uint32_t flight);
+    /* The retransmission timer expired with flight bytes outstanding, the window restarts from one segment */
+    void (*on_timeout)(struct cc_state *cc, uint32_t flight);
+};
+
+extern const struct cc_ops cc_newreno;
+extern const struct cc_ops cc_cubic;
+
+/* Slow start increase shared by the algorithms, at most one segment per ACK (RFC 3465 with L = 1) */
+static inline void cc_slow_start(struct cc_state *cc, uint32_t acked)
+{
+    cc->cwnd += acked < cc->mss ? acked : cc->mss;
+}
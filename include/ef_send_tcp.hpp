@@ -1,45 +1,458 @@
-#include <etherfabric/vi.h>
-#include <etherfabric/pd.h>
-#include <etherfabric/memreg.h>
-#include <etherfabric/capabilities.h>
 #include "utils.h"
 #include "pkt_headers.hpp"
+#include "nic_backend.hpp"
+#include "neigh.hpp"
+#include "latency.hpp"
+#include "capture.hpp"
+#include "spsc_ring.hpp"
+#include "congestion.hpp"
+#include "fixed_session.hpp"
 #include <iostream>
 #include <tuple>
 #include <bitset>
 #include <chrono>
-#include <queue>
-#define PKT_BUF_SIZE 2048                                            // Size of each packet buffer
-#define RX_DMA_OFF ROUND_UP(sizeof(struct pkt_buf), EF_VI_DMA_ALIGN) // Offset of the RX DMA address
-#define RX_RING_SIZE 512                                             // Maximum number of receive requests in the RX ring
-#define TX_RING_SIZE 2048                                            // Maximum number of transmit requests in the TX ring
+#include <sys/uio.h>
+#include <thread>
+#include <pthread.h>
+#define PKT_BUF_SIZE 2048                                            // Default size of each packet buffer
+#define PKT_BUF_MIN_SIZE 1664                                        // Smallest packet buffer, a full frame with its receive prefix after the stagger
+#define PKT_BUF_SMALL_SIZE 256                                       // Size of the small TX buffers, for ACKs, control frames and short messages
+#define PKT_SMALL_BUFS 1024                                          // Default number of small TX buffers
+#define PKT_BUF_NONE UINT32_MAX                                      // End of a free list
+#define RX_RING_SIZE 512                                             // Default number of receive requests in the RX ring
+#define RX_QUEUE_SIZE 512                                            // Segments a connection holds for ef_read, power of 2
+#define TX_RING_SIZE 2048                                            // Default number of transmit requests in the TX ring
 #define REFILL_BATCH_SIZE 64                                         // Minimum number of buffers to refill the ring
+#define RTX_QUEUE_SIZE 1024                                          // Maximum number of unacknowledged segments
+#define RTO_INITIAL_NS 200000000ull                                  // Retransmission timeout before the first RTT sample
+#define RTO_MIN_NS 1000000ull                                        // Lower bound on the retransmission timeout
+#define RTO_MAX_NS 2000000000ull                                     // Upper bound on the retransmission timeout after backoff
+#define RTX_MAX_RETRIES 10                                           // Timeouts in a row before the connection is given up
+#define DUPACK_THRESHOLD 3                                           // Duplicate ACKs that trigger a fast retransmit
+#define MAX_PAYLOAD_SIZE 1460                                        // Largest payload sent in one segment
+#define OOO_MAX_SEGS 64                                              // Maximum number of out-of-order segments held, bounds the RX buffers kept off the ring
+#define MAX_CONNS 16                                                 // Maximum number of connections sharing the VI
+#define CONN_TABLE_SIZE 64                                           // Slots in the 4-tuple lookup table, a power of two of at least 4 * MAX_CONNS
+#define RCV_WSCALE 4                                                 // Window scale shift offered in the SYN, the window of a full RX queue fits in 16 bits at this scale
+#define TX_BATCH_MAX 32                                              // Frames held behind the doorbell before an open batch is flushed
+#define TX_BATCH_LATENCY_NS 20000ull                                 // Longest the oldest frame of an open batch is held
+#define ARP_TIMEOUT_NS 100000000ull                                  // Time to wait for an ARP reply before asking again
+#define ARP_RETRIES 3                                                // ARP requests sent before a next hop is given up on
+#define ACK_MAX_SEGS 16                                              // In-order segments left unacknowledged before an ACK goes out right away
+#define ACK_DELAY_NS 0ull                                            // Longest an ACK is held, 0 to send it at the end of each poll batch
+#define PACE_GAIN_SS_PCT 200                                         // Pacing rate in slow start, in percent of cwnd per smoothed RTT
+#define PACE_GAIN_CA_PCT 120                                         // Pacing rate in congestion avoidance, in percent of cwnd per smoothed RTT
+#define PACE_BURST_SEGS 2                                            // Segments a paced connection may send back to back after being idle
+#define WAIT_SPIN_NS 50000ull                                        // Spin before blocking, and the most the adaptive mode spins
+#define WAIT_SPIN_MIN_NS 1000ull                                     // Spin of the adaptive mode when events are further apart than WAIT_SPIN_NS
+#define WAIT_BLOCK_MAX_NS 100000000ull                               // Longest single block, so the timers still run on a quiet VI
+#define NET_MAX_CHANS 8                                              // Maximum number of application threads talking to the network thread
+#define NET_CMD_RING_SIZE 256                                        // Sends a channel can queue for the network thread, power of 2
+#define NET_EVENT_RING_SIZE 1024                                     // Events the network thread can queue for a channel, power of 2
 
+/*
+    Metadata of a packet buffer, kept apart from the DMA memory in a dense array indexed by buffer id.
+    The free lists and reference counts are touched by every send, completion and refill, so at 8 bytes a buffer
+    a burst of completions walks a cache line per 8 buffers, and never pulls a DMA buffer into the cache for its link.
+*/
 struct pkt_buf
 {
-    ef_addr rx_ef_addr;
-    ef_addr tx_ef_addr;
-    int64_t id;
-    struct pkt_buf *next;
-} __attribute__((packed));
+    uint32_t next; /* Next buffer on the free list of its class, PKT_BUF_NONE at the end */
+    int32_t refs;  /* TX only: held by the NIC until completion and by the retransmission queue until acknowledged */
+};
+
+/* Metadata read once per frame, in a second array so it does not dilute the one above */
+struct pkt_buf_cold
+{
+    nic_addr dma_addr; /* Address of the buffer's frame as seen by the NIC */
+    uint64_t rx_tsc;   /* RX only: time the RX event was polled */
+};
+
+/* A received segment waiting for ef_read: len payload bytes at offset off in packet buffer id */
+struct rx_desc
+{
+    uint32_t id;
+    uint16_t off;
+    uint16_t len;
+};
+
+/*
+    Ring of received segments waiting for ef_read, oldest first.
+    It only holds descriptors, the payload stays in the RX buffers. The descriptors live in the packet memory,
+    so queueing a segment never allocates and the ring of a connection spans a few cache lines at a time.
+*/
+struct rx_queue
+{
+    struct rx_desc *descs;
+    uint32_t head;
+    uint32_t tail;
+};
 
+/*
+    Packet buffer pool, in one region of huge pages when the system has them.
+    There are two size classes. Full buffers of buf_size bytes are posted on the RX ring and carry data segments,
+    small buffers of PKT_BUF_SMALL_SIZE bytes carry ACKs, SYNs, FINs, ARP and messages short enough to fit,
+    so the frames sent most often take four cache lines in a dense block rather than a 2 KiB slot each.
+    Buffer ids 0 to num - 1 are full buffers, num to num + num_small - 1 small ones.
+    The metadata arrays, the TX ring and the read queues of the connections are carved out of the same region,
+    after the buffers, so the whole data path fits in a few TLB entries.
+    The ring sizes and buf_size come from ef_config at initialization.
+*/
 struct pkt_bufs
 {
     void *mem;
     size_t mem_size;
-    int num;
-    struct pkt_buf *free_pool;
+    bool huge_pages;          /* mem is made of huge pages from mmap, rather than posix_memalign */
+    int rx_ring_size;
+    int tx_ring_size;
+    uint32_t buf_size;        /* Bytes of a full buffer */
+    int rx_prefix_len;        /* Bytes the NIC writes in front of every received frame */
+    int num;                  /* Full buffers */
+    int num_small;            /* Small buffers */
+    char *small_mem;          /* First small buffer, after the full ones */
+    struct pkt_buf *bufs;     /* Hot metadata of every buffer */
+    struct pkt_buf_cold *cold;
+    struct rx_desc *rx_descs; /* RX_QUEUE_SIZE descriptors for each connection */
+    uint32_t free_pool;       /* Free full buffers */
     int free_pool_n;
+    uint32_t free_small;      /* Free small buffers */
+    int free_small_n;
+    uint32_t rx_share;        /* Full buffers free or on the RX ring for each connection, as of the last refill */
+};
+
+struct tx_ring
+{
+    uint32_t *ids; /* Buffers owned by the NIC, in the order they were posted, tx_ring_size of them */
+    uint64_t *tsc; /* Time each of them was queued */
+    unsigned added;
+    unsigned removed;
+};
+
+/*
+    Doorbell batching.
+    Frames are queued on the NIC with transmit_init, and the doorbell is rung once for all of them with transmit_push.
+    Outside a batch that happens right after every frame. While a batch is open (depth > 0), it happens
+    when the batch closes, or earlier on the TX_BATCH_MAX or TX_BATCH_LATENCY_NS bound.
+*/
+struct tx_batch
+{
+    int depth;         /* Batches open, nested ones are part of the outermost */
+    int queued;        /* Frames queued on the NIC behind the doorbell */
+    uint64_t first_ns; /* Time the oldest of them was queued, while a batch is open */
+};
+
+/*
+    Latency stages, each with its own histogram.
+    The software stages are measured with the TSC on the way through the stack.
+    The wire stages compare the hardware timestamps of the NIC with the TSC, so they need hw_timestamps in ef_config
+    and a NIC clock synchronized to the system clock (e.g. by sfptpd).
+*/
+enum class LAT_STAGE : uint8_t
+{
+    SEND_TO_POST,     /* Send call entry to the frame queued on the NIC */
+    POST_TO_COMPLETE, /* Frame queued to its TX completion polled */
+    RX_TO_DELIVER,    /* RX event polled to the payload handed to the application */
+    POST_TO_WIRE,     /* Frame queued to leaving the NIC (hardware TX timestamp) */
+    WIRE_TO_RX,       /* Frame reaching the NIC (hardware RX timestamp) to its RX event polled */
+    WIRE_TO_WAKE,     /* Frame reaching the NIC to being polled by the thread it woke from a block, the wakeup latency */
+    COUNT,
+};
+
+/*
+    How the stack waits for the NIC when it has nothing else to do, in ef_wait and while connecting or closing.
+    SPIN polls without pause, for the lowest latency at the cost of a full core. BLOCK polls for spin_ns, then sleeps
+    in the NIC with its interrupt armed until an event arrives. ADAPTIVE does the same, with a spin budget that follows
+    the smoothed gap between events: twice the gap while that fits in spin_ns, so a busy session never sleeps,
+    and WAIT_SPIN_MIN_NS once events are further apart, so an idle one hardly spins at all.
+*/
+enum class WAIT_MODE : uint8_t
+{
+    SPIN,
+    BLOCK,
+    ADAPTIVE,
+};
+
+struct wait_policy
+{
+    WAIT_MODE mode;
+    uint64_t spin_ns;   /* BLOCK: spin before blocking. ADAPTIVE: upper bound on the spin budget */
+    uint64_t budget_ns; /* Spin of the next wait */
+    uint64_t gap_ns;    /* Smoothed time between waits that found events, 0 before the first two */
+    uint64_t last_tsc;  /* When the last wait found events */
+    bool woken;         /* The thread has just been woken from a block, the next RX event is its wakeup */
+};
+
+/*
+    Counters of the wait strategy. Like the latency histograms, they have a single writer and can be read from any thread.
+*/
+struct wait_stats
+{
+    std::atomic<uint64_t> spins;    /* Waits that found an event while spinning */
+    std::atomic<uint64_t> blocks;   /* Spin to block transitions, the spin budget ran out and the thread slept */
+    std::atomic<uint64_t> wakeups;  /* Blocks ended by an event, block to spin transitions */
+    std::atomic<uint64_t> timeouts; /* Blocks that ran out, to run the timers or at the end of the wait */
+};
+
+struct rtx_seg
+{
+    uint32_t seq;       /* First sequence number of the segment */
+    uint32_t end;       /* Sequence number after the segment, counting SYN and FIN */
+    uint32_t buf_id;    /* TX buffer still holding the frame */
+    uint16_t frame_len; /* Length of the frame in the buffer */
+};
+
+struct rtx_queue
+{
+    struct rtx_seg segs[RTX_QUEUE_SIZE]; /* Unacknowledged segments, oldest first */
+    unsigned head;
+    unsigned tail;
+    uint64_t deadline_ns;  /* Time the oldest segment is retransmitted, 0 when nothing is outstanding */
+    uint64_t rto_ns;
+    uint64_t srtt_ns;      /* Smoothed RTT, 0 before the first sample */
+    uint64_t rttvar_ns;
+    bool timing;           /* An RTT measurement is running on rtt_seq */
+    uint32_t rtt_seq;
+    uint64_t rtt_start_ns;
+    bool in_recovery;      /* Retransmitting after a loss until everything up to recover is acknowledged */
+    uint32_t recover;
+    int dupacks;
+    int retries;
+};
+
+struct ooo_seg
+{
+    uint32_t seq;  /* First sequence number still needed from the segment */
+    uint32_t end;  /* Sequence number after the segment */
+    uint32_t buf_id;
+    char *payload; /* Payload byte for seq, inside the RX buffer */
+};
+
+struct ooo_queue
+{
+    struct ooo_seg segs[OOO_MAX_SEGS]; /* Segments ahead of rcv_nxt, sorted by seq and not overlapping */
+    int n;
+};
+
+/* Sequence number comparisons that survive wrap around */
+static inline bool seq_lt(uint32_t a, uint32_t b) { return (int32_t)(a - b) < 0; }
+static inline bool seq_leq(uint32_t a, uint32_t b) { return (int32_t)(a - b) <= 0; }
+static inline bool seq_gt(uint32_t a, uint32_t b) { return (int32_t)(a - b) > 0; }
+static inline bool seq_geq(uint32_t a, uint32_t b) { return (int32_t)(a - b) >= 0; }
+
+struct ev_backlog
+{
+    struct nic_event *evs; /* Events set aside while waiting for TX space, room for a full RX ring and a poll */
+    unsigned size;
+    unsigned head;
+    unsigned tail;
+};
+
+/*
+    Handlers for the callback receive API, any of them may be NULL.
+    on_data gets in-order payload straight from the RX buffer, which is only valid for the duration of the call.
+    Without on_reset or on_close, a reset or close throws TcpResetException as it does for ef_read.
+    arg is passed back to every handler, e.g. to tell sessions sharing the same handlers apart.
+*/
+struct ef_callbacks
+{
+    void (*on_data)(void *arg, const char *data, size_t len);
+    void (*on_reset)(void *arg);
+    void (*on_close)(void *arg);
+    void *arg;
+};
+
+/*
+    A borrowed view of received payload, pointing straight into the RX buffer.
+    The buffer stays off the RX ring until the view is given back with ef_read_release.
+*/
+struct ef_rx_view
+{
+    const char *data;
+    size_t len;
+    uint32_t handle; /* Packet buffer id */
+};
+
+/*
+    A TX buffer lent to the application, to write a payload straight into DMA-visible memory.
+    data is right after the space kept for the headers, which are filled in by ef_send_commit.
+*/
+struct ef_tx_slot
+{
+    char *data;
+    size_t max_len;
+    uint32_t handle; /* Packet buffer id */
+};
+
+/*
+    Local endpoint of the stack, and the remote endpoint of the default connection.
+    Addresses are IPv4 in host byte order, like ports. Only the local MAC is configured,
+    the MAC of the next hop is resolved with ARP on the VI when a connection is set up.
+*/
+struct ef_config
+{
+    const char *intf;        /* Interface the VI is opened on */
+    uint8_t mac[ETH_ALEN];   /* MAC of the interface */
+    uint32_t addr;           /* Local IP address */
+    uint32_t netmask;        /* Peers outside addr/netmask are reached through the gateway */
+    uint32_t gateway;        /* 0 if every peer is on the local subnet */
+    uint32_t backup_gateway; /* Taken over when the gateway stops answering ARP, 0 for none */
+    uint32_t remote_addr;    /* Default connection, opened by ef_init_tcp_client */
+    uint16_t local_port;
+    uint16_t remote_port;
+    bool hw_timestamps;      /* Timestamp frames in the NIC, for the wire latency stages */
+    int rx_ring_size;        /* RX descriptors, a power of 2, 0 for RX_RING_SIZE */
+    int tx_ring_size;        /* TX descriptors, a power of 2, 0 for TX_RING_SIZE */
+    uint32_t buf_size;       /* Bytes of a packet buffer, a multiple of NIC_DMA_ALIGN of at least PKT_BUF_MIN_SIZE, 0 for PKT_BUF_SIZE */
+    int small_bufs;          /* Small TX buffers, 0 for PKT_SMALL_BUFS, negative for none */
+    bool sw_csum;            /* Compute and check every checksum in the stack, even where the NIC would */
+};
+
+/* Configuration of the lab setup the stack was written for (hftt1 -> exchange server), used by ef_init_tcp_client() */
+extern const struct ef_config ef_default_config;
+
+/* One message of ef_send_batch */
+struct ef_send_req
+{
+    struct tcp_conn *conn; /* NULL for the default connection */
+    const char *buf;
+    int len;
+};
+
+enum class NET_EVENT : uint8_t
+{
+    DATA,  /* len bytes of in-order payload in data */
+    RESET, /* The peer reset the connection */
+    CLOSE, /* The peer closed the connection */
+    ERROR, /* The network thread stopped on an error, described in data */
+};
+
+/* A send queued for the network thread */
+struct ef_net_cmd
+{
+    struct tcp_conn *conn; /* NULL for the default connection */
+    int len;
+    char data[MAX_PAYLOAD_SIZE];
+};
+
+/* An event from the network thread, for the connection it was subscribed with (NULL for the default connection) */
+struct ef_net_event
+{
+    NET_EVENT type;
+    struct tcp_conn *conn;
+    uint32_t len;
+    char data[MAX_PAYLOAD_SIZE];
+};
+
+/*
+    A channel between one application thread and the network thread: a ring of sends one way, and a ring of events
+    for the connections the channel subscribed to the other way.
+*/
+struct ef_net_chan
+{
+    struct spsc_ring<struct ef_net_cmd, NET_CMD_RING_SIZE> cmds;
+    struct spsc_ring<struct ef_net_event, NET_EVENT_RING_SIZE> events;
+};
+
+/* The channel a connection's events go to, and the handle the subscriber knows the connection by */
+struct net_sub
+{
+    struct ef_net_chan *chan;
+    struct tcp_conn *conn;
+};
+
+/*
+    The network thread, which owns the VI while it runs.
+    It takes sends from the channels and polls the NIC in a loop, and copies what arrives to the subscribed channels.
+*/
+struct net_thread
+{
+    std::thread thread;
+    std::atomic<bool> running;
+    struct ef_net_chan *chans[NET_MAX_CHANS];
+    int n_chans;
+    struct net_sub subs[MAX_CONNS + 1];
+    int n_subs;
+};
+
+/*
+    State of one TCP connection.
+    Every connection has its own sequence numbers, header template, retransmission and reassembly queues,
+    while the VI, the packet pool and the TX ring are shared by all of them.
+*/
+struct tcp_conn
+{
+    uint32_t snd_nxt;
+    uint32_t rcv_nxt;
+    uint32_t snd_una;
+    bool established;
+    uint32_t next_hop; /* Address whose MAC the frames are sent to, the peer itself or the gateway, network byte order */
+    struct ef_callbacks cbs;
+    struct pkt_hdr_template tx_tmpl;
+    struct rx_queue rxq;
+    struct rtx_queue rtx;
+    struct ooo_queue ooo;
+    uint32_t ack_pending;     /* In-order segments received since the last ACK sent */
+    uint64_t ack_deadline_ns; /* When the held ACK has to go out with a delay set, 0 if none is held */
+    uint16_t snd_mss;         /* Largest payload the peer takes in one segment, from its MSS option */
+    uint8_t snd_wscale;       /* Shift of the windows the peer advertises */
+    uint8_t rcv_wscale;       /* Shift of the windows advertised to the peer, 0 unless both sides scale */
+    bool sack_ok;             /* The peer accepts SACK blocks */
+    uint32_t snd_wnd;         /* Last window advertised by the peer, in bytes */
+    uint32_t rcv_adv;         /* Right edge of the window advertised to the peer */
+    const struct cc_ops *cc_ops; /* Congestion control, NULL to send regardless of congestion */
+    struct cc_state cc;
+    bool pacing;              /* Spread the segments of a window over the smoothed RTT */
+    uint64_t pace_next_tsc;   /* Earliest time the next segment leaves when pacing */
+    const struct fixed_ops *fixed_ops; /* Header builder and RX match of a session fixed at compile time, NULL for tx_tmpl */
+};
+
+/*
+    ACK coalescing.
+    In-order data is not acknowledged segment by segment. The ACK is held and sent once max_segs segments are waiting,
+    or at the end of the poll batch that received them, or with delay_ns set, delay_ns after the first of them.
+    Any frame sent on the connection in the meantime carries the ACK, which is then not sent on its own.
+    Out-of-order and duplicate segments are still acknowledged right away, for fast retransmit on the peer.
+*/
+struct ack_policy
+{
+    uint32_t max_segs; /* 1 acknowledges every segment */
+    uint64_t delay_ns;
+    uint32_t held;     /* Bit i is set while conns[i] holds an ACK */
 };
+static_assert(MAX_CONNS <= 32, "ack_policy.held has a bit per connection");
 
-struct vi
+/* Incoming 4-tuple of a connection, in network byte order as it appears in the headers */
+struct conn_key
 {
-    ef_driver_handle dh;
-    ef_pd pd;
-    ef_vi vi;
-    ef_memreg memreg;
-    unsigned int tx_outstanding;
-    uint64_t n_pkts;
+    uint32_t laddr;
+    uint32_t raddr;
+    uint16_t lport;
+    uint16_t rport;
+};
+
+/*
+    Open addressed table from 4-tuple to connection, with linear probing.
+    Slots are 16 bytes so four share a cache line, and the table is kept at most a quarter full,
+    so a lookup on the RX path normally touches a single line.
+*/
+struct conn_slot
+{
+    struct conn_key key;
+    int32_t conn; /* Index into the connection array, -1 if the slot is empty */
+};
+
+struct conn_table
+{
+    struct conn_slot slots[CONN_TABLE_SIZE];
+};
+
+/*
+    Connections with a fixed session, whose frames are recognised before the connection table is looked up.
+*/
+struct fixed_table
+{
+    struct tcp_conn *conns[MAX_CONNS];
+    int n;
 };
 
 class TcpResetException : public std::exception {
@@ -49,114 +462,212 @@ public:
     }
 };
 /*
-    This function returns a pointer to the packet buffer at index pkt_buf_i.
-    It casts the memory pointer to a pointer to a pkt_buf struct.
-    It then returns the pointer to the pkt_buf struct.
-    id -> pkt_buf struct
+* Initialize the EF_VI TCP interface with ef_default_config
 */
-static inline struct pkt_buf *pkt_buf_from_id(int pkt_buf_i);
+void ef_init_tcp_client();
 /*
-    This function returns the offset of the DMA address from the packet buffer.
-    It returns the offset of the DMA address from the packet buffer.
-    pkt_buf_i -> offset (not entirely important)
+* Initialize the TCP interface on the given NIC backend, e.g. &nic_loopback to run without a Solarflare card
 */
-static inline int addr_offset_from_id(int pkt_buf_i);
+void ef_init_tcp_client(const struct nic_backend *backend);
 /*
-    This function refills the RX ring.
-    It checks if the RX ring has enough space to refill the ring.
-    It also checks if there are enough free buffers to refill the ring.
-    If it does, it refills the ring.
-    If it doesn't, it returns.
+* Initialize the TCP interface with the given endpoints, and open the default connection to config->remote_addr
 */
-static void vi_refill_rx_ring(void);
+void ef_init_tcp_client(const struct ef_config *config);
+void ef_init_tcp_client(const struct nic_backend *backend, const struct ef_config *config);
 /*
-    This function frees a packet buffer.
-    It adds the packet buffer to the free pool.
-    pkt_buf -> free pool
-*/
-static inline void pkt_buf_free(struct pkt_buf *pkt_buf);
+ * Create a connection from local_port to remote_addr:remote_port (host byte order) on the shared VI and install its filter.
+ * The next hop is resolved with ARP by ef_connect.
+ * ef_init_tcp_client opens the default connection used by the functions without a connection argument
+ */
+struct tcp_conn *ef_conn_open(uint32_t remote_addr, uint16_t local_port, uint16_t remote_port);
 /*
-    This function initializes the packet buffers.
-    It sets the number of packet buffers to the sum of the RX and TX ring sizes.
-    It then sets the memory size to the number of packet buffers times the size of each packet buffer.
-    It then maps the memory to the packet buffers.
-    It then initializes the packet buffers.
-*/
-static int init_pkts_memory(void);
+ * Same, to the remote address of the configuration
+ */
+struct tcp_conn *ef_conn_open(uint16_t local_port, uint16_t remote_port);
 /*
-    This function initializes the virtual interface.
-    It sets the flags to the default flags.
-    It then opens the driver.
-    It then allocates the PD.
-    It then allocates the VI.
-    It then allocates the memory register.
-    It then initializes the packet buffers.
-    It then sets the filters to receive TCP packets.
-    It then returns 0.
-*/
-static int init(const char *intf);
-/**
- * @brief Send a packet with the given payload, payload length, flags, sequence number, and acknowledgment number and frees the buffer
- * Note: seq and ack are numbers to be sent with the packet
- * @param payload
- * @param payload_len
- * @param flags
- * @param seq
- * @param ack
+ * Switch to another gateway (host byte order) at runtime, e.g. to fail over to a backup.
+ * The gateway is resolved with ARP and every connection leaving the subnet is repointed at it
  */
-static void send_packet(char *payload, int payload_len, uint8_t flags, uint32_t seq, uint32_t ack);
+void ef_set_gateway(uint32_t gateway);
 /*
- * Receive a packet and verify the seq, ack, and flags are as expected
+ * Acknowledge received data once max_segs segments are waiting (1 for every segment), and otherwise at the end of each
+ * poll batch, or with delay_ns > 0, at most delay_ns after the first unacknowledged segment
  */
-static std::tuple<struct pkt_hdr *, uint32_t, uint8_t> receive_packet(uint8_t flags, uint32_t seq, uint32_t ack);
+void ef_set_ack_policy(uint32_t max_segs, uint64_t delay_ns);
 /*
- * Send a connection handshake
+ * Choose the congestion control of a connection, cc_newreno (the default) or cc_cubic.
+ * NULL sends regardless of congestion and without pacing, for sessions where latency matters more than anything else
  */
-static void send_connection_handshake();
+void ef_set_congestion(const struct cc_ops *ops);
+void ef_set_congestion(struct tcp_conn *c, const struct cc_ops *ops);
 /*
- * Send a TCP teardown
+ * Turn pacing of a connection on or off (the default). Paced segments are spread over the RTT rather than sent in bursts
  */
-static void send_tcp_teardown();
+void ef_set_pacing(bool on);
+void ef_set_pacing(struct tcp_conn *c, bool on);
 /*
- * Send a hello world packet
+ * Send and recognise the frames of a connected connection with a session fixed at compile time, e.g.
+ * ef_set_fixed(c, &fixed_session<...>::ops), or NULL to go back to the header template.
+ * Throws if the session's endpoints are not those of the connection, the peer does not take its MSS,
+ * or it leaves the checksums to a NIC that does not compute them. A session that stops matching, as its
+ * next hop moved, falls back to the header template
  */
-static void send_hello_world();
+void ef_set_fixed(const struct fixed_ops *ops);
+void ef_set_fixed(struct tcp_conn *c, const struct fixed_ops *ops);
 /*
-* Initialize the EF_VI TCP interface
-*/
-void ef_init_tcp_client();
+ * Add a permanent neighbor entry (host byte order address), for next hops that do not answer ARP
+ */
+void ef_neigh_add(uint32_t addr, const uint8_t *mac);
 /*
- * Connect to the server
+ * Connect to the server, resolving the next hop first if needed
  */
 void ef_connect();
+void ef_connect(struct tcp_conn *c);
 /*
  * Disconnect from the server
  */
 void ef_disconnect();
+void ef_disconnect(struct tcp_conn *c);
 /*
  * Read a packet
  */
 ssize_t ef_read(char* buf, int count);
+ssize_t ef_read(struct tcp_conn *c, char* buf, int count);
 /*
- * Reset the variables
+ * Borrow up to max_views views of received payload without copying, polling the NIC once if none is queued.
+ * Returns the number of views filled in, each must be given back with ef_read_release
  */
-void reset_variables();
+int ef_read_zc(struct ef_rx_view *views, int max_views);
+int ef_read_zc(struct tcp_conn *c, struct ef_rx_view *views, int max_views);
+/*
+ * Give a borrowed view back, returning its buffer to the pool and refilling the RX ring
+ */
+void ef_read_release(const struct ef_rx_view *view);
+/*
+ * Register the handlers called by ef_poll, or NULL to go back to ef_read
+ */
+void ef_set_callbacks(const struct ef_callbacks *callbacks);
+void ef_set_callbacks(struct tcp_conn *c, const struct ef_callbacks *callbacks);
+/*
+ * Poll the NIC once and dispatch received data of every connection to its handlers, returns the number of events handled
+ */
+int ef_poll();
+/*
+ * Choose how the stack waits for events: WAIT_MODE::SPIN (the default) polls without pause, BLOCK spins for spin_ns
+ * and then sleeps until the NIC interrupts, ADAPTIVE spins for a budget following the gaps between events, up to spin_ns
+ */
+void ef_set_wait_mode(WAIT_MODE mode, uint64_t spin_ns);
+/*
+ * Wait for events as the wait mode says, for up to timeout_ns (negative: forever), and handle them as ef_poll does.
+ * Returns the number of events handled, 0 on timeout
+ */
+int ef_wait(int64_t timeout_ns);
+/*
+ * Print the geometry of the packet pool, whether it got huge pages, and how many buffers of each class are free
+ */
+void ef_pool_dump(FILE *out);
+/*
+ * Print count, p50, p99, p99.9 and max of every latency stage, in ns, and the counters of the wait strategy.
+ * Can be called from any thread
+ */
+void ef_latency_dump(FILE *out);
+/*
+ * Forget every latency sample and wait counter, e.g. after warming up
+ */
+void ef_latency_reset();
+/*
+ * Start writing every frame sent and received to a pcap file at path, with nanosecond timestamps.
+ * The file is written by a background thread; frames are dropped rather than delaying the stack if it falls behind.
+ * A snaplen keeps only the first snaplen bytes of each frame, which is cheaper for large frames
+ */
+void ef_capture_start(const char *path);
+void ef_capture_start(const char *path, uint32_t snaplen);
+/*
+ * Stop the capture once every captured frame is in the file
+ */
+void ef_capture_stop();
+/*
+ * Number of frames the current or last capture could not keep
+ */
+uint64_t ef_capture_dropped();
+/*
+ * Number of received frames dropped since init, as the NIC discarded them or their lengths or checksums were wrong
+ */
+uint64_t ef_rx_discarded();
 /*
- * Send a reset
+ * Open a channel for an application thread to use the stack through the network thread. Called before ef_net_start.
+ * Each channel has one sending and polling thread
  */
-static void send_reset();
+struct ef_net_chan *ef_net_open();
+/*
+ * Send the events of connection c (NULL for the default connection) to a channel. Called before ef_net_start
+ */
+void ef_net_subscribe(struct ef_net_chan *chan, struct tcp_conn *c);
+/*
+ * Start the network thread, pinned to cpu unless it is negative. Until ef_net_stop, the stack is only used
+ * through the channels: the network thread spins on the NIC, sends what the channels queue and delivers what arrives
+ */
+void ef_net_start(int cpu);
+/*
+ * Stop the network thread once it has sent everything queued, handing the stack back to the calling thread
+ */
+void ef_net_stop();
+/*
+ * Queue a message of up to MAX_PAYLOAD_SIZE bytes on connection c (NULL for the default connection).
+ * Returns len, or -1 with errno EAGAIN if the channel is full
+ */
+ssize_t ef_net_send(struct ef_net_chan *chan, struct tcp_conn *c, const char *buf, int len);
+/*
+ * Queue n messages, made visible to the network thread together. Returns the number queued, fewer if the channel filled up
+ */
+int ef_net_send_batch(struct ef_net_chan *chan, const struct ef_send_req *reqs, int n);
+/*
+ * Get up to max_evs events of the channel. They stay valid until the next ef_net_poll on the channel
+ */
+int ef_net_poll(struct ef_net_chan *chan, const struct ef_net_event **evs, int max_evs);
+/*
+ * Reset the variables
+ */
+void reset_variables();
 /*
  * Send a packet
  */
 ssize_t ef_send(char* buf, int len);
+ssize_t ef_send(struct tcp_conn *c, char* buf, int len);
+/*
+ * Send a message gathered from iovcnt buffers, split into segments of up to MAX_PAYLOAD_SIZE bytes that are all
+ * handed to the NIC with one doorbell. Returns the number of bytes sent
+ */
+ssize_t ef_sendv(const struct iovec *iov, int iovcnt);
+ssize_t ef_sendv(struct tcp_conn *c, const struct iovec *iov, int iovcnt);
+/*
+ * Open a batch: frames sent until the matching ef_batch_end, including ACKs, are queued on the NIC
+ * and the doorbell is rung once for all of them (or earlier, after TX_BATCH_MAX frames or TX_BATCH_LATENCY_NS).
+ * Batches nest
+ */
+void ef_batch_begin();
+/*
+ * Close a batch, ringing the doorbell for everything queued when the outermost one closes
+ */
+void ef_batch_end();
+/*
+ * Send n messages of up to MAX_PAYLOAD_SIZE bytes, possibly on different connections, with one doorbell.
+ * Returns the number of bytes sent
+ */
+ssize_t ef_send_batch(const struct ef_send_req *reqs, int n);
+/*
+ * Acquire a TX buffer to encode a payload of up to slot->max_len bytes in place at slot->data
+ */
+void ef_send_acquire(struct ef_tx_slot *slot);
 /*
- * Poll events for incoming packets when data is immediately wanted
+ * Send the first len bytes written at slot->data, filling in the headers around them without copying
  */
-static void poll_events(char *buf, ssize_t& read, int len);
+ssize_t ef_send_commit(struct ef_tx_slot *slot, int len);
+ssize_t ef_send_commit(struct tcp_conn *c, struct ef_tx_slot *slot, int len);
 /*
- * Poll events for incoming packets when data is not immediately wanted
+ * Give an acquired TX buffer back without sending anything
  */
-static void poll_events();
+void ef_send_abort(struct ef_tx_slot *slot);
 
 void dump_buffer(const uint8_t *buf, size_t len);
 
@@ -0,0 +1,159 @@
+#pragma once
+#include "pkt_headers.hpp"
+#include "checksum.hpp"
+#include <stddef.h>
+
+/*
+    Sessions whose endpoints are fixed at compile time.
+    A connection normally builds its frames from a header template filled in at run time, and finds the connection of a
+    received frame by hashing its 4-tuple. When the MACs, addresses and ports of a session are known when the program is
+    built, fixed_session bakes the header bytes and the constant part of the checksums (the pseudo-header, the ports and
+    the data offset) into the binary. Sending then copies a constant header and folds in the per-packet fields, and the
+    receive path recognises the session's frames with a handful of compares against constants, before any lookup.
+    Frames it does not recognise (options, another 4-tuple, a bad checksum) take the normal path.
+    The stack reaches the session through its fixed_ops, set on a connection with ef_set_fixed(c, &session::ops), which
+    checks that the connection really has the endpoints the session was built for.
+    MACs are 48 bit values, e.g. 0x000f535a4da1, and addresses and ports are in host byte order.
+*/
+
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__, "fixed_session sums headers as little endian words");
+
+/*
+    Who computes the checksums of a fixed session.
+    SOFTWARE fills them in on TX and checks them on RX. OFFLOAD leaves both to the NIC, which fills them in as frames
+    leave and discards received frames whose checksums are wrong, so neither direction reads the payload for them.
+*/
+enum class CSUM_MODE : uint8_t
+{
+    SOFTWARE,
+    OFFLOAD,
+};
+
+struct fixed_ops
+{
+    const uint8_t *hdr; /* Header the session sends, with tot_len, seq, ack, flags, window and checksums zero */
+    uint16_t mss;       /* Largest payload the session sends, the peer has to accept it */
+    CSUM_MODE csum;
+    /* Whether a received frame of len bytes is a segment of the session with a plain 20 byte IP and TCP header, an IP
+       total length that fits in len (and right checksums) */
+    bool (*rx_match)(const struct pkt_hdr *hdr, uint32_t len);
+    /* Build the headers in front of payload_len bytes already in the frame, whose unfolded sum is payload_sum
+       (unused with OFFLOAD). window is in network byte order */
+    void (*tx_build)(char *frame, uint32_t payload_sum, uint32_t payload_len, uint8_t flags, uint32_t seq, uint32_t ack, uint16_t window);
+};
+
+struct fixed_hdr
+{
+    uint8_t b[sizeof(struct pkt_hdr)];
+};
+
+/* Store the n low bytes of v at p, most significant first */
+static constexpr void fixed_put(uint8_t *p, uint64_t v, int n)
+{
+    for (int i = 0; i < n; ++i)
+        p[i] = (uint8_t)(v >> (8 * (n - 1 - i)));
+}
+
+/* The n bytes at off as a load from memory would see them */
+static constexpr uint64_t fixed_load(const struct fixed_hdr &h, size_t off, int n)
+{
+    uint64_t v = 0;
+    for (int i = 0; i < n; ++i)
+        v |= (uint64_t)h.b[off + i] << (8 * i);
+    return v;
+}
+
+/* Unfolded one's complement sum of len bytes at off, over words in memory order like csum_partial */
+static constexpr uint32_t fixed_sum(const struct fixed_hdr &h, size_t off, size_t len)
+{
+    uint32_t sum = 0;
+    for (size_t i = 0; i < len; i += 2)
+        sum += (uint32_t)fixed_load(h, off + i, 2);
+    return sum;
+}
+
+/* Header of a frame from src to dst, with the constant fields of pkt_hdr and every per-packet field zero */
+static constexpr struct fixed_hdr fixed_hdr_build(uint64_t src_mac, uint64_t dst_mac, uint32_t src_addr, uint32_t dst_addr,
+                                                  uint16_t src_port, uint16_t dst_port)
+{
+    struct fixed_hdr h = {};
+    fixed_put(&h.b[offsetof(struct pkt_hdr, eth.dst_mac)], dst_mac, ETH_ALEN);
+    fixed_put(&h.b[offsetof(struct pkt_hdr, eth.src_mac)], src_mac, ETH_ALEN);
+    fixed_put(&h.b[offsetof(struct pkt_hdr, eth.ether_type)], ETH_P_IP, 2);
+    h.b[offsetof(struct pkt_hdr, ip.version_ihl)] = 0x45;
+    fixed_put(&h.b[offsetof(struct pkt_hdr, ip.id)], 0x00fc, 2);
+    h.b[offsetof(struct pkt_hdr, ip.ttl)] = 0x40;
+    h.b[offsetof(struct pkt_hdr, ip.protocol)] = IPPROTO_TCP;
+    fixed_put(&h.b[offsetof(struct pkt_hdr, ip.src_addr)], src_addr, 4);
+    fixed_put(&h.b[offsetof(struct pkt_hdr, ip.dst_addr)], dst_addr, 4);
+    fixed_put(&h.b[offsetof(struct pkt_hdr, tcp.src_port)], src_port, 2);
+    fixed_put(&h.b[offsetof(struct pkt_hdr, tcp.dst_port)], dst_port, 2);
+    h.b[offsetof(struct pkt_hdr, tcp.data_off_reserved)] = 0x50;
+    return h;
+}
+
+template <uint64_t SRC_MAC, uint64_t DST_MAC, uint32_t SRC_ADDR, uint32_t DST_ADDR, uint16_t SRC_PORT, uint16_t DST_PORT,
+          uint16_t MSS = 1460, CSUM_MODE CSUM = CSUM_MODE::SOFTWARE>
+struct fixed_session
+{
+    /* What the session sends, and what the peer sends back */
+    static constexpr struct fixed_hdr tx_hdr = fixed_hdr_build(SRC_MAC, DST_MAC, SRC_ADDR, DST_ADDR, SRC_PORT, DST_PORT);
+    static constexpr struct fixed_hdr rx_hdr = fixed_hdr_build(DST_MAC, SRC_MAC, DST_ADDR, SRC_ADDR, DST_PORT, SRC_PORT);
+    /* Sum of the IP header without tot_len and check */
+    static constexpr uint32_t ip_sum = fixed_sum(tx_hdr, offsetof(struct pkt_hdr, ip), sizeof(struct ip_hdr));
+    /* Sum of the pseudo-header addresses and protocol, the same both ways */
+    static constexpr uint32_t pseudo_sum = fixed_sum(tx_hdr, offsetof(struct pkt_hdr, ip.src_addr), 2 * sizeof(uint32_t)) + (IPPROTO_TCP << 8);
+    /* pseudo_sum and the TCP header without seq, ack, flags, window and check */
+    static constexpr uint32_t tcp_sum = pseudo_sum + fixed_sum(tx_hdr, offsetof(struct pkt_hdr, tcp.src_port), 2 * sizeof(uint16_t)) + 0x50;
+    /* Fields a segment from the peer has, as loads see them */
+    static constexpr uint16_t rx_ether_type = fixed_load(rx_hdr, offsetof(struct pkt_hdr, eth.ether_type), 2);
+    static constexpr uint64_t rx_addrs = fixed_load(rx_hdr, offsetof(struct pkt_hdr, ip.src_addr), 8);
+    static constexpr uint32_t rx_ports = fixed_load(rx_hdr, offsetof(struct pkt_hdr, tcp.src_port), 4);
+
+    static bool rx_match(const struct pkt_hdr *hdr, uint32_t len)
+    {
+        uint64_t addrs;
+        uint32_t ports;
+        memcpy(&addrs, &hdr->ip.src_addr, sizeof(addrs));
+        memcpy(&ports, &hdr->tcp.src_port, sizeof(ports));
+        if (addrs != rx_addrs || ports != rx_ports || hdr->eth.ether_type != rx_ether_type || hdr->ip.version_ihl != 0x45 ||
+            hdr->ip.protocol != IPPROTO_TCP || hdr->tcp.data_off_reserved != 0x50)
+            return false;
+        // the payload length comes from tot_len, so it has to cover the headers and stay inside the frame
+        uint32_t tot_len = ntohs(hdr->ip.tot_len);
+        if (tot_len < sizeof(struct ip_hdr) + sizeof(struct tcp_hdr) || tot_len + sizeof(struct eth_hdr) > len)
+            return false;
+        if constexpr (CSUM == CSUM_MODE::OFFLOAD)
+            return true;
+        // a correct header or segment sums to 0xFFFF with its checksum field included
+        uint16_t tcp_len = (uint16_t)(tot_len - sizeof(struct ip_hdr));
+        if (csum_fold(csum_partial(&hdr->ip, sizeof(struct ip_hdr), 0)) != 0xFFFF)
+            return false;
+        return csum_fold(csum_partial(&hdr->tcp, tcp_len, pseudo_sum + htons(tcp_len))) == 0xFFFF;
+    }
+
+    static void tx_build(char *frame, uint32_t payload_sum, uint32_t payload_len, uint8_t flags, uint32_t seq, uint32_t ack, uint16_t window)
+    {
+        struct pkt_hdr *hdr = (struct pkt_hdr *)frame;
+        uint16_t tcp_len = (uint16_t)(sizeof(struct tcp_hdr) + payload_len);
+        uint16_t tot_len = htons((uint16_t)(sizeof(struct ip_hdr) + tcp_len));
+        uint32_t seq_n = htonl(seq);
+        uint32_t ack_n = htonl(ack);
+
+        memcpy(frame, tx_hdr.b, sizeof(tx_hdr.b));
+        hdr->ip.tot_len = tot_len;
+        hdr->tcp.seq_num = seq_n;
+        hdr->tcp.ack_num = ack_n;
+        hdr->tcp.flags = flags;
+        hdr->tcp.window = window;
+        if constexpr (CSUM == CSUM_MODE::OFFLOAD)
+            return;
+        hdr->ip.check = (uint16_t)~csum_fold(ip_sum + tot_len);
+        // the flags are the high byte of the word they share with the data offset
+        uint32_t sum = tcp_sum + htons(tcp_len) + ((uint32_t)flags << 8) + window + payload_sum;
+        sum += (seq_n >> 16) + (seq_n & 0xFFFF) + (ack_n >> 16) + (ack_n & 0xFFFF);
+        hdr->tcp.check = (uint16_t)~csum_fold(sum);
+    }
+
+    static constexpr struct fixed_ops ops = {tx_hdr.b, MSS, CSUM, rx_match, tx_build};
+};
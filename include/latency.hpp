@@ -0,0 +1,90 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <atomic>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/*
+    Latency measurement.
+    Timestamps are raw TSC reads, converted to nanoseconds only when results are read, so taking one costs a few ns.
+    Samples go into HDR (high dynamic range) histograms: values below HDR_SUB_COUNT are counted exactly,
+    above that each power of two is split into HDR_SUB_COUNT / 2 buckets, so every value is kept to within 1/64.
+    A histogram has a single writer, the thread running the stack, and any number of readers.
+    Counters are atomics updated with plain relaxed stores, so dumping from another thread never blocks or locks the bus.
+*/
+
+#define HDR_SUB_BITS 7                      /* 128 exact values, then 64 buckets per power of two */
+#define HDR_SUB_COUNT (1u << HDR_SUB_BITS)
+#define HDR_MAX_BITS 48                     /* Values are clamped below 2^48 */
+#define HDR_BUCKETS (HDR_SUB_COUNT + (HDR_MAX_BITS - HDR_SUB_BITS) * (HDR_SUB_COUNT / 2))
+
+struct hdr_hist
+{
+    std::atomic<uint64_t> counts[HDR_BUCKETS];
+    std::atomic<uint64_t> total;
+    std::atomic<uint64_t> max;
+};
+
+/* Read the time stamp counter, or a nanosecond clock where there is none */
+static inline uint64_t tsc_now(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+/*
+ * Measure the TSC frequency against the system clock, spinning for about 10 ms. Called once at startup
+ */
+void tsc_calibrate(void);
+/*
+ * Convert a number of TSC ticks to nanoseconds
+ */
+uint64_t tsc_to_ns(uint64_t ticks);
+/*
+ * Convert nanoseconds to a number of TSC ticks
+ */
+uint64_t ns_to_tsc(uint64_t ns);
+/*
+ * Convert a TSC read to CLOCK_REALTIME nanoseconds, the clock hardware timestamps are synchronized to
+ */
+uint64_t tsc_to_realtime_ns(uint64_t tsc);
+
+/* Bucket of a value, see the layout above */
+static inline unsigned hdr_index(uint64_t v)
+{
+    if (v < HDR_SUB_COUNT)
+        return (unsigned)v;
+    if (v >> HDR_MAX_BITS)
+        v = (1ull << HDR_MAX_BITS) - 1;
+    unsigned shift = 63 - __builtin_clzll(v) - (HDR_SUB_BITS - 1);
+    return HDR_SUB_COUNT + (shift - 1) * (HDR_SUB_COUNT / 2) + (unsigned)((v >> shift) - HDR_SUB_COUNT / 2);
+}
+
+/*
+ * Add a sample. Only one thread may record into a histogram
+ */
+static inline void hdr_record(struct hdr_hist *h, uint64_t v)
+{
+    std::atomic<uint64_t> *c = &h->counts[hdr_index(v)];
+    c->store(c->load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    h->total.store(h->total.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    if (v > h->max.load(std::memory_order_relaxed))
+        h->max.store(v, std::memory_order_relaxed);
+}
+
+/*
+ * Value that p percent of the samples are at or below, e.g. p = 99.9. 0 if there are no samples
+ */
+uint64_t hdr_percentile(const struct hdr_hist *h, double p);
+/*
+ * Forget every sample. Samples recorded at the same time may be lost
+ */
+void hdr_reset(struct hdr_hist *h);
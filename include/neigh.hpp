@@ -0,0 +1,39 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <net/ethernet.h>
+
+/*
+    Neighbor cache, mapping next hop IPv4 addresses to the MAC addresses learned through ARP.
+    It is only consulted when a connection is set up or a next hop changes. The MAC is then copied into
+    the header templates of the connections behind it, so the send path never looks anything up.
+*/
+
+#define NEIGH_CACHE_SIZE 32 /* Next hops remembered at once */
+
+struct neigh_entry
+{
+    uint32_t addr; /* IPv4 address, network byte order, 0 if the entry is unused */
+    uint8_t mac[ETH_ALEN];
+    bool permanent; /* Added by hand, never changed by ARP */
+};
+
+struct neigh_cache
+{
+    struct neigh_entry entries[NEIGH_CACHE_SIZE];
+    unsigned victim; /* Next entry to replace when the cache is full */
+};
+
+/*
+ * Find the entry for addr (network byte order), NULL if it has not been resolved
+ */
+const struct neigh_entry *neigh_lookup(const struct neigh_cache *cache, uint32_t addr);
+/*
+ * Record that addr is at mac. An existing entry is always updated, a new one is only created if create is set
+ * (RFC 826: only hosts that talk to us, or that we asked for, are added). Returns true if addr now maps to a new MAC
+ */
+bool neigh_update(struct neigh_cache *cache, uint32_t addr, const uint8_t *mac, bool create);
+/*
+ * Add or replace a permanent entry, which ARP frames will not change
+ */
+void neigh_add_permanent(struct neigh_cache *cache, uint32_t addr, const uint8_t *mac);
@@ -0,0 +1,113 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+    NIC backend interface.
+    The TCP stack only talks to the NIC through one of these, so the same code can run
+    against a Solarflare card (nic_efvi) or against an in-process peer simulator (nic_loopback)
+    on any Linux host. Each backend keeps its own state in file scope, like the stack does.
+*/
+
+typedef uint64_t nic_addr;  /* Address of a buffer as seen by the NIC (ef_addr for ef_vi) */
+
+#define NIC_DMA_ALIGN 64    /* Alignment of DMA buffers, same as EF_VI_DMA_ALIGN */
+#define NIC_POLL_MAX_EVS 16 /* Maximum number of events returned by a single poll */
+#define NIC_INIT_TIMESTAMPS 0x1 /* init flag: timestamp frames in hardware, as they leave and reach the wire */
+#define NIC_INIT_SW_CSUM 0x2    /* init flag: the stack computes and checks every checksum, the NIC touches none of them */
+#define NIC_OFFLOAD_TX_CSUM 0x1 /* offloads: the NIC fills in the IP and TCP checksums of every frame it sends */
+#define NIC_OFFLOAD_RX_CSUM 0x2 /* offloads: the NIC checks the IP and TCP checksums of received frames, bad ones come as RX_DISCARD */
+
+enum class NIC_EVENT : uint16_t
+{
+    RX,         /* A frame has been received into buffer id */
+    TX,         /* len transmit requests have completed, in the order they were posted, the last one being id */
+    TX_ERROR,   /* A transmit request failed */
+    RX_DISCARD, /* A frame was received into buffer id but discarded by the NIC, e.g. for a bad checksum. flags is the backend's reason */
+};
+
+struct nic_event
+{
+    NIC_EVENT type;
+    uint16_t flags;
+    uint32_t id;  /* RX: request id of the filled buffer. TX: request id of the last completed transmit */
+    uint32_t len; /* RX: number of bytes written, including the receive prefix. TX: number of completed transmits */
+    uint64_t hw_ns; /* TX: hardware timestamp of the last completed transmit, ns since the epoch, 0 if there is none */
+};
+
+struct nic_backend
+{
+    const char *name;
+    /* Open the interface, allocate rings of the given sizes and register mem for DMA.
+       The NIC writes at most rx_buf_len bytes into a posted RX buffer, prefix included. flags are NIC_INIT_* */
+    int (*init)(const char *intf, void *mem, size_t mem_size, int rxq_size, int txq_size, int rx_buf_len, unsigned flags);
+    /* DMA address of the byte at offset in the registered memory */
+    nic_addr (*dma_addr)(size_t offset);
+    /* Number of bytes the NIC writes in front of every received frame */
+    int (*rx_prefix_len)(void);
+    /* NIC_OFFLOAD_* the interface does, as opened by init */
+    unsigned (*offloads)(void);
+    /* Hardware timestamp of a received frame from its receive prefix at dma, in ns since the epoch, 0 if there is none */
+    uint64_t (*rx_timestamp)(const void *dma);
+    /* Number of RX descriptors that can still be posted */
+    int (*rx_space)(void);
+    /* Queue an RX buffer, made visible to the NIC by rx_push */
+    int (*rx_post)(nic_addr addr, uint32_t id);
+    void (*rx_push)(void);
+    /* Transmit len bytes at addr, id is reported back on completion. The buffer belongs to the NIC until then */
+    int (*transmit)(nic_addr addr, int len, uint32_t id);
+    /* Queue a transmit without telling the NIC, transmit_push then sends everything queued with one doorbell */
+    int (*transmit_init)(nic_addr addr, int len, uint32_t id);
+    void (*transmit_push)(void);
+    /* Poll for up to max_evs events, never more than NIC_POLL_MAX_EVS */
+    int (*poll)(struct nic_event *evs, int max_evs);
+    /* Sleep until the NIC has an event for poll, with its interrupt armed, or timeout_ns has passed.
+       Returns 1 if an event may be waiting, 0 on timeout, negative on error */
+    int (*wait)(uint64_t timeout_ns);
+    /* Steer TCP frames for the given 4-tuple (network byte order) to this interface */
+    int (*filter_add)(uint32_t laddr, uint16_t lport, uint32_t raddr, uint16_t rport);
+    /* Steer frames of ether_type (network byte order) sent to mac to this interface, e.g. ARP for the local and broadcast MACs */
+    int (*filter_add_eth)(const uint8_t *mac, uint16_t ether_type);
+};
+
+#ifndef EF_TCP_NO_EFVI
+extern const struct nic_backend nic_efvi;
+#endif
+extern const struct nic_backend nic_loopback;
+
+/*
+    The loopback backend runs a minimal TCP peer on the other end of the wire, for every connection of the stack.
+    It answers the handshake and teardown, acknowledges every in-order segment,
+    sends a duplicate ACK for every out-of-order one, and can be told to send data to the stack.
+    It answers ARP requests for any address with NIC_LOOPBACK_PEER_MAC, and drops TCP frames sent to any other MAC.
+*/
+#define NIC_LOOPBACK_PEER_MAC {0x00, 0x0f, 0x53, 0x4b, 0xe6, 0xb1}
+/*
+ * Queue a data segment from the simulated peer, delivered on the next poll
+ */
+void nic_loopback_inject(const char *payload, size_t len);
+/*
+ * Same, for the connection with the given local port when the stack has several
+ */
+void nic_loopback_inject(uint16_t local_port, const char *payload, size_t len);
+/*
+ * Make the simulated peer echo every data segment it receives
+ */
+void nic_loopback_set_echo(bool echo);
+/*
+ * Make the simulated peer deliver every pair of injected segments in swapped order
+ */
+void nic_loopback_set_reorder(bool reorder);
+/*
+ * Drop every nth data segment sent by the stack before the peer sees it, 0 to drop nothing
+ */
+void nic_loopback_set_drop(unsigned every);
+/*
+ * Flip a payload bit in every nth data segment the simulated peer sends, after computing its checksums, 0 for none.
+ * With NIC_OFFLOAD_RX_CSUM the loopback NIC discards those frames as a real one would. The peer does not retransmit them
+ */
+void nic_loopback_set_corrupt(unsigned every);
+/*
+ * Make the simulated peer ignore ARP requests for addr (host byte order), e.g. to test gateway failover, 0 to answer all
+ */
+void nic_loopback_set_arp_ignore(uint32_t addr);
@@ -1,10 +1,13 @@
+#pragma once
 #include <stdint.h>
 #include <string.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
 #include <netinet/tcp.h>
 #include <net/ethernet.h>
+#include <net/if_arp.h>
 #include <iostream>
+#include "checksum.hpp"
 
 /* Ethernet header */
 
@@ -18,10 +21,9 @@ enum class TCP_FLAGS: uint8_t {
 
 struct eth_hdr
 {
-    // swap the mac addresses
-    uint8_t dst_mac[ETH_ALEN] = {0x00, 0x0f, 0x53, 0x4b, 0xe6, 0xb1}; /* Destination MAC address */
-    uint8_t src_mac[ETH_ALEN] = {0x00, 0x0f, 0x53, 0x5a, 0x4d, 0xa1}; /* Source MAC address */
-    uint16_t ether_type = htons(ETH_P_IP);                            /* EtherType (e.g., ETH_P_IP) */
+    uint8_t dst_mac[ETH_ALEN] = {};         /* Destination MAC address, of the next hop */
+    uint8_t src_mac[ETH_ALEN] = {};         /* Source MAC address */
+    uint16_t ether_type = htons(ETH_P_IP);  /* EtherType (e.g., ETH_P_IP) */
 } __attribute__((packed));
 
 /* IP header */
@@ -35,8 +37,8 @@ struct ip_hdr
     uint8_t ttl = 0x40;                               /* Time to Live */
     uint8_t protocol = IPPROTO_TCP;                   /* Protocol (e.g., IPPROTO_TCP) */
     uint16_t check = 0; /* Header Checksum */         // MODIFICATION
-    uint32_t src_addr = htonl(0xc0a80d17);            /* Source Address */
-    uint32_t dst_addr = htonl(0xc0a80d0a);            /* Destination Address */
+    uint32_t src_addr = 0;                            /* Source Address */
+    uint32_t dst_addr = 0;                            /* Destination Address */
 } __attribute__((packed));
 
 /* TCP header */
@@ -60,19 +62,161 @@ struct pkt_hdr
     struct tcp_hdr tcp;
 } __attribute__((packed));
 
+/* ARP header for IPv4 over Ethernet (RFC 826) */
+struct arp_hdr
+{
+    uint16_t htype = htons(ARPHRD_ETHER); /* Hardware type */
+    uint16_t ptype = htons(ETH_P_IP);     /* Protocol type */
+    uint8_t hlen = ETH_ALEN;              /* Hardware address length */
+    uint8_t plen = 4;                     /* Protocol address length */
+    uint16_t oper;                        /* ARPOP_REQUEST or ARPOP_REPLY */
+    uint8_t sha[ETH_ALEN];                /* Sender MAC address */
+    uint32_t spa;                         /* Sender IP address */
+    uint8_t tha[ETH_ALEN];                /* Target MAC address, ignored in a request */
+    uint32_t tpa;                         /* Target IP address */
+} __attribute__((packed));
+
+struct arp_pkt
+{
+    struct eth_hdr eth;
+    struct arp_hdr arp;
+} __attribute__((packed));
+
+#define ARP_FRAME_LEN 60 /* ARP frames are padded to the shortest Ethernet frame */
+#define TCP_OPTS_MAX_LEN 40 /* Most option bytes a TCP header holds, data offset 15 */
+#define TCP_DEFAULT_MSS 536 /* MSS assumed when the peer sends none (RFC 9293) */
+#define TCP_MAX_WSCALE 14   /* Largest window scale shift (RFC 7323) */
+
+/* TCP options carried by a SYN, or found in a received header */
+struct tcp_opts
+{
+    uint16_t mss = 0;     /* Maximum segment size, 0 if absent */
+    int8_t wscale = -1;   /* Window scale shift, -1 if absent */
+    bool sack_ok = false; /* SACK permitted */
+    bool ts_ok = false;   /* Timestamps, with ts_val and ts_ecr */
+    uint32_t ts_val = 0;
+    uint32_t ts_ecr = 0;
+};
+
 /* Compute checksum for count bytes starting at addr, using one's complement of one's complement sum*/
 unsigned short compute_checksum(unsigned short *addr, unsigned int count);
 void compute_ip_checksum(struct ip_hdr *ip_hdr);
 uint16_t tcp_checksum(struct pkt_hdr *pkt, size_t payload_len, size_t total_len);
+/* Check that a received IPv4 TCP frame of len bytes, from the Ethernet header on, has an IHL of 5 words (no IP options),
+   a data offset of at least 5 words, and an IP total length that covers both headers and fits in the frame */
+bool tcp_frame_ok(const struct pkt_hdr *hdr, size_t len);
+/* Check the lengths (as tcp_frame_ok) and the IP and TCP checksums of a received frame of len bytes */
+bool tcp_checksums_ok(const struct pkt_hdr *hdr, size_t len);
+
+/*
+    Cached header for one connection.
+    Every field that stays the same for the 4-tuple (MACs, IPs, ports, TTL, data offset) is filled in once, as well as the
+    window, which only changes when pkt_hdr_template_set_window is called,
+    and the one's complement sums over those fields are kept so that a send only has to fold in
+    tot_len, seq, ack, flags and the payload (RFC 1624 incremental update).
+    Sums are over words in memory (network) order, so they can be stored without byte swapping.
+*/
+struct pkt_hdr_template
+{
+    struct pkt_hdr hdr; /* Constant fields set, tot_len, seq, ack, flags and checksums zero */
+    uint32_t ip_sum;    /* Sum of the IP header without tot_len and check */
+    uint32_t tcp_sum;   /* Sum of the pseudo-header addresses and protocol, and the TCP header without seq, ack, flags and check */
+};
+
+/**
+ * Fills in the header template for a connection from src_addr:src_port to dst_addr:dst_port, given in host byte order.
+ * dst_mac is the MAC of the next hop, it can be changed later in tmpl->hdr.eth as it is not covered by any checksum.
+ * */
+void init_pkt_hdr_template(struct pkt_hdr_template *tmpl, const uint8_t *src_mac, const uint8_t *dst_mac,
+                           uint32_t src_addr, uint32_t dst_addr, uint16_t src_port, uint16_t dst_port);
+
+/**
+ * Builds a TCP packet directly in buffer from the connection's header template,
+ * updating the template checksums with the per-packet fields and the payload.
+ * The payload is copied and summed in one pass, or only summed if it was already written in place after the header.
+ *
+ * @param tmpl: Header template of the connection.
+ * @param payload: Pointer to the payload.
+ * @param payload_len: Length of the payload.
+ * @param buffer: Buffer to store the packet, normally the TX DMA buffer.
+ * */
+void build_tcp_packet_from_template(const struct pkt_hdr_template *tmpl, const char *payload, size_t payload_len, uint8_t flags, uint32_t seq, uint32_t ack, char *buffer);
+
+/**
+ * Fills in the headers in front of a payload that is already in buffer, after the header,
+ * given the one's complement sum of the payload (e.g. from csum_copy_partial while gathering it).
+ *
+ * @param tmpl: Header template of the connection.
+ * @param payload_sum: Unfolded sum of the payload.
+ * @param payload_len: Length of the payload.
+ * @param buffer: Buffer holding the packet, normally the TX DMA buffer.
+ * */
+void build_tcp_header_from_template(const struct pkt_hdr_template *tmpl, uint32_t payload_sum, size_t payload_len, uint8_t flags, uint32_t seq, uint32_t ack, char *buffer);
 
 /**
+ * Fills in the headers in front of a payload that is already in buffer, after the header, leaving both checksums zero
+ * for a NIC that fills them in as the frame leaves (NIC_OFFLOAD_TX_CSUM). The payload is not read.
+ *
+ * @param tmpl: Header template of the connection.
+ * @param payload_len: Length of the payload.
+ * @param buffer: Buffer holding the packet, normally the TX DMA buffer.
+ * */
+void build_tcp_header_offload(const struct pkt_hdr_template *tmpl, size_t payload_len, uint8_t flags, uint32_t seq, uint32_t ack, char *buffer);
+
 /**
  * Builds a TCP packet with the given payload and payload length.
  * The packet is built in the buffer passed as argument. The passed buffer is populated with the complete packet.
  *
- * @param pkt_hdr: Pointer to the packet header.
+ * @param addrs: Header the MACs, IPs and ports are taken from.
  * @param payload: Pointer to the payload.
  * @param payload_len: Length of the payload.
  * @param buffer: Buffer to store the packet.
  * */
-void build_tcp_packet(const char *payload, size_t payload_len, uint8_t flags, uint32_t seq, uint32_t ack, char *buffer);
\ No newline at end of file
+void build_tcp_packet(const struct pkt_hdr *addrs, const char *payload, size_t payload_len, uint8_t flags, uint32_t seq, uint32_t ack, char *buffer);
+
+/**
+ * Encodes the options in buf, in the order Linux sends them in a SYN, padded with NOPs to a multiple of 4 bytes.
+ *
+ * @param opts: Options to encode, absent ones are left out.
+ * @param buf: Buffer to store the options, at least TCP_OPTS_MAX_LEN bytes.
+ * @return The length of the options.
+ * */
+size_t build_tcp_options(const struct tcp_opts *opts, uint8_t *buf);
+
+/**
+ * Parses the options of a received TCP header, between the fixed header and the data offset.
+ * Unknown options are skipped, and parsing stops at a malformed one, keeping what was found before it.
+ *
+ * @param tcp: The TCP header, followed by its options.
+ * @param opts: Filled in with the options found.
+ * */
+void parse_tcp_options(const struct tcp_hdr *tcp, struct tcp_opts *opts);
+
+/**
+ * Builds a TCP packet without payload whose header carries options, e.g. a SYN, from the connection's header template.
+ * The checksums are computed in full, as options are only sent on the handshake.
+ *
+ * @param tmpl: Header template of the connection.
+ * @param opts: Options to put in the header.
+ * @param buffer: Buffer to store the packet, normally the TX DMA buffer.
+ * @return The length of the frame.
+ * */
+size_t build_tcp_packet_with_options(const struct pkt_hdr_template *tmpl, const struct tcp_opts *opts, uint8_t flags, uint32_t seq, uint32_t ack, char *buffer);
+
+/**
+ * Changes the window advertised by every packet built from the template, and updates its sum (RFC 1624).
+ *
+ * @param tmpl: Header template of the connection.
+ * @param window: The window field, in host byte order, already scaled down.
+ * */
+void pkt_hdr_template_set_window(struct pkt_hdr_template *tmpl, uint16_t window);
+
+/**
+ * Builds an ARP request or reply in buffer, padded to ARP_FRAME_LEN.
+ * A request is broadcast and dst_mac is ignored. Addresses are in network byte order.
+ *
+ * @param oper: ARPOP_REQUEST or ARPOP_REPLY.
+ * @param buffer: Buffer to store the frame, at least ARP_FRAME_LEN bytes.
+ * @return The length of the frame.
+ * */
+size_t build_arp_packet(uint16_t oper, const uint8_t *src_mac, uint32_t src_addr, const uint8_t *dst_mac, uint32_t dst_addr, char *buffer);
\ No newline at end of file
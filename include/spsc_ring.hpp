@@ -0,0 +1,106 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+
+/*
+    Single producer single consumer ring of fixed-size entries, for passing work between two threads without locks.
+    Entries are filled and read in place. The producer makes the entries it has written visible with spsc_publish,
+    and the consumer hands back the entries it has read with spsc_release, so a burst costs one store each way.
+    Each side keeps its index on its own cache line, and a copy of the other side's index that it only refreshes
+    when the ring looks full (or empty), so the shared lines move between cores once per batch rather than per entry.
+*/
+
+template <typename T, uint32_t N>
+struct spsc_ring
+{
+    static_assert((N & (N - 1)) == 0, "spsc_ring size must be a power of 2");
+    /* Producer side */
+    alignas(64) std::atomic<uint32_t> tail; /* Entries published */
+    uint32_t prod_tail;                     /* Entries written, published by spsc_publish */
+    uint32_t head_cache;                    /* Last value of head seen by the producer */
+    /* Consumer side */
+    alignas(64) std::atomic<uint32_t> head; /* Entries released */
+    uint32_t cons_head;                     /* Entries read, released by spsc_release */
+    uint32_t tail_cache;                    /* Last value of tail seen by the consumer */
+    alignas(64) T slots[N];
+};
+
+/*
+ * Next free entry for the producer to fill, NULL if the ring is full
+ */
+template <typename T, uint32_t N>
+static inline T *spsc_claim(struct spsc_ring<T, N> *r)
+{
+    if (r->prod_tail - r->head_cache == N)
+    {
+        r->head_cache = r->head.load(std::memory_order_acquire);
+        if (r->prod_tail - r->head_cache == N)
+            return NULL;
+    }
+    return &r->slots[r->prod_tail & (N - 1)];
+}
+
+/*
+ * Count the entry returned by spsc_claim as written, the consumer sees it after the next spsc_publish
+ */
+template <typename T, uint32_t N>
+static inline void spsc_push(struct spsc_ring<T, N> *r)
+{
+    ++r->prod_tail;
+}
+
+/*
+ * Make every entry pushed so far visible to the consumer
+ */
+template <typename T, uint32_t N>
+static inline void spsc_publish(struct spsc_ring<T, N> *r)
+{
+    if (r->tail.load(std::memory_order_relaxed) != r->prod_tail)
+        r->tail.store(r->prod_tail, std::memory_order_release);
+}
+
+/*
+ * Oldest entry the consumer has not read, NULL if there is none
+ */
+template <typename T, uint32_t N>
+static inline T *spsc_peek(struct spsc_ring<T, N> *r)
+{
+    if (r->cons_head == r->tail_cache)
+    {
+        r->tail_cache = r->tail.load(std::memory_order_acquire);
+        if (r->cons_head == r->tail_cache)
+            return NULL;
+    }
+    return &r->slots[r->cons_head & (N - 1)];
+}
+
+/*
+ * Count the entry returned by spsc_peek as read. It stays valid until the next spsc_release
+ */
+template <typename T, uint32_t N>
+static inline void spsc_pop(struct spsc_ring<T, N> *r)
+{
+    ++r->cons_head;
+}
+
+/*
+ * Give every entry read so far back to the producer
+ */
+template <typename T, uint32_t N>
+static inline void spsc_release(struct spsc_ring<T, N> *r)
+{
+    if (r->head.load(std::memory_order_relaxed) != r->cons_head)
+        r->head.store(r->cons_head, std::memory_order_release);
+}
+
+/*
+ * Empty the ring. Neither side may be using it
+ */
+template <typename T, uint32_t N>
+static inline void spsc_init(struct spsc_ring<T, N> *r)
+{
+    r->tail.store(0, std::memory_order_relaxed);
+    r->head.store(0, std::memory_order_relaxed);
+    r->prod_tail = r->head_cache = r->cons_head = r->tail_cache = 0;
+}
@@ -0,0 +1,137 @@
+#include "capture.hpp"
+#include "latency.hpp"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define PCAP_MAGIC_NS 0xa1b23c4d /* pcap with nanosecond timestamps */
+#define PCAP_LINKTYPE_ETHERNET 1
+
+struct pcap_file_hdr
+{
+    uint32_t magic;
+    uint16_t version_major;
+    uint16_t version_minor;
+    int32_t thiszone;
+    uint32_t sigfigs;
+    uint32_t snaplen;
+    uint32_t linktype;
+};
+
+struct pcap_rec_hdr
+{
+    uint32_t ts_sec;
+    uint32_t ts_nsec;
+    uint32_t caplen;
+    uint32_t len;
+};
+
+/*
+    This function extends the file by CAPTURE_FILE_GROW and maps the new size.
+*/
+static int capture_grow(struct capture *cap)
+{
+    size_t len = cap->map_len + CAPTURE_FILE_GROW;
+    if (ftruncate(cap->fd, len) != 0)
+        return -1;
+    void *map = cap->map == NULL ? mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, cap->fd, 0)
+                                 : mremap(cap->map, cap->map_len, len, MREMAP_MAYMOVE);
+    if (map == MAP_FAILED)
+        return -1;
+    cap->map = (char *)map;
+    cap->map_len = len;
+    return 0;
+}
+
+/*
+    This function appends a frame to the file as a pcap record.
+    The TSC it was captured at becomes a CLOCK_REALTIME timestamp here, off the stack's thread.
+*/
+static int capture_write(struct capture *cap, const struct capture_slot *slot)
+{
+    size_t rec_len = sizeof(struct pcap_rec_hdr) + slot->caplen;
+    if (cap->file_len + rec_len > cap->map_len && capture_grow(cap) != 0)
+        return -1;
+    uint64_t ns = tsc_to_realtime_ns(slot->tsc);
+    struct pcap_rec_hdr rec = {(uint32_t)(ns / 1000000000ull), (uint32_t)(ns % 1000000000ull), slot->caplen, slot->len};
+    memcpy(cap->map + cap->file_len, &rec, sizeof(rec));
+    memcpy(cap->map + cap->file_len + sizeof(rec), slot->data, slot->caplen);
+    cap->file_len += rec_len;
+    return 0;
+}
+
+/*
+    This function is the writer thread. It drains the ring into the file until capture_close stops it,
+    sleeping CAPTURE_IDLE_US after each pass so the producer keeps its cache lines most of the time.
+    running is read before the ring, so every frame captured before the stop is written.
+    If the file cannot grow any more, the rest of the frames are counted as dropped.
+*/
+static void capture_run(struct capture *cap)
+{
+    bool failed = false;
+    while (true)
+    {
+        bool running = cap->running.load(std::memory_order_acquire);
+        uint64_t added = cap->added.load(std::memory_order_acquire);
+        uint64_t removed = cap->removed.load(std::memory_order_relaxed);
+        for (; removed != added; ++removed)
+        {
+            if (!failed && capture_write(cap, &cap->slots[removed & (CAPTURE_RING_SIZE - 1)]) != 0)
+            {
+                perror("capture: cannot grow the file");
+                failed = true;
+            }
+            if (failed)
+                cap->dropped.fetch_add(1, std::memory_order_relaxed);
+            cap->removed.store(removed + 1, std::memory_order_release);
+        }
+        if (!running)
+            return;
+        // reading added after every frame would take its cache line away from the producer each time
+        usleep(CAPTURE_IDLE_US);
+    }
+}
+
+int capture_open(struct capture *cap, const char *path, uint32_t snaplen)
+{
+    cap->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (cap->fd < 0)
+        return -1;
+    cap->map = NULL;
+    cap->map_len = 0;
+    if (capture_grow(cap) != 0)
+    {
+        int err = errno;
+        close(cap->fd);
+        errno = err;
+        return -1;
+    }
+    cap->snaplen = snaplen < CAPTURE_SNAPLEN ? snaplen : CAPTURE_SNAPLEN;
+    struct pcap_file_hdr hdr = {PCAP_MAGIC_NS, 2, 4, 0, 0, cap->snaplen, PCAP_LINKTYPE_ETHERNET};
+    memcpy(cap->map, &hdr, sizeof(hdr));
+    cap->file_len = sizeof(hdr);
+    cap->slots = new struct capture_slot[CAPTURE_RING_SIZE];
+    cap->added.store(0, std::memory_order_relaxed);
+    cap->removed.store(0, std::memory_order_relaxed);
+    cap->removed_cache = 0;
+    cap->dropped.store(0, std::memory_order_relaxed);
+    cap->running.store(true, std::memory_order_release);
+    cap->writer = std::thread(capture_run, cap);
+    return 0;
+}
+
+void capture_close(struct capture *cap)
+{
+    cap->running.store(false, std::memory_order_release);
+    cap->writer.join();
+    munmap(cap->map, cap->map_len);
+    // drop the unused end of the last extension
+    if (ftruncate(cap->fd, cap->file_len) != 0)
+        perror("capture: cannot trim the file");
+    close(cap->fd);
+    delete[] cap->slots;
+    cap->slots = NULL;
+    cap->map = NULL;
+}
@@ -0,0 +1,97 @@
+#include "congestion.hpp"
+#include <math.h>
+
+/*
+    CUBIC congestion control (RFC 9438).
+    After a loss the window grows along a cubic curve of the time since the start of the epoch, flattening out
+    around the window where the loss happened, and growing faster once past it. It never grows slower than
+    standard TCP would from the same reduction.
+*/
+
+static void cubic_init(struct cc_state *cc, uint32_t mss)
+{
+    *cc = cc_state();
+    cc->mss = mss;
+    cc->cwnd = CC_INITIAL_SEGS * mss;
+    cc->ssthresh = UINT32_MAX;
+}
+
+/*
+    This function reduces the window after a congestion event, remembering where it was.
+    A loss below the previous w_max means the available bandwidth went down, so w_max is lowered further
+    to leave it to other flows sooner (fast convergence).
+*/
+static void cubic_reduce(struct cc_state *cc)
+{
+    if (cc->cwnd < cc->w_max)
+        cc->w_max = (uint32_t)(cc->cwnd * (1.0 + CC_CUBIC_BETA) / 2.0);
+    else
+        cc->w_max = cc->cwnd;
+    cc->ssthresh = (uint32_t)(cc->cwnd * CC_CUBIC_BETA);
+    if (cc->ssthresh < CC_MIN_SEGS * cc->mss)
+        cc->ssthresh = CC_MIN_SEGS * cc->mss;
+    cc->epoch_ns = 0;
+}
+
+static void cubic_on_ack(struct cc_state *cc, uint32_t acked, uint64_t now_ns, uint64_t srtt_ns)
+{
+    if (cc->cwnd < cc->ssthresh)
+    {
+        cc_slow_start(cc, acked);
+        return;
+    }
+    double mss = cc->mss;
+    if (cc->epoch_ns == 0)
+    {
+        cc->epoch_ns = now_ns;
+        cc->w_est = cc->cwnd;
+        cc->k_s = cc->cwnd < cc->w_max ? cbrt((cc->w_max - cc->cwnd) / mss / CC_CUBIC_C) : 0.0;
+        if (cc->cwnd > cc->w_max)
+            cc->w_max = cc->cwnd;
+    }
+    // the window the curve reaches one RTT from now
+    double t = (double)(now_ns - cc->epoch_ns + srtt_ns) / 1e9 - cc->k_s;
+    double target = cc->w_max + CC_CUBIC_C * t * t * t * mss;
+    if (target < cc->cwnd)
+        target = cc->cwnd;
+    else if (target > 1.5 * cc->cwnd)
+        target = 1.5 * cc->cwnd;
+    // standard TCP with the same average window, which grows alpha segments per RTT
+    cc->w_est += 3.0 * (1.0 - CC_CUBIC_BETA) / (1.0 + CC_CUBIC_BETA) * acked * mss / cc->cwnd;
+    if (cc->w_est > target)
+    {
+        cc->cwnd = (uint32_t)cc->w_est;
+        return;
+    }
+    // a fraction of the distance to the target per ACK, the whole distance over a window of ACKs
+    cc->w_inc += (target - cc->cwnd) * acked / cc->cwnd;
+    if (cc->w_inc >= 1.0)
+    {
+        cc->cwnd += (uint32_t)cc->w_inc;
+        cc->w_inc -= (uint32_t)cc->w_inc;
+    }
+}
+
+static void cubic_on_loss(struct cc_state *cc, uint32_t flight)
+{
+    (void)flight;
+    cubic_reduce(cc);
+    cc->cwnd = cc->ssthresh;
+    cc->w_inc = 0.0;
+}
+
+static void cubic_on_timeout(struct cc_state *cc, uint32_t flight)
+{
+    (void)flight;
+    cubic_reduce(cc);
+    cc->cwnd = cc->mss;
+    cc->w_inc = 0.0;
+}
+
+const struct cc_ops cc_cubic = {
+    "cubic",
+    cubic_init,
+    cubic_on_ack,
+    cubic_on_loss,
+    cubic_on_timeout,
+};
@@ -0,0 +1,61 @@
+#include "congestion.hpp"
+
+/*
+    NewReno congestion control.
+    Slow start adds a segment per ACK, congestion avoidance a segment per window of data acknowledged,
+    and a loss halves the window.
+*/
+
+static uint32_t newreno_halve(const struct cc_state *cc, uint32_t flight)
+{
+    uint32_t half = flight / 2;
+    return half > CC_MIN_SEGS * cc->mss ? half : CC_MIN_SEGS * cc->mss;
+}
+
+static void newreno_init(struct cc_state *cc, uint32_t mss)
+{
+    *cc = cc_state();
+    cc->mss = mss;
+    cc->cwnd = CC_INITIAL_SEGS * mss;
+    cc->ssthresh = UINT32_MAX;
+}
+
+static void newreno_on_ack(struct cc_state *cc, uint32_t acked, uint64_t now_ns, uint64_t srtt_ns)
+{
+    (void)now_ns;
+    (void)srtt_ns;
+    if (cc->cwnd < cc->ssthresh)
+    {
+        cc_slow_start(cc, acked);
+        return;
+    }
+    // appropriate byte counting, so the growth does not depend on how often the peer acknowledges (RFC 5681)
+    cc->bytes_acked += acked;
+    if (cc->bytes_acked >= cc->cwnd)
+    {
+        cc->bytes_acked -= cc->cwnd;
+        cc->cwnd += cc->mss;
+    }
+}
+
+static void newreno_on_loss(struct cc_state *cc, uint32_t flight)
+{
+    cc->ssthresh = newreno_halve(cc, flight);
+    cc->cwnd = cc->ssthresh;
+    cc->bytes_acked = 0;
+}
+
+static void newreno_on_timeout(struct cc_state *cc, uint32_t flight)
+{
+    cc->ssthresh = newreno_halve(cc, flight);
+    cc->cwnd = cc->mss;
+    cc->bytes_acked = 0;
+}
+
+const struct cc_ops cc_newreno = {
+    "newreno",
+    newreno_init,
+    newreno_on_ack,
+    newreno_on_loss,
+    newreno_on_timeout,
+};
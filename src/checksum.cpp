@@ -0,0 +1,324 @@
+#include "checksum.hpp"
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CSUM_X86 1
+#endif
+
+/* Add v to a 64 bit one's complement accumulator, wrapping the carry around */
+static inline uint64_t add64(uint64_t acc, uint64_t v)
+{
+    acc += v;
+    return acc + (acc < v);
+}
+
+/* Fold a 64 bit accumulator down to a sum that fits in 16 bits, so callers can keep adding words to it */
+static inline uint32_t fold64(uint64_t acc)
+{
+    acc = (acc & 0xFFFFFFFF) + (acc >> 32);
+    acc = (acc & 0xFFFFFFFF) + (acc >> 32);
+    return csum_fold((uint32_t)acc);
+}
+
+/*
+    This function sums len bytes 8 at a time into a 64 bit accumulator, then the 4, 2 and 1 byte tail.
+    The leftover byte is the first byte of a zero padded word, as the checksum is defined.
+*/
+static inline uint64_t sum_words(const uint8_t *p, size_t len, uint64_t acc)
+{
+    uint64_t q0, q1, q2, q3;
+    while (len >= 32)
+    {
+        memcpy(&q0, p, 8);
+        memcpy(&q1, p + 8, 8);
+        memcpy(&q2, p + 16, 8);
+        memcpy(&q3, p + 24, 8);
+        acc = add64(acc, q0);
+        acc = add64(acc, q1);
+        acc = add64(acc, q2);
+        acc = add64(acc, q3);
+        p += 32;
+        len -= 32;
+    }
+    while (len >= 8)
+    {
+        memcpy(&q0, p, 8);
+        acc = add64(acc, q0);
+        p += 8;
+        len -= 8;
+    }
+    if (len & 4)
+    {
+        uint32_t w;
+        memcpy(&w, p, 4);
+        acc = add64(acc, w);
+        p += 4;
+    }
+    if (len & 2)
+    {
+        uint16_t w;
+        memcpy(&w, p, 2);
+        acc = add64(acc, w);
+        p += 2;
+    }
+    if (len & 1)
+    {
+        uint16_t w = 0;
+        memcpy(&w, p, 1);
+        acc = add64(acc, w);
+    }
+    return acc;
+}
+
+/*
+    Same as sum_words, storing every word to dst as it is summed.
+*/
+static inline uint64_t copy_sum_words(uint8_t *dst, const uint8_t *p, size_t len, uint64_t acc)
+{
+    uint64_t q0, q1;
+    while (len >= 16)
+    {
+        memcpy(&q0, p, 8);
+        memcpy(&q1, p + 8, 8);
+        memcpy(dst, &q0, 8);
+        memcpy(dst + 8, &q1, 8);
+        acc = add64(acc, q0);
+        acc = add64(acc, q1);
+        p += 16;
+        dst += 16;
+        len -= 16;
+    }
+    if (len & 8)
+    {
+        memcpy(&q0, p, 8);
+        memcpy(dst, &q0, 8);
+        acc = add64(acc, q0);
+        p += 8;
+        dst += 8;
+    }
+    if (len & 4)
+    {
+        uint32_t w;
+        memcpy(&w, p, 4);
+        memcpy(dst, &w, 4);
+        acc = add64(acc, w);
+        p += 4;
+        dst += 4;
+    }
+    if (len & 2)
+    {
+        uint16_t w;
+        memcpy(&w, p, 2);
+        memcpy(dst, &w, 2);
+        acc = add64(acc, w);
+        p += 2;
+        dst += 2;
+    }
+    if (len & 1)
+    {
+        uint16_t w = 0;
+        memcpy(&w, p, 1);
+        *dst = *p;
+        acc = add64(acc, w);
+    }
+    return acc;
+}
+
+uint32_t csum_partial_scalar(const void *buf, size_t len, uint32_t sum)
+{
+    return fold64(sum_words((const uint8_t *)buf, len, sum));
+}
+
+uint32_t csum_copy_partial_scalar(void *dst, const void *src, size_t len, uint32_t sum)
+{
+    return fold64(copy_sum_words((uint8_t *)dst, (const uint8_t *)src, len, sum));
+}
+
+#ifdef CSUM_X86
+/*
+    The SIMD variants widen each 32 bit word to a 64 bit lane and add lanes, so no carries are lost
+    for anything shorter than 2^32 words. Lanes are combined at the end and the tail is done as scalar.
+*/
+__attribute__((target("sse4.2"))) static inline uint64_t reduce_sse(__m128i a, __m128i b)
+{
+    uint64_t lanes[2];
+    _mm_storeu_si128((__m128i *)lanes, _mm_add_epi64(a, b));
+    return add64(lanes[0], lanes[1]);
+}
+
+__attribute__((target("sse4.2"))) static uint32_t sse42_partial(const void *buf, size_t len, uint32_t sum)
+{
+    const uint8_t *p = (const uint8_t *)buf;
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc0 = zero, acc1 = zero;
+    while (len >= 32)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)p);
+        __m128i b = _mm_loadu_si128((const __m128i *)(p + 16));
+        acc0 = _mm_add_epi64(acc0, _mm_unpacklo_epi32(a, zero));
+        acc1 = _mm_add_epi64(acc1, _mm_unpackhi_epi32(a, zero));
+        acc0 = _mm_add_epi64(acc0, _mm_unpacklo_epi32(b, zero));
+        acc1 = _mm_add_epi64(acc1, _mm_unpackhi_epi32(b, zero));
+        p += 32;
+        len -= 32;
+    }
+    return fold64(sum_words(p, len, add64(reduce_sse(acc0, acc1), sum)));
+}
+
+__attribute__((target("sse4.2"))) static uint32_t sse42_copy_partial(void *dst, const void *src, size_t len, uint32_t sum)
+{
+    const uint8_t *p = (const uint8_t *)src;
+    uint8_t *d = (uint8_t *)dst;
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc0 = zero, acc1 = zero;
+    while (len >= 32)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)p);
+        __m128i b = _mm_loadu_si128((const __m128i *)(p + 16));
+        _mm_storeu_si128((__m128i *)d, a);
+        _mm_storeu_si128((__m128i *)(d + 16), b);
+        acc0 = _mm_add_epi64(acc0, _mm_unpacklo_epi32(a, zero));
+        acc1 = _mm_add_epi64(acc1, _mm_unpackhi_epi32(a, zero));
+        acc0 = _mm_add_epi64(acc0, _mm_unpacklo_epi32(b, zero));
+        acc1 = _mm_add_epi64(acc1, _mm_unpackhi_epi32(b, zero));
+        p += 32;
+        d += 32;
+        len -= 32;
+    }
+    return fold64(copy_sum_words(d, p, len, add64(reduce_sse(acc0, acc1), sum)));
+}
+
+__attribute__((target("avx2"))) static inline uint64_t reduce_avx2(__m256i a, __m256i b)
+{
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i *)lanes, _mm256_add_epi64(a, b));
+    return add64(add64(lanes[0], lanes[1]), add64(lanes[2], lanes[3]));
+}
+
+__attribute__((target("avx2"))) static uint32_t avx2_partial(const void *buf, size_t len, uint32_t sum)
+{
+    const uint8_t *p = (const uint8_t *)buf;
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i acc0 = zero, acc1 = zero;
+    while (len >= 64)
+    {
+        __m256i a = _mm256_loadu_si256((const __m256i *)p);
+        __m256i b = _mm256_loadu_si256((const __m256i *)(p + 32));
+        acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(a, zero));
+        acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(a, zero));
+        acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(b, zero));
+        acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(b, zero));
+        p += 64;
+        len -= 64;
+    }
+    if (len >= 32)
+    {
+        __m256i a = _mm256_loadu_si256((const __m256i *)p);
+        acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(a, zero));
+        acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(a, zero));
+        p += 32;
+        len -= 32;
+    }
+    return fold64(sum_words(p, len, add64(reduce_avx2(acc0, acc1), sum)));
+}
+
+__attribute__((target("avx2"))) static uint32_t avx2_copy_partial(void *dst, const void *src, size_t len, uint32_t sum)
+{
+    const uint8_t *p = (const uint8_t *)src;
+    uint8_t *d = (uint8_t *)dst;
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i acc0 = zero, acc1 = zero;
+    while (len >= 32)
+    {
+        __m256i a = _mm256_loadu_si256((const __m256i *)p);
+        _mm256_storeu_si256((__m256i *)d, a);
+        acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(a, zero));
+        acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(a, zero));
+        p += 32;
+        d += 32;
+        len -= 32;
+    }
+    return fold64(copy_sum_words(d, p, len, add64(reduce_avx2(acc0, acc1), sum)));
+}
+
+static bool cpu_has(const char *feature)
+{
+    __builtin_cpu_init();
+    if (strcmp(feature, "avx2") == 0)
+        return __builtin_cpu_supports("avx2");
+    return __builtin_cpu_supports("sse4.2");
+}
+
+const csum_partial_fn csum_partial_sse42 = cpu_has("sse4.2") ? sse42_partial : NULL;
+const csum_partial_fn csum_partial_avx2 = cpu_has("avx2") ? avx2_partial : NULL;
+const csum_copy_fn csum_copy_partial_sse42 = cpu_has("sse4.2") ? sse42_copy_partial : NULL;
+const csum_copy_fn csum_copy_partial_avx2 = cpu_has("avx2") ? avx2_copy_partial : NULL;
+#else
+const csum_partial_fn csum_partial_sse42 = NULL;
+const csum_partial_fn csum_partial_avx2 = NULL;
+const csum_copy_fn csum_copy_partial_sse42 = NULL;
+const csum_copy_fn csum_copy_partial_avx2 = NULL;
+#endif
+
+static uint32_t csum_partial_resolve(const void *buf, size_t len, uint32_t sum);
+static uint32_t csum_copy_partial_resolve(void *dst, const void *src, size_t len, uint32_t sum);
+
+static csum_partial_fn csum_partial_impl = csum_partial_resolve;
+static csum_copy_fn csum_copy_partial_impl = csum_copy_partial_resolve;
+static const char *csum_name = "scalar";
+
+/*
+    This function picks the widest variant the CPU supports.
+    It runs on the first checksum, so it does not depend on static initialization order.
+*/
+static void csum_select(void)
+{
+#ifdef CSUM_X86
+    if (cpu_has("avx2"))
+    {
+        csum_partial_impl = avx2_partial;
+        csum_copy_partial_impl = avx2_copy_partial;
+        csum_name = "avx2";
+        return;
+    }
+    if (cpu_has("sse4.2"))
+    {
+        csum_partial_impl = sse42_partial;
+        csum_copy_partial_impl = sse42_copy_partial;
+        csum_name = "sse4.2";
+        return;
+    }
+#endif
+    csum_partial_impl = csum_partial_scalar;
+    csum_copy_partial_impl = csum_copy_partial_scalar;
+    csum_name = "scalar";
+}
+
+static uint32_t csum_partial_resolve(const void *buf, size_t len, uint32_t sum)
+{
+    csum_select();
+    return csum_partial_impl(buf, len, sum);
+}
+
+static uint32_t csum_copy_partial_resolve(void *dst, const void *src, size_t len, uint32_t sum)
+{
+    csum_select();
+    return csum_copy_partial_impl(dst, src, len, sum);
+}
+
+uint32_t csum_partial(const void *buf, size_t len, uint32_t sum)
+{
+    return csum_partial_impl(buf, len, sum);
+}
+
+uint32_t csum_copy_partial(void *dst, const void *src, size_t len, uint32_t sum)
+{
+    return csum_copy_partial_impl(dst, src, len, sum);
+}
+
+const char *csum_impl_name(void)
+{
+    if (csum_partial_impl == csum_partial_resolve)
+        csum_select();
+    return csum_name;
+}
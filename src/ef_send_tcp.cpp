@@ -1,7 +1,6 @@
 #include "ef_send_tcp.hpp"
 
 /* Future Changes
-1. Make a parser to handle reads in an event driven callback way
 2. Make sure when numbers don't align (snd_nxt, rcv_nxt, snd_una) that we handle gracefully with right logic
 3. Allow for retransmissions, related to 2
 4. Handle window updates
@@ -10,31 +9,537 @@
 7. Debug duplex messaging and regular messaging more
 */
 
-static struct vi vi;
+/*
+    This function returns the metadata of the packet buffer with id pkt_buf_i.
+    id -> pkt_buf struct
+*/
+static inline struct pkt_buf *pkt_buf_from_id(uint32_t pkt_buf_i);
+/*
+    This function returns the offset of the frame in a full buffer.
+    Odd buffers start a cache line later, so the headers of neighbouring buffers do not all share the same cache sets.
+    pkt_buf_i -> offset (not entirely important)
+*/
+static inline int addr_offset_from_id(uint32_t pkt_buf_i);
+/*
+    This function returns the start of the DMA area of a buffer, where the NIC writes a received frame
+    (after its prefix) and reads a frame to send.
+*/
+static inline char *pkt_buf_dma(uint32_t id);
+/*
+    This function returns the start of the frame in an RX buffer, after the receive prefix.
+*/
+static inline char *rx_frame(uint32_t id);
+/*
+    This function refills the RX ring.
+    It checks if the RX ring has enough space to refill the ring.
+    It also checks if there are enough free buffers to refill the ring.
+    If it does, it refills the ring.
+    If it doesn't, it returns.
+*/
+static void vi_refill_rx_ring(void);
+/*
+    This function sets the share of the full buffers free or on the RX ring that the window of each connection is built from.
+*/
+static inline void rx_share_update(int rx_space);
+/*
+    This function frees a packet buffer.
+    It adds the packet buffer to the free list of its size class.
+    pkt_buf -> free pool
+*/
+static inline void pkt_buf_free(uint32_t id);
+/*
+    This function drops one reference on a TX packet buffer.
+    It frees the buffer when the last reference is gone.
+*/
+static inline void pkt_buf_release(uint32_t id);
+/*
+    This function records a latency sample for a stage, unless built with EF_TCP_NO_LATENCY.
+*/
+static inline void lat_record(LAT_STAGE stage, uint64_t value);
+/*
+    This function copies a frame queued on the NIC to the capture, if one is running.
+    It compiles to nothing when built with EF_TCP_NO_CAPTURE.
+*/
+static inline void capture_tx(uint32_t id, uint32_t len, uint64_t tsc);
+/*
+    This function copies the frames of the RX events from the NIC to the capture, if one is running.
+    They are stamped with the time they were polled.
+*/
+static inline void capture_rx(const struct nic_event *evs, int n_ev);
+/*
+    This function adds a buffer queued on the NIC to the TX ring, with the time it was queued.
+    It then counts it as a frame waiting behind the doorbell.
+*/
+static inline void tx_ring_add(uint32_t id, uint64_t tsc);
+/*
+    This function counts a frame queued behind the doorbell, noting when the oldest one was queued.
+*/
+static inline void tx_queued(void);
+/*
+    This function rings the doorbell for every frame queued on the NIC.
+*/
+static inline void tx_flush(void);
+/*
+    This function rings the doorbell after a frame has been queued, unless a batch is open.
+    An open batch is flushed once it holds TX_BATCH_MAX frames or its oldest frame has waited TX_BATCH_LATENCY_NS.
+*/
+static inline void tx_kick(void);
+/*
+    This function waits for acknowledgments while the retransmission queue of a connection is full.
+    Segments held behind the doorbell are sent first, as they could not be acknowledged otherwise.
+*/
+static void rtx_wait_space(struct tcp_conn *c);
+/*
+    This function waits until a new segment of len bytes may be sent on a connection:
+    there is room in the retransmission queue, the bytes in flight stay within the congestion window and the window
+    of the peer, and with pacing on, the segment's turn has come. Events are handled while waiting, so ACKs open the windows.
+*/
+static void send_wait(struct tcp_conn *c, uint32_t len);
+/*
+    This function waits for the pacing time of a segment of len bytes, then books the time of the next one.
+    Segments leave at a rate of a gain times cwnd per smoothed RTT, with up to PACE_BURST_SEGS back to back after an idle period.
+*/
+static void pace_wait(struct tcp_conn *c, uint32_t len);
+/*
+    This function passes an ACK of acked new bytes to the congestion control of a connection.
+    The window is held during fast recovery, and grows again once the data in flight at the loss is acknowledged.
+*/
+static inline void cc_ack(struct tcp_conn *c, uint32_t acked, uint64_t now);
+/*
+    This function tells the congestion control of a connection about a loss found by duplicate ACKs.
+*/
+static inline void cc_loss(struct tcp_conn *c);
+/*
+    This function tells the congestion control of a connection that the retransmission timer expired.
+*/
+static inline void cc_timeout(struct tcp_conn *c);
+/*
+    This function adds a sent segment to the retransmission queue.
+    It takes a reference on the TX buffer so the frame can be sent again.
+    It starts the retransmission timer and an RTT measurement if none is running.
+*/
+static void rtx_push(struct tcp_conn *c, uint32_t id, uint32_t seq, uint32_t end, uint16_t frame_len);
+/*
+    This function removes every segment acknowledged by ack from the retransmission queue.
+    It takes an RTT sample if the timed segment is covered.
+    It then restarts the retransmission timer.
+    During loss recovery it retransmits the next segment on a partial ACK.
+*/
+static void rtx_ack(struct tcp_conn *c, uint32_t ack, uint64_t now);
+/*
+    This function sends the oldest unacknowledged segment again from its TX buffer.
+*/
+static void rtx_retransmit_head(struct tcp_conn *c);
+/*
+    This function retransmits the oldest segment if the retransmission timer has expired.
+    It doubles the timeout on every expiry and gives up after RTX_MAX_RETRIES.
+*/
+static void rtx_check_timer(struct tcp_conn *c);
+/*
+    This function releases every segment in the retransmission queue and stops the timer.
+*/
+static void rtx_clear(struct tcp_conn *c);
+/*
+    This function processes the acknowledgment number of an incoming segment.
+    It advances snd_una and trims the retransmission queue when new data is acknowledged.
+    It counts duplicate ACKs and fast retransmits after DUPACK_THRESHOLD of them.
+*/
+static void process_ack(struct tcp_conn *c, uint32_t ack_num, bool pure_ack);
+/*
+    This function initializes the packet buffers with the geometry of the configuration.
+    It sets the number of full buffers to the sum of the RX and TX ring sizes, plus the small TX buffers.
+    It then maps one region for the buffers, their metadata, the TX ring, the event backlog and the read queues,
+    from huge pages if it can, and from posix_memalign otherwise.
+    It then puts every buffer on the free list of its class.
+*/
+static int init_pkts_memory(const struct ef_config *config);
+/*
+    This function returns the next aligned block of size bytes of the pool region, from offset *off.
+*/
+static inline void *pool_carve(size_t *off, size_t size);
+/*
+    This function initializes the virtual interface.
+    It initializes the NIC backend on the interface.
+    It then computes the DMA addresses of the packet buffers.
+    It then fills the RX ring.
+    It then empties the connection table, filters are set per connection by ef_conn_open.
+    It then steers ARP frames for the local and broadcast MACs to the VI.
+    It then returns 0.
+*/
+static int init(const char *intf);
+/*
+    This function returns the address frames to raddr are sent to, raddr itself on the local subnet or the gateway.
+    Addresses are in network byte order.
+*/
+static uint32_t next_hop_for(uint32_t raddr);
+/*
+    This function sends an ARP request (broadcast) or reply from the local addresses.
+*/
+static void arp_send(uint16_t oper, const uint8_t *dst_mac, uint32_t dst_addr);
+/*
+    This function handles a received ARP frame.
+    It updates the neighbor cache from the sender, as RFC 826 merges it, and repoints connections whose next hop moved.
+    It answers requests for the local address.
+*/
+static void arp_input(const struct arp_pkt *pkt);
+/*
+    This function sends ARP requests for addr until it is in the neighbor cache, serving the NIC meanwhile.
+    It returns false if nothing answered after ARP_RETRIES requests.
+*/
+static bool arp_resolve(uint32_t addr);
+/*
+    This function copies the MAC of addr from the neighbor cache into every connection sent through addr.
+    Frames waiting for retransmission are patched as well, so they follow the new next hop.
+*/
+static void neigh_apply(uint32_t addr);
+/*
+    This function returns whether a fixed session sends the header the connection's template holds, apart from the window.
+*/
+static bool fixed_matches(const struct tcp_conn *c, const struct fixed_ops *ops);
+/*
+    This function returns whether the NIC fills in and checks the checksums of every frame.
+*/
+static bool nic_csum_offload(void);
+/*
+    This function makes sure the next hop of a connection is resolved and its MAC is in the header template.
+    If the gateway does not answer and a backup gateway is configured, it fails over to the backup.
+*/
+static void conn_resolve(struct tcp_conn *c);
+/*
+    This function polls the NIC for events.
+    It returns events set aside by tx_wait_space before polling the NIC.
+*/
+static int poll_nic(struct nic_event *evs, int max_evs);
+/*
+    This function handles a TX completion event.
+    It returns the completed buffers to the free pool in one batch.
+    It then refills the RX ring.
+*/
+static void tx_complete(const struct nic_event *ev);
+/*
+    This function returns whether the TX ring has room for one more frame.
+*/
+static inline bool tx_ring_space();
+/*
+    This function returns whether the TX ring has room and a buffer is free for a frame of frame_len bytes.
+*/
+static inline bool tx_space(uint32_t frame_len);
+/*
+    This function waits until the TX ring, and unless the frame already has its buffer the packet pool, can take a frame of frame_len bytes.
+    It handles TX completions as they arrive.
+    It sets every other event aside for the next poll.
+*/
+static void tx_wait_space(uint32_t frame_len, bool has_buf);
+/**
+ * @brief Send a packet with the given payload, payload length, flags, sequence number, and acknowledgment number
+ * Note: seq and ack are numbers to be sent with the packet
+ * Note: the buffer is freed when the NIC reports the transmit complete
+ * @param payload
+ * @param payload_len
+ * @param flags
+ * @param seq
+ * @param ack
+ */
+static void send_packet(struct tcp_conn *c, char *payload, int payload_len, uint8_t flags, uint32_t seq, uint32_t ack);
+/*
+    This function takes a TX buffer for a frame of up to frame_len bytes, a small one if it fits and one is free.
+    It applies backpressure rather than overflowing the TX ring.
+*/
+static uint32_t tx_buf_alloc(uint32_t frame_len);
+/*
+    This function returns the start of the frame in a TX buffer, where the NIC reads from.
+*/
+static inline char *tx_frame(uint32_t id);
+/*
+    This function builds the frame in a TX buffer taken with tx_buf_alloc and hands it to the NIC.
+    The payload is copied in, unless it already sits right after the header.
+*/
+static void tx_buf_send(struct tcp_conn *c, uint32_t id, const char *payload, int payload_len, uint8_t flags, uint32_t seq, uint32_t ack);
+/*
+    This function queues a built frame on the NIC without ringing the doorbell.
+    Segments that take up sequence space are kept in the retransmission queue until acknowledged.
+*/
+static void tx_buf_post(struct tcp_conn *c, uint32_t id, int payload_len, uint8_t flags, uint32_t seq);
+/*
+    This function builds a frame of a fixed session in a TX buffer, copying the payload in unless it already sits after the header.
+    The payload is only summed when the session computes its own checksums.
+*/
+static void fixed_build(struct tcp_conn *c, uint32_t id, const char *payload, int payload_len, uint8_t flags, uint32_t seq, uint32_t ack);
+/*
+    This function returns whether the frames a connection sends carry checksums computed by the stack, so their payload is summed.
+*/
+static inline bool tx_csum_sw(const struct tcp_conn *c);
+/*
+    This function returns whether the checksums of a received TCP frame of len bytes, whose lengths have been checked,
+    are right, trusting the NIC with them when it checks them.
+*/
+static inline bool rx_csum_ok(const struct pkt_hdr *hdr, uint32_t len);
+/*
+    This function drops a received frame the NIC discarded or whose lengths or checksums are wrong, counting it for ef_rx_discarded.
+*/
+static void rx_discard(uint32_t id);
+/*
+ * Receive a packet and verify the seq, ack, and flags are as expected
+ */
+static std::tuple<struct pkt_hdr *, uint32_t, uint8_t> receive_packet(struct tcp_conn *c, uint8_t flags, uint32_t seq, uint32_t ack);
+/*
+ * Send a connection handshake, negotiating the MSS, window scaling and SACK
+ */
+static void send_connection_handshake(struct tcp_conn *c);
+/*
+    This function returns the bytes the connection can take in, from the RX buffers free or on the ring,
+    shared between the connections, and the room left in its read queue.
+*/
+static inline uint32_t rcv_wnd_avail(struct tcp_conn *c);
+/*
+    This function sets the window advertised by the next frames built for the connection.
+    The right edge of the window never moves back, even when small segments used up more buffers than their bytes.
+*/
+static inline void rcv_wnd_update(struct tcp_conn *c);
+/*
+    This function tells the peer the window has opened again, once the application has freed buffers
+    after the advertised window fell below one segment.
+*/
+static inline void rcv_wnd_reopen(struct tcp_conn *c);
+/*
+ * Send a TCP teardown
+ */
+static void send_tcp_teardown(struct tcp_conn *c);
+/*
+ * Send a hello world packet
+ */
+static void send_hello_world(struct tcp_conn *c);
+/*
+ * Reset the variables
+ */
+static void reset_variables(struct tcp_conn *c);
+/*
+ * Reset the variables for a new connection, with the RTT estimate started again
+ */
+static void set_variables(struct tcp_conn *c);
+/*
+ * Send a reset
+ */
+static void send_reset(struct tcp_conn *c);
+/*
+ * Send an ACK for everything received so far
+ */
+static void send_ack(struct tcp_conn *c);
+/*
+    This function counts an in-order segment to acknowledge, sending the ACK once max_segs are waiting.
+    It otherwise holds the ACK, starting the delay if one is set.
+*/
+static inline void ack_hold(struct tcp_conn *c);
+/*
+    This function forgets the ACK held on a connection, as a frame carrying rcv_nxt has been sent.
+*/
+static inline void ack_sent(struct tcp_conn *c);
+/*
+    This function sends every held ACK, or with a delay set, those whose delay has run out.
+*/
+static void ack_flush(bool timer);
+/*
+ * Hand in-order payload to the on_data handler, or queue it for ef_read
+ */
+static void deliver(struct tcp_conn *c, char *payload, ssize_t len, uint32_t id);
+/*
+    This function adds a segment to the read queue of a connection, which the caller has checked has room.
+*/
+static inline void rxq_push(struct tcp_conn *c, char *payload, uint32_t len, uint32_t id);
+/*
+    This function returns the first payload byte of a queued segment.
+*/
+static inline char *rxq_payload(const struct rx_desc *d);
+/*
+    This function frees every segment in the read queue of a connection.
+*/
+static void rxq_clear(struct tcp_conn *c);
+/*
+    This function holds a segment that arrived ahead of rcv_nxt in the reassembly queue, without copying it out of its RX buffer.
+    Bytes already held by a neighbouring segment are trimmed off, and held segments the new one covers are dropped.
+    It returns false if nothing of the segment was kept, in which case the caller frees the buffer.
+*/
+static bool ooo_insert(struct tcp_conn *c, uint32_t seq, uint32_t end, char *payload, uint32_t id);
+/*
+    This function moves held segments to the read queue once rcv_nxt has reached them.
+    Segments that turned out to be duplicates are freed.
+*/
+static void ooo_release(struct tcp_conn *c);
+/*
+    This function frees every segment held in the reassembly queue.
+*/
+static void ooo_clear(struct tcp_conn *c);
+/*
+ * Handle a received frame of len bytes on the established connection
+ */
+static void handle_rx(uint32_t id, uint32_t len);
+/*
+    This function handles a segment of an established connection whose headers, hdr_len bytes from the IP header on,
+    have been checked. The buffer is freed, queued or handed to the application.
+*/
+static void handle_segment(struct tcp_conn *c, struct pkt_hdr *hdr, uint32_t id, uint32_t hdr_len);
+/*
+    This function returns the connection of the fixed session a frame of len bytes belongs to, NULL if it is none of theirs.
+*/
+static inline struct tcp_conn *fixed_lookup(const struct pkt_hdr *hdr, uint32_t len);
+/*
+    This function hashes a 4-tuple to its home slot in the connection table.
+*/
+static inline uint32_t conn_hash(const struct conn_key *key);
+/*
+    This function finds the connection an incoming frame belongs to.
+    It probes from the home slot until it finds the key or an empty slot.
+    It returns NULL for frames of no known connection. The frame has to have passed tcp_frame_ok.
+*/
+static inline struct tcp_conn *conn_lookup(const struct pkt_hdr *hdr);
+/*
+    This function adds a connection to the table under its 4-tuple.
+    Connections are never removed, so there are no tombstones to skip.
+*/
+static void conn_insert(const struct conn_key *key, int conn);
+/*
+    This function runs the retransmission timer of every connection, and sends the ACKs whose delay has run out.
+    It then rings the doorbell if a held batch has reached TX_BATCH_LATENCY_NS.
+*/
+static void check_timers(void);
+/*
+    This function returns the time until the first retransmission or delayed ACK timer of any connection expires,
+    at most max_ns.
+*/
+static uint64_t timer_next_ns(uint64_t max_ns);
+/*
+    This function adds one to a wait counter, as a plain relaxed store since the stack is its only writer.
+*/
+static inline void wait_count(std::atomic<uint64_t> *counter);
+/*
+    This function notes that a wait found events, updating the smoothed gap between events
+    and, in the adaptive mode, the spin budget of the next wait.
+*/
+static void wait_found(uint64_t now);
+/*
+    This function polls the NIC until it has events or timeout_ns has passed (negative: forever), waiting as the wait mode says.
+    It runs the timers while spinning, and never blocks past the next timer or with frames held behind the doorbell.
+    It returns the number of events polled, 0 on timeout.
+*/
+static int wait_events(struct nic_event *evs, int max_evs, int64_t timeout_ns);
+/*
+ * Handle a batch of events from the NIC, holding the doorbell until all of them are handled
+ */
+static void handle_events(struct nic_event *evs, int n_ev);
+static void handle_events_batch(struct nic_event *evs, int n_ev);
+/*
+ * Copy up to len bytes from the read queue into buf, freeing buffers that were copied out completely
+ */
+static ssize_t read_queue(struct tcp_conn *c, char *buf, ssize_t len);
+/*
+ * Poll events for incoming packets when data is immediately wanted
+ */
+static void poll_events(struct tcp_conn *c, char *buf, ssize_t& read, int len);
+/*
+ * Poll events for incoming packets when data is not immediately wanted
+ */
+static void poll_events();
+/*
+    This function is the network thread: it pins itself, then sends queued messages and polls the NIC until stopped.
+    An exception stops it, after an ERROR event has been sent to every channel.
+*/
+static void net_run(int cpu);
+/*
+    This function sends the messages queued on a channel, up to TX_BATCH_MAX at a time.
+*/
+static void net_drain_cmds(struct ef_net_chan *chan);
+/*
+    This function queues an event on a channel, waiting for the application to make room if the channel is full.
+    Events are published at the end of each turn of the network thread.
+*/
+static void net_push_event(struct ef_net_chan *chan, NET_EVENT type, struct tcp_conn *conn, const char *data, size_t len);
+/*
+    These functions are the handlers the network thread installs on subscribed connections.
+*/
+static void net_on_data(void *arg, const char *data, size_t len);
+static void net_on_reset(void *arg);
+static void net_on_close(void *arg);
+
+#ifdef EF_TCP_NO_EFVI
+static const struct nic_backend *nic = &nic_loopback;
+#else
+static const struct nic_backend *nic = &nic_efvi;
+#endif
 static struct pkt_bufs pbs;
-static uint32_t snd_nxt = 16000000;
-static uint32_t rcv_nxt = 0;
-static uint32_t snd_una = 0;
-static std::queue<std::tuple<char *, ssize_t, ssize_t>> data_queue;
-/*
-    This function returns a pointer to the packet buffer at index pkt_buf_i.
-    It casts the memory pointer to a pointer to a pkt_buf struct.
-    It then returns the pointer to the pkt_buf struct.
+static struct tx_ring tx;
+static struct ev_backlog backlog;
+static struct tx_batch batch;
+static struct hdr_hist lat[(int)LAT_STAGE::COUNT];
+static uint64_t send_tsc; /* Entry of the send call in progress, 0 outside of one */
+static const char *const lat_names[] = {"send_to_post", "post_to_complete", "rx_to_deliver", "post_to_wire", "wire_to_rx", "wire_to_wake"};
+static struct tcp_conn conns[MAX_CONNS];
+static int n_conns;
+static struct conn_table conn_table;
+static struct fixed_table fixed;
+static struct tcp_conn *default_conn;
+static struct ef_config endpoint;
+static struct neigh_cache neigh;
+static struct capture cap;
+static bool capturing; /* Every frame sent or received is copied to cap */
+static struct net_thread net;
+static struct ack_policy ack = {ACK_MAX_SEGS, ACK_DELAY_NS, 0};
+static struct wait_policy waiter = {WAIT_MODE::SPIN, WAIT_SPIN_NS, WAIT_SPIN_NS, 0, 0, false};
+static struct wait_stats wait_stats;
+static unsigned nic_offloads; /* NIC_OFFLOAD_* of the VI, the stack computes every other checksum */
+static std::atomic<uint64_t> rx_discards; /* Frames dropped for a bad checksum or discarded by the NIC */
+
+const struct ef_config ef_default_config = {
+    "enp1s0f1",
+    {0x00, 0x0f, 0x53, 0x5a, 0x4d, 0xa1},
+    0xc0a80d17, // 192.168.13.23
+    0xffffff00,
+    0,
+    0,
+    0xc0a80d0a, // 192.168.13.10
+    1234,
+    12345,
+    false,
+    0,
+    0,
+    0,
+    0,
+    false,
+};
+/*
+    This function returns the metadata of the packet buffer with id pkt_buf_i.
     id -> pkt_buf struct
 */
-static inline struct pkt_buf *pkt_buf_from_id(int pkt_buf_i)
+static inline struct pkt_buf *pkt_buf_from_id(uint32_t pkt_buf_i)
 {
-    assert((unsigned)pkt_buf_i < (unsigned)pbs.num);
-    return (struct pkt_buf *)((char *)pbs.mem + (size_t)pkt_buf_i * PKT_BUF_SIZE);
+    assert(pkt_buf_i < (uint32_t)(pbs.num + pbs.num_small));
+    return &pbs.bufs[pkt_buf_i];
 }
 /*
-    This function returns the offset of the DMA address from the packet buffer.
-    It returns the offset of the DMA address from the packet buffer.
+    This function returns the offset of the frame in a full buffer.
+    Odd buffers start a cache line later, so the headers of neighbouring buffers do not all share the same cache sets.
     pkt_buf_i -> offset (not entirely important)
 */
-static inline int addr_offset_from_id(int pkt_buf_i)
+static inline int addr_offset_from_id(uint32_t pkt_buf_i)
+{
+    return (pkt_buf_i % 2) * NIC_DMA_ALIGN;
+}
+/*
+    This function returns the start of the DMA area of a buffer, where the NIC writes a received frame
+    (after its prefix) and reads a frame to send.
+*/
+static inline char *pkt_buf_dma(uint32_t id)
 {
-    return (pkt_buf_i % 2) * EF_VI_DMA_ALIGN;
+    assert(id < (uint32_t)(pbs.num + pbs.num_small));
+    if (id < (uint32_t)pbs.num)
+        return (char *)pbs.mem + (size_t)id * pbs.buf_size + addr_offset_from_id(id);
+    return pbs.small_mem + (size_t)(id - pbs.num) * PKT_BUF_SMALL_SIZE;
+}
+/*
+    This function returns the start of the frame in an RX buffer, after the receive prefix.
+*/
+static inline char *rx_frame(uint32_t id)
+{
+    return pkt_buf_dma(id) + pbs.rx_prefix_len;
 }
 /*
     This function refills the RX ring.
@@ -45,561 +550,2394 @@ static inline int addr_offset_from_id(int pkt_buf_i)
 */
 static void vi_refill_rx_ring(void)
 {
-    ef_vi *vi_ptr = &vi.vi;
-    struct pkt_buf *pkt_buf;
+    uint32_t id;
     int i;
+    int rx_space = nic->rx_space();
 
-    if (ef_vi_receive_space(vi_ptr) < REFILL_BATCH_SIZE ||
+    // refilling only moves buffers from the pool to the ring, so the share is the same before and after
+    rx_share_update(rx_space);
+    if (rx_space < REFILL_BATCH_SIZE ||
         pbs.free_pool_n < REFILL_BATCH_SIZE)
         return;
 
     for (i = 0; i < REFILL_BATCH_SIZE; ++i)
     {
-        pkt_buf = pbs.free_pool;
-        pbs.free_pool = pbs.free_pool->next;
+        id = pbs.free_pool;
+        pbs.free_pool = pbs.bufs[id].next;
         --pbs.free_pool_n;
-        ef_vi_receive_init(vi_ptr, pkt_buf->rx_ef_addr, pkt_buf->id);
+        nic->rx_post(pbs.cold[id].dma_addr, id);
     }
-    ef_vi_receive_push(vi_ptr);
+    nic->rx_push();
+}
+/*
+    This function sets the share of the full buffers free or on the RX ring that the window of each connection is built from.
+    It is called on every refill and when a connection is added, so sending does not ask the NIC for its ring space.
+*/
+static inline void rx_share_update(int rx_space)
+{
+    if (n_conns > 0)
+        pbs.rx_share = (pbs.free_pool_n + (pbs.rx_ring_size - 1 - rx_space)) / n_conns;
 }
 /*
     This function frees a packet buffer.
-    It adds the packet buffer to the free pool.
+    It adds the packet buffer to the free list of its size class.
     pkt_buf -> free pool
 */
-static inline void pkt_buf_free(struct pkt_buf *pkt_buf)
+static inline void pkt_buf_free(uint32_t id)
+{
+    struct pkt_buf *pkt_buf = pkt_buf_from_id(id);
+    if (id < (uint32_t)pbs.num)
+    {
+        pkt_buf->next = pbs.free_pool;
+        pbs.free_pool = id;
+        ++pbs.free_pool_n;
+    }
+    else
+    {
+        pkt_buf->next = pbs.free_small;
+        pbs.free_small = id;
+        ++pbs.free_small_n;
+    }
+}
+/*
+    This function drops one reference on a TX packet buffer.
+    It frees the buffer when the last reference is gone.
+*/
+static inline void pkt_buf_release(uint32_t id)
 {
-    pkt_buf->next = pbs.free_pool;
-    pbs.free_pool = pkt_buf;
-    ++pbs.free_pool_n;
+    if (--pkt_buf_from_id(id)->refs == 0)
+        pkt_buf_free(id);
+}
+
+static inline uint64_t now_ns(void)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
 }
 
 void reset_variables()
 {
-    data_queue.empty();
-    snd_nxt = 16000000;
-    rcv_nxt = 0;
-    snd_una = 0;
+    reset_variables(default_conn);
+}
+
+static void reset_variables(struct tcp_conn *c)
+{
+    c->established = false;
+    rxq_clear(c);
+    rtx_clear(c);
+    ooo_clear(c);
+    ack_sent(c);
+    c->snd_nxt = 16000000;
+    c->rcv_nxt = 0;
+    c->snd_una = c->snd_nxt;
+    c->snd_wscale = 0;
+    c->rcv_wscale = 0;
+    c->rcv_adv = 0;
+}
+
+static void set_variables(struct tcp_conn *c)
+{
+    reset_variables(c);
+    // a new connection measures its path afresh
+    c->rtx.rto_ns = RTO_INITIAL_NS;
+    c->rtx.srtt_ns = 0;
+    c->rtx.rttvar_ns = 0;
+}
+/*
+    This function returns the next aligned block of size bytes of the pool region, from offset *off.
+*/
+static inline void *pool_carve(size_t *off, size_t size)
+{
+    void *p = (char *)pbs.mem + *off;
+    *off = ROUND_UP(*off + size, (size_t)NIC_DMA_ALIGN);
+    return p;
+}
+/*
+    This function initializes the packet buffers with the geometry of the configuration.
+    It sets the number of full buffers to the sum of the RX and TX ring sizes, plus the small TX buffers.
+    It then maps one region for the buffers, their metadata, the TX ring, the event backlog and the read queues,
+    from huge pages if it can, and from posix_memalign otherwise, asking for transparent huge pages.
+    It then puts every buffer on the free list of its class.
+*/
+static int init_pkts_memory(const struct ef_config *config)
+{
+    pbs.rx_ring_size = config->rx_ring_size > 0 ? config->rx_ring_size : RX_RING_SIZE;
+    pbs.tx_ring_size = config->tx_ring_size > 0 ? config->tx_ring_size : TX_RING_SIZE;
+    pbs.buf_size = config->buf_size > 0 ? config->buf_size : PKT_BUF_SIZE;
+    if (!IS_POW2(pbs.rx_ring_size) || !IS_POW2(pbs.tx_ring_size))
+        throw std::runtime_error("Ring sizes must be powers of 2");
+    if (pbs.buf_size < PKT_BUF_MIN_SIZE || pbs.buf_size % NIC_DMA_ALIGN != 0)
+        throw std::runtime_error("Packet buffer size must be a multiple of " + std::to_string(NIC_DMA_ALIGN) +
+                                 " of at least " + std::to_string(PKT_BUF_MIN_SIZE));
+    pbs.num = pbs.rx_ring_size + pbs.tx_ring_size;
+    pbs.num_small = config->small_bufs == 0 ? PKT_SMALL_BUFS : std::max(config->small_bufs, 0);
+    size_t n = (size_t)pbs.num + pbs.num_small;
+    backlog.size = pbs.rx_ring_size + NIC_POLL_MAX_EVS;
+
+    // the full buffers keep their natural alignment, everything after them is cache line aligned
+    size_t sizes[] = {(size_t)pbs.num * pbs.buf_size, (size_t)pbs.num_small * PKT_BUF_SMALL_SIZE,
+                      n * sizeof(struct pkt_buf), n * sizeof(struct pkt_buf_cold),
+                      (size_t)pbs.tx_ring_size * sizeof(uint32_t), (size_t)pbs.tx_ring_size * sizeof(uint64_t),
+                      backlog.size * sizeof(struct nic_event), (size_t)MAX_CONNS * RX_QUEUE_SIZE * sizeof(struct rx_desc)};
+    pbs.mem_size = 0;
+    for (size_t size : sizes)
+        pbs.mem_size = ROUND_UP(pbs.mem_size + size, (size_t)NIC_DMA_ALIGN);
+    pbs.mem_size = ROUND_UP(pbs.mem_size, (size_t)huge_page_size);
+
+    pbs.mem = mmap(NULL, pbs.mem_size, PROT_READ | PROT_WRITE,
+                   MAP_ANONYMOUS | MAP_PRIVATE | MAP_HUGETLB, -1, 0);
+    pbs.huge_pages = pbs.mem != MAP_FAILED;
+    if (!pbs.huge_pages)
+    {
+        LOGW("WARNING: no huge pages for the packet pool, using posix_memalign and 4 KiB pages (%zu KiB)\n", pbs.mem_size >> 10);
+        TEST(posix_memalign(&pbs.mem, huge_page_size, pbs.mem_size) == 0);
+        // transparent huge pages, where enabled, still save most of the TLB misses
+        madvise(pbs.mem, pbs.mem_size, MADV_HUGEPAGE);
+        memset(pbs.mem, 0, pbs.mem_size);
+    }
+    size_t off = 0;
+    pool_carve(&off, sizes[0]);
+    pbs.small_mem = (char *)pool_carve(&off, sizes[1]);
+    pbs.bufs = (struct pkt_buf *)pool_carve(&off, sizes[2]);
+    pbs.cold = (struct pkt_buf_cold *)pool_carve(&off, sizes[3]);
+    tx.ids = (uint32_t *)pool_carve(&off, sizes[4]);
+    tx.tsc = (uint64_t *)pool_carve(&off, sizes[5]);
+    backlog.evs = (struct nic_event *)pool_carve(&off, sizes[6]);
+    pbs.rx_descs = (struct rx_desc *)pool_carve(&off, sizes[7]);
+
+    pbs.free_pool = pbs.free_small = PKT_BUF_NONE;
+    pbs.free_pool_n = pbs.free_small_n = 0;
+    // pushed in reverse so the lowest ids, and the first pages, are handed out first
+    for (uint32_t i = n; i-- > 0;)
+        pkt_buf_free(i);
+    return 0;
+}
+/*
+    This function initializes the virtual interface.
+    It initializes the NIC backend on the interface with the ring sizes of the pool, with hardware timestamps if configured,
+    and keeps the checksum offloads it ends up with (none if the endpoint asks for software checksums).
+    It then computes the DMA addresses of the packet buffers of both classes.
+    It then fills the RX ring.
+    It then empties the connection table, filters are set per connection by ef_conn_open.
+    It then steers ARP frames for the local and broadcast MACs to the VI.
+    It then returns 0.
+*/
+static int init(const char *intf)
+{
+    static const uint8_t broadcast[ETH_ALEN] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+    int i;
+
+    // odd buffers lose a cache line to the stagger
+    TRY(nic->init(intf, pbs.mem, pbs.mem_size, pbs.rx_ring_size, pbs.tx_ring_size, pbs.buf_size - NIC_DMA_ALIGN,
+                  (endpoint.hw_timestamps ? NIC_INIT_TIMESTAMPS : 0) | (endpoint.sw_csum ? NIC_INIT_SW_CSUM : 0)));
+    pbs.rx_prefix_len = nic->rx_prefix_len();
+    nic_offloads = nic->offloads();
+    rx_discards.store(0, std::memory_order_relaxed);
+
+    for (i = 0; i < pbs.num + pbs.num_small; ++i)
+        pbs.cold[i].dma_addr = nic->dma_addr(pkt_buf_dma(i) - (char *)pbs.mem);
+
+    while (nic->rx_space() > REFILL_BATCH_SIZE)
+        vi_refill_rx_ring();
+
+    for (i = 0; i < CONN_TABLE_SIZE; ++i)
+        conn_table.slots[i].conn = -1;
+    fixed.n = 0;
+
+    // next hops are resolved on the VI, so the kernel never sits on the path
+    if (nic->filter_add_eth(endpoint.mac, htons(ETH_P_ARP)) < 0 ||
+        nic->filter_add_eth(broadcast, htons(ETH_P_ARP)) < 0)
+        LOGW("WARNING: ARP filters not supported, next hops have to be added with ef_neigh_add\n");
+
+    return 0;
+}
+/*
+    This function hashes a 4-tuple to its home slot in the connection table.
+*/
+static inline uint32_t conn_hash(const struct conn_key *key)
+{
+    uint32_t h = key->laddr ^ key->raddr ^ (((uint32_t)key->lport << 16) | key->rport);
+    h ^= h >> 16;
+    h *= 0x9E3779B1u;
+    return h >> 16 & (CONN_TABLE_SIZE - 1);
+}
+
+static inline bool conn_key_eq(const struct conn_key *a, const struct conn_key *b)
+{
+    return a->laddr == b->laddr && a->raddr == b->raddr && a->lport == b->lport && a->rport == b->rport;
+}
+/*
+    This function finds the connection an incoming frame belongs to.
+    It probes from the home slot until it finds the key or an empty slot.
+    It returns NULL for frames of no known connection. The frame has to have passed tcp_frame_ok.
+*/
+static inline struct tcp_conn *conn_lookup(const struct pkt_hdr *hdr)
+{
+    struct conn_key key = {hdr->ip.dst_addr, hdr->ip.src_addr, hdr->tcp.dst_port, hdr->tcp.src_port};
+    for (uint32_t i = conn_hash(&key);; i = (i + 1) & (CONN_TABLE_SIZE - 1))
+    {
+        struct conn_slot *slot = &conn_table.slots[i];
+        if (slot->conn < 0)
+            return NULL;
+        if (conn_key_eq(&slot->key, &key))
+            return &conns[slot->conn];
+    }
+}
+/*
+    This function returns the connection of the fixed session a frame of len bytes belongs to, NULL if it is none of theirs.
+*/
+static inline struct tcp_conn *fixed_lookup(const struct pkt_hdr *hdr, uint32_t len)
+{
+    for (int i = 0; i < fixed.n; ++i)
+        if (fixed.conns[i]->fixed_ops->rx_match(hdr, len))
+            return fixed.conns[i];
+    return NULL;
+}
+/*
+    This function adds a connection to the table under its 4-tuple.
+    Connections are never removed, so there are no tombstones to skip.
+*/
+static void conn_insert(const struct conn_key *key, int conn)
+{
+    uint32_t i = conn_hash(key);
+    while (conn_table.slots[i].conn >= 0)
+    {
+        if (conn_key_eq(&conn_table.slots[i].key, key))
+            throw std::runtime_error("Connection already exists");
+        i = (i + 1) & (CONN_TABLE_SIZE - 1);
+    }
+    conn_table.slots[i].key = *key;
+    conn_table.slots[i].conn = conn;
+}
+
+/*
+    This function polls the NIC for events.
+    It returns events set aside by tx_wait_space before polling the NIC.
+*/
+static int poll_nic(struct nic_event *evs, int max_evs)
+{
+    int n_ev = 0;
+    if (backlog.head == backlog.tail)
+        n_ev = nic->poll(evs, max_evs);
+    while (n_ev < max_evs && backlog.head != backlog.tail)
+        evs[n_ev++] = backlog.evs[backlog.head++ % backlog.size];
+    capture_rx(evs, n_ev);
+    return n_ev;
+}
+/*
+    This function handles a TX completion event.
+    It returns the completed buffers to the free pool in one batch.
+    It then refills the RX ring.
+*/
+static void tx_complete(const struct nic_event *ev)
+{
+    assert(ev->len <= tx.added - tx.removed);
+    uint64_t now = tsc_now();
+    for (uint32_t i = 0; i < ev->len; ++i)
+    {
+        unsigned slot = tx.removed++ & (pbs.tx_ring_size - 1);
+        lat_record(LAT_STAGE::POST_TO_COMPLETE, now - tx.tsc[slot]);
+        pkt_buf_release(tx.ids[slot]);
+    }
+    // the hardware timestamp is for the last frame of the event
+    if (ev->hw_ns != 0 && ev->len > 0)
+    {
+        uint64_t posted = tsc_to_realtime_ns(tx.tsc[(tx.removed - 1) & (pbs.tx_ring_size - 1)]);
+        if (ev->hw_ns > posted)
+            lat_record(LAT_STAGE::POST_TO_WIRE, ev->hw_ns - posted);
+    }
+    assert(ev->len == 0 || tx.ids[(tx.removed - 1) & (pbs.tx_ring_size - 1)] == ev->id);
+    vi_refill_rx_ring();
+}
+/*
+    This function returns whether the TX ring has room for one more frame.
+*/
+static inline bool tx_ring_space()
+{
+    return tx.added - tx.removed < (unsigned)pbs.tx_ring_size - 1;
+}
+/*
+    This function returns whether the TX ring has room and a buffer is free for a frame of frame_len bytes.
+*/
+static inline bool tx_space(uint32_t frame_len)
+{
+    if (!tx_ring_space())
+        return false;
+    return pbs.free_pool_n > 0 || (frame_len <= PKT_BUF_SMALL_SIZE && pbs.free_small_n > 0);
+}
+/*
+    This function waits until the TX ring, and unless the frame already has its buffer the packet pool, can take a frame of frame_len bytes.
+    It handles TX completions as they arrive.
+    It sets every other event aside for the next poll.
+*/
+static void tx_wait_space(uint32_t frame_len, bool has_buf)
+{
+    const unsigned backlog_size = backlog.size;
+    struct nic_event evs[NIC_POLL_MAX_EVS];
+    // frames still queued behind the doorbell would never complete
+    tx_flush();
+    while (has_buf ? !tx_ring_space() : !tx_space(frame_len))
+    {
+        if (tx.added == tx.removed)
+            throw std::runtime_error("Out of packet buffers");
+        int n_ev = nic->poll(evs, sizeof(evs) / sizeof(evs[0]));
+        for (int i = 0; i < n_ev; ++i)
+        {
+            if (evs[i].type == NIC_EVENT::TX)
+            {
+                tx_complete(&evs[i]);
+                continue;
+            }
+            if (backlog.tail - backlog.head == backlog_size)
+                throw std::runtime_error("Event backlog overflow");
+            backlog.evs[backlog.tail++ % backlog_size] = evs[i];
+        }
+    }
+}
+
+/**
+ * @brief Send a packet with the given payload, payload length, flags, sequence number, and acknowledgment number
+ * Note: seq and ack are numbers to be sent with the packet
+ * Note: the buffer is freed when the NIC reports the transmit complete
+ * @param payload
+ * @param payload_len
+ * @param flags
+ * @param seq
+ * @param ack
+ */
+
+static void send_packet(struct tcp_conn *c, char *payload, int payload_len, uint8_t flags, uint32_t seq, uint32_t ack)
+{
+    tx_buf_send(c, tx_buf_alloc(sizeof(struct pkt_hdr) + payload_len), payload, payload_len, flags, seq, ack);
+}
+/*
+    This function takes a TX buffer for a frame of up to frame_len bytes, a small one if it fits and one is free.
+    It applies backpressure rather than overflowing the TX ring.
+*/
+static uint32_t tx_buf_alloc(uint32_t frame_len)
+{
+    if (!tx_space(frame_len))
+        tx_wait_space(frame_len, false);
+    uint32_t id;
+    if (frame_len <= PKT_BUF_SMALL_SIZE && pbs.free_small_n > 0)
+    {
+        id = pbs.free_small;
+        pbs.free_small = pbs.bufs[id].next;
+        --pbs.free_small_n;
+    }
+    else
+    {
+        id = pbs.free_pool;
+        pbs.free_pool = pbs.bufs[id].next;
+        --pbs.free_pool_n;
+    }
+    pbs.bufs[id].refs = 1;
+    return id;
+}
+/*
+    This function returns the start of the frame in a TX buffer, where the NIC reads from.
+*/
+static inline char *tx_frame(uint32_t id)
+{
+    return pkt_buf_dma(id);
+}
+/*
+    This function builds the frame in a TX buffer taken with tx_buf_alloc and hands it to the NIC.
+    The payload is copied in, unless it already sits right after the header.
+*/
+static void tx_buf_send(struct tcp_conn *c, uint32_t id, const char *payload, int payload_len, uint8_t flags, uint32_t seq, uint32_t ack)
+{
+    // build packet from the connection's header template, straight into the DMA buffer
+    rcv_wnd_update(c);
+    if (c->fixed_ops != NULL)
+    {
+        fixed_build(c, id, payload, payload_len, flags, seq, ack);
+    }
+    else if (nic_offloads & NIC_OFFLOAD_TX_CSUM)
+    {
+        // the NIC sums the payload as it reads it, so it is only copied
+        char *dst = tx_frame(id) + sizeof(struct pkt_hdr);
+        if (payload_len > 0 && payload != dst)
+            memcpy(dst, payload, payload_len);
+        build_tcp_header_offload(&c->tx_tmpl, payload_len, flags, seq, ack, tx_frame(id));
+    }
+    else
+    {
+        build_tcp_packet_from_template(&c->tx_tmpl, payload, payload_len, flags, seq, ack, tx_frame(id));
+    }
+    tx_buf_post(c, id, payload_len, flags, seq);
+    tx_kick();
+}
+/*
+    This function returns whether the frames a connection sends carry checksums computed by the stack, so their payload is summed.
+    A fixed session decides for itself, other connections leave them to the NIC when it can fill them in.
+*/
+static inline bool tx_csum_sw(const struct tcp_conn *c)
+{
+    if (c->fixed_ops != NULL)
+        return c->fixed_ops->csum == CSUM_MODE::SOFTWARE;
+    return !(nic_offloads & NIC_OFFLOAD_TX_CSUM);
+}
+/*
+    This function builds a frame of a fixed session in a TX buffer, copying the payload in unless it already sits after the header.
+    The payload is only summed when the session computes its own checksums.
+*/
+static void fixed_build(struct tcp_conn *c, uint32_t id, const char *payload, int payload_len, uint8_t flags, uint32_t seq, uint32_t ack)
+{
+    char *frame = tx_frame(id);
+    char *dst = frame + sizeof(struct pkt_hdr);
+    uint32_t sum = 0;
+    if (payload_len > 0 && !tx_csum_sw(c))
+    {
+        if (payload != dst)
+            memcpy(dst, payload, payload_len);
+    }
+    else if (payload == dst)
+    {
+        sum = csum_partial(payload, payload_len, 0);
+    }
+    else if (payload_len > 0)
+    {
+        sum = csum_copy_partial(dst, payload, payload_len, 0);
+    }
+    c->fixed_ops->tx_build(frame, sum, payload_len, flags, seq, ack, c->tx_tmpl.hdr.tcp.window);
+}
+/*
+    This function queues a built frame on the NIC without ringing the doorbell.
+    A frame with the ACK flag takes the place of a held ACK.
+    Segments that take up sequence space are kept in the retransmission queue until acknowledged.
+*/
+static void tx_buf_post(struct tcp_conn *c, uint32_t id, int payload_len, uint8_t flags, uint32_t seq)
+{
+    // the header may carry options, so the frame length is taken from it
+    uint16_t frame_len = sizeof(struct eth_hdr) + ntohs(((struct pkt_hdr *)tx_frame(id))->ip.tot_len);
+    int rc = nic->transmit_init(pbs.cold[id].dma_addr, frame_len, id);
+    if (rc != 0)
+    {
+        throw std::runtime_error("Failed to transmit");
+    }
+    // the NIC owns the buffer until the completion comes back
+    uint64_t now = tsc_now();
+    tx_ring_add(id, now);
+    capture_tx(id, frame_len, now);
+    if (send_tsc != 0 && payload_len > 0)
+        lat_record(LAT_STAGE::SEND_TO_POST, now - send_tsc);
+    // every frame is built with the current rcv_nxt, so it acknowledges everything held
+    if (flags & (uint8_t)TCP_FLAGS::ACK)
+        ack_sent(c);
+    uint32_t seq_len = payload_len + ((flags & (uint8_t)TCP_FLAGS::SYN) ? 1 : 0) + ((flags & (uint8_t)TCP_FLAGS::FIN) ? 1 : 0);
+    if (seq_len > 0)
+        rtx_push(c, id, seq, seq + seq_len, frame_len);
+}
+/*
+    This function records a latency sample for a stage, unless built with EF_TCP_NO_LATENCY.
+*/
+static inline void lat_record(LAT_STAGE stage, uint64_t value)
+{
+#ifndef EF_TCP_NO_LATENCY
+    hdr_record(&lat[(int)stage], value);
+#else
+    (void)stage;
+    (void)value;
+#endif
+}
+/*
+    This function copies a frame queued on the NIC to the capture, if one is running.
+    It compiles to nothing when built with EF_TCP_NO_CAPTURE.
+*/
+static inline void capture_tx(uint32_t id, uint32_t len, uint64_t tsc)
+{
+#ifndef EF_TCP_NO_CAPTURE
+    if (capturing)
+        capture_frame(&cap, tx_frame(id), len, tsc);
+#else
+    (void)id;
+    (void)len;
+    (void)tsc;
+#endif
+}
+/*
+    This function copies the frames of the RX events from the NIC to the capture, if one is running.
+    They are stamped with the time they were polled.
+*/
+static inline void capture_rx(const struct nic_event *evs, int n_ev)
+{
+#ifndef EF_TCP_NO_CAPTURE
+    if (!capturing)
+        return;
+    uint64_t now = tsc_now();
+    for (int i = 0; i < n_ev; ++i)
+    {
+        if (evs[i].type != NIC_EVENT::RX)
+            continue;
+        capture_frame(&cap, rx_frame(evs[i].id), evs[i].len - pbs.rx_prefix_len, now);
+    }
+#else
+    (void)evs;
+    (void)n_ev;
+#endif
+}
+/*
+    This function adds a buffer queued on the NIC to the TX ring, with the time it was queued.
+    It then counts it as a frame waiting behind the doorbell.
+*/
+static inline void tx_ring_add(uint32_t id, uint64_t tsc)
+{
+    tx.tsc[tx.added & (pbs.tx_ring_size - 1)] = tsc;
+    tx.ids[tx.added++ & (pbs.tx_ring_size - 1)] = id;
+    tx_queued();
+}
+/*
+    This function counts a frame queued behind the doorbell, noting when the oldest one was queued.
+*/
+static inline void tx_queued(void)
+{
+    // the clock is only read when a held batch starts
+    if (batch.queued++ == 0 && batch.depth > 0)
+        batch.first_ns = now_ns();
+}
+/*
+    This function rings the doorbell for every frame queued on the NIC.
+*/
+static inline void tx_flush(void)
+{
+    if (batch.queued == 0)
+        return;
+    nic->transmit_push();
+    batch.queued = 0;
+}
+/*
+    This function rings the doorbell after a frame has been queued, unless a batch is open.
+    An open batch is flushed once it holds TX_BATCH_MAX frames or its oldest frame has waited TX_BATCH_LATENCY_NS.
+*/
+static inline void tx_kick(void)
+{
+    if (batch.depth == 0 || batch.queued >= TX_BATCH_MAX ||
+        now_ns() - batch.first_ns >= TX_BATCH_LATENCY_NS)
+        tx_flush();
+}
+/*
+    This function waits for acknowledgments while the retransmission queue of a connection is full.
+    Segments held behind the doorbell are sent first, as they could not be acknowledged otherwise.
+*/
+static void rtx_wait_space(struct tcp_conn *c)
+{
+    if (c->rtx.tail - c->rtx.head < RTX_QUEUE_SIZE)
+        return;
+    tx_flush();
+    while (c->rtx.tail - c->rtx.head == RTX_QUEUE_SIZE)
+        poll_events();
+}
+/*
+    This function waits until a new segment of len bytes may be sent on a connection:
+    there is room in the retransmission queue, the bytes in flight stay within the congestion window and the window
+    of the peer, and with pacing on, the segment's turn has come. Events are handled while waiting, so ACKs open the windows.
+    With nothing in flight a segment always goes, so a closed window cannot stall the connection for good.
+*/
+static void send_wait(struct tcp_conn *c, uint32_t len)
+{
+    rtx_wait_space(c);
+    if (c->cc_ops == NULL)
+        return;
+    if (c->snd_nxt != c->snd_una && c->snd_nxt - c->snd_una + len > std::min(c->cc.cwnd, c->snd_wnd))
+    {
+        tx_flush();
+        while (c->snd_nxt != c->snd_una && c->snd_nxt - c->snd_una + len > std::min(c->cc.cwnd, c->snd_wnd))
+            poll_events();
+    }
+    if (c->pacing)
+        pace_wait(c, len);
+}
+/*
+    This function waits for the pacing time of a segment of len bytes, then books the time of the next one.
+    Segments leave at a rate of a gain times cwnd per smoothed RTT, with up to PACE_BURST_SEGS back to back after an idle period.
+    Nothing is paced before the first RTT sample.
+*/
+static void pace_wait(struct tcp_conn *c, uint32_t len)
+{
+    if (c->rtx.srtt_ns == 0)
+        return;
+    uint64_t now = tsc_now();
+    if ((int64_t)(c->pace_next_tsc - now) > 0)
+    {
+        tx_flush();
+        while ((int64_t)(c->pace_next_tsc - (now = tsc_now())) > 0)
+            poll_events();
+    }
+    // cwnd bytes per srtt, faster in slow start so the window can still double every RTT
+    uint64_t rate = (uint64_t)c->cc.cwnd * (c->cc.cwnd < c->cc.ssthresh ? PACE_GAIN_SS_PCT : PACE_GAIN_CA_PCT);
+    uint64_t credit = ns_to_tsc((uint64_t)PACE_BURST_SEGS * c->cc.mss * c->rtx.srtt_ns * 100 / rate);
+    if ((int64_t)(c->pace_next_tsc - (now - credit)) < 0)
+        c->pace_next_tsc = now - credit;
+    c->pace_next_tsc += ns_to_tsc((uint64_t)len * c->rtx.srtt_ns * 100 / rate);
+}
+/*
+    This function passes an ACK of acked new bytes to the congestion control of a connection.
+    The window is held during fast recovery, and grows again once the data in flight at the loss is acknowledged.
+*/
+static inline void cc_ack(struct tcp_conn *c, uint32_t acked, uint64_t now)
+{
+    if (c->cc_ops == NULL)
+        return;
+    if (c->cc.recovering)
+    {
+        c->cc.recovering = c->rtx.in_recovery;
+        return;
+    }
+    c->cc_ops->on_ack(&c->cc, acked, now, c->rtx.srtt_ns);
+}
+/*
+    This function tells the congestion control of a connection about a loss found by duplicate ACKs.
+*/
+static inline void cc_loss(struct tcp_conn *c)
+{
+    if (c->cc_ops == NULL)
+        return;
+    c->cc_ops->on_loss(&c->cc, c->snd_nxt - c->snd_una);
+    c->cc.recovering = true;
+}
+/*
+    This function tells the congestion control of a connection that the retransmission timer expired.
+    Slow start takes over from fast recovery.
+*/
+static inline void cc_timeout(struct tcp_conn *c)
+{
+    if (c->cc_ops == NULL)
+        return;
+    c->cc_ops->on_timeout(&c->cc, c->snd_nxt - c->snd_una);
+    c->cc.recovering = false;
+}
+/*
+    This function adds a sent segment to the retransmission queue.
+    It takes a reference on the TX buffer so the frame can be sent again.
+    It starts the retransmission timer and an RTT measurement if none is running.
+*/
+static void rtx_push(struct tcp_conn *c, uint32_t id, uint32_t seq, uint32_t end, uint16_t frame_len)
+{
+    if (c->rtx.tail - c->rtx.head == RTX_QUEUE_SIZE)
+        throw std::runtime_error("Retransmission queue full");
+    struct rtx_seg *seg = &c->rtx.segs[c->rtx.tail++ & (RTX_QUEUE_SIZE - 1)];
+    seg->seq = seq;
+    seg->end = end;
+    seg->buf_id = id;
+    seg->frame_len = frame_len;
+    ++pkt_buf_from_id(id)->refs;
+    // only read the clock when the timer or the RTT measurement needs starting
+    if (c->rtx.deadline_ns == 0 || !c->rtx.timing)
+    {
+        uint64_t now = now_ns();
+        if (c->rtx.deadline_ns == 0)
+            c->rtx.deadline_ns = now + c->rtx.rto_ns;
+        if (!c->rtx.timing)
+        {
+            c->rtx.timing = true;
+            c->rtx.rtt_seq = end;
+            c->rtx.rtt_start_ns = now;
+        }
+    }
+}
+/*
+    This function removes every segment acknowledged by ack from the retransmission queue.
+    It takes an RTT sample if the timed segment is covered.
+    It then restarts the retransmission timer.
+    During loss recovery it retransmits the next segment on a partial ACK.
+*/
+static void rtx_ack(struct tcp_conn *c, uint32_t ack, uint64_t now)
+{
+    if (c->rtx.timing && seq_geq(ack, c->rtx.rtt_seq))
+    {
+        // RFC 6298 smoothing
+        uint64_t rtt = now - c->rtx.rtt_start_ns;
+        if (c->rtx.srtt_ns == 0)
+        {
+            c->rtx.srtt_ns = rtt;
+            c->rtx.rttvar_ns = rtt / 2;
+        }
+        else
+        {
+            uint64_t delta = c->rtx.srtt_ns > rtt ? c->rtx.srtt_ns - rtt : rtt - c->rtx.srtt_ns;
+            c->rtx.rttvar_ns = (3 * c->rtx.rttvar_ns + delta) / 4;
+            c->rtx.srtt_ns = (7 * c->rtx.srtt_ns + rtt) / 8;
+        }
+        c->rtx.timing = false;
+    }
+    // forward progress undoes any backoff
+    if (c->rtx.srtt_ns != 0)
+        c->rtx.rto_ns = std::max<uint64_t>(RTO_MIN_NS, std::min<uint64_t>(RTO_MAX_NS, c->rtx.srtt_ns + 4 * c->rtx.rttvar_ns));
+    while (c->rtx.head != c->rtx.tail)
+    {
+        struct rtx_seg *seg = &c->rtx.segs[c->rtx.head & (RTX_QUEUE_SIZE - 1)];
+        if (seq_gt(seg->end, ack))
+            break;
+        pkt_buf_release(seg->buf_id);
+        ++c->rtx.head;
+    }
+    c->rtx.dupacks = 0;
+    c->rtx.retries = 0;
+    c->rtx.deadline_ns = c->rtx.head == c->rtx.tail ? 0 : now + c->rtx.rto_ns;
+    // a partial ACK during recovery means the next segment was lost too (RFC 6582)
+    if (c->rtx.in_recovery)
+    {
+        if (seq_lt(ack, c->rtx.recover) && c->rtx.head != c->rtx.tail)
+            rtx_retransmit_head(c);
+        else
+            c->rtx.in_recovery = false;
+    }
+}
+/*
+    This function sends the oldest unacknowledged segment again from its TX buffer.
+*/
+static void rtx_retransmit_head(struct tcp_conn *c)
+{
+    struct rtx_seg *seg = &c->rtx.segs[c->rtx.head & (RTX_QUEUE_SIZE - 1)];
+    uint32_t id = seg->buf_id;
+    // Karn's algorithm, an ACK for a retransmitted segment is not an RTT sample
+    c->rtx.timing = false;
+    // the segment reposts the buffer it holds, so only a descriptor is needed, and waiting on the pool could stall
+    // the retransmit that would free buffers
+    if (!tx_ring_space())
+        tx_wait_space(seg->frame_len, true);
+    int rc = nic->transmit_init(pbs.cold[id].dma_addr, seg->frame_len, id);
+    if (rc != 0)
+    {
+        throw std::runtime_error("Failed to retransmit");
+    }
+    ++pkt_buf_from_id(id)->refs;
+    uint64_t now = tsc_now();
+    tx_ring_add(id, now);
+    capture_tx(id, seg->frame_len, now);
+    tx_kick();
+}
+/*
+    This function retransmits the oldest segment if the retransmission timer has expired.
+    It doubles the timeout on every expiry and gives up after RTX_MAX_RETRIES.
+*/
+static void rtx_check_timer(struct tcp_conn *c)
+{
+    if (c->rtx.deadline_ns == 0)
+        return;
+    uint64_t now = now_ns();
+    if (now < c->rtx.deadline_ns)
+        return;
+    if (++c->rtx.retries > RTX_MAX_RETRIES)
+        throw std::runtime_error("Retransmission timeout");
+    c->rtx.rto_ns = std::min<uint64_t>(RTO_MAX_NS, c->rtx.rto_ns * 2);
+    // only the first expiry says anything new about congestion
+    if (c->rtx.retries == 1)
+        cc_timeout(c);
+    c->rtx.in_recovery = true;
+    c->rtx.recover = c->snd_nxt;
+    rtx_retransmit_head(c);
+    c->rtx.deadline_ns = now + c->rtx.rto_ns;
+}
+/*
+    This function runs the retransmission timer of every connection.
+    It then rings the doorbell if a held batch has reached TX_BATCH_LATENCY_NS.
+*/
+static void check_timers(void)
+{
+    for (int i = 0; i < n_conns; ++i)
+        rtx_check_timer(&conns[i]);
+    // ACKs held outside handle_events, e.g. while waiting for the handshake, go out on the next poll without a delay
+    if (ack.held != 0)
+        ack_flush(ack.delay_ns > 0);
+    if (batch.queued > 0 && now_ns() - batch.first_ns >= TX_BATCH_LATENCY_NS)
+        tx_flush();
+}
+/*
+    This function returns the time until the first retransmission or delayed ACK timer of any connection expires,
+    at most max_ns.
+*/
+static uint64_t timer_next_ns(uint64_t max_ns)
+{
+    uint64_t now = now_ns();
+    uint64_t next = now + max_ns;
+    for (int i = 0; i < n_conns; ++i)
+    {
+        if (conns[i].rtx.deadline_ns != 0)
+            next = std::min(next, conns[i].rtx.deadline_ns);
+        if (conns[i].ack_deadline_ns != 0)
+            next = std::min(next, conns[i].ack_deadline_ns);
+    }
+    return next > now ? next - now : 0;
+}
+/*
+    This function adds one to a wait counter, as a plain relaxed store since the stack is its only writer.
+*/
+static inline void wait_count(std::atomic<uint64_t> *counter)
+{
+    counter->store(counter->load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+/*
+    This function notes that a wait found events, updating the smoothed gap between events
+    and, in the adaptive mode, the spin budget of the next wait.
+    Gaps are clamped to a few spin budgets, so a session coming back from a quiet night adapts within a few events.
+*/
+static void wait_found(uint64_t now)
+{
+    if (waiter.last_tsc != 0)
+    {
+        uint64_t gap = std::min(tsc_to_ns(now - waiter.last_tsc), 4 * waiter.spin_ns);
+        waiter.gap_ns = waiter.gap_ns == 0 ? gap : (7 * waiter.gap_ns + gap) / 8;
+    }
+    waiter.last_tsc = now;
+    if (waiter.mode == WAIT_MODE::ADAPTIVE && waiter.gap_ns != 0)
+        waiter.budget_ns = 2 * waiter.gap_ns <= waiter.spin_ns ? std::max<uint64_t>(2 * waiter.gap_ns, WAIT_SPIN_MIN_NS) : WAIT_SPIN_MIN_NS;
+}
+/*
+    This function polls the NIC until it has events or timeout_ns has passed (negative: forever), waiting as the wait mode says.
+    It runs the timers while spinning, and never blocks past the next timer or with frames held behind the doorbell.
+    It returns the number of events polled, 0 on timeout.
+*/
+static int wait_events(struct nic_event *evs, int max_evs, int64_t timeout_ns)
+{
+    uint64_t start = tsc_now();
+    uint64_t limit = timeout_ns < 0 ? UINT64_MAX : start + ns_to_tsc(timeout_ns);
+    uint64_t spin_end = waiter.mode == WAIT_MODE::SPIN ? UINT64_MAX : start + ns_to_tsc(waiter.budget_ns);
+    bool spun = false;
+    waiter.woken = false;
+    while (true)
+    {
+        check_timers();
+        int n_ev = poll_nic(evs, max_evs);
+        uint64_t now = tsc_now();
+        if (n_ev > 0)
+        {
+            if (spun)
+                wait_count(&wait_stats.spins);
+            wait_found(now);
+            return n_ev;
+        }
+        if (now >= limit)
+            return 0;
+        spun = true;
+        if (now < spin_end)
+            continue;
+        // nothing queued on the NIC may wait for a doorbell while the thread sleeps
+        tx_flush();
+        uint64_t block_ns = timer_next_ns(WAIT_BLOCK_MAX_NS);
+        if (limit != UINT64_MAX)
+            block_ns = std::min(block_ns, tsc_to_ns(limit - now));
+        wait_count(&wait_stats.blocks);
+        int rc = nic->wait(block_ns);
+        if (rc < 0)
+            throw std::runtime_error("Failed to wait for NIC events: " + std::string(strerror(-rc)));
+        wait_count(rc > 0 ? &wait_stats.wakeups : &wait_stats.timeouts);
+        waiter.woken = rc > 0;
+        // after a block, one poll decides between another block and returning
+        spun = false;
+        spin_end = tsc_now();
+    }
+}
+/*
+    This function releases every segment in the retransmission queue and stops the timer.
+*/
+static void rtx_clear(struct tcp_conn *c)
+{
+    while (c->rtx.head != c->rtx.tail)
+        pkt_buf_release(c->rtx.segs[c->rtx.head++ & (RTX_QUEUE_SIZE - 1)].buf_id);
+    c->rtx.deadline_ns = 0;
+    c->rtx.timing = false;
+    c->rtx.in_recovery = false;
+    c->rtx.dupacks = 0;
+    c->rtx.retries = 0;
+}
+/*
+    This function processes the acknowledgment number of an incoming segment.
+    It advances snd_una and trims the retransmission queue when new data is acknowledged.
+    It counts duplicate ACKs and fast retransmits after DUPACK_THRESHOLD of them.
+*/
+static void process_ack(struct tcp_conn *c, uint32_t ack_num, bool pure_ack)
+{
+    if (seq_gt(ack_num, c->snd_nxt))
+    {
+        throw std::runtime_error("Invalid or malicious ACK received");
+    }
+    if (seq_gt(ack_num, c->snd_una))
+    {
+        uint64_t now = now_ns();
+        uint32_t acked = ack_num - c->snd_una;
+        c->snd_una = ack_num;
+        rtx_ack(c, ack_num, now);
+        cc_ack(c, acked, now);
+    }
+    else if (ack_num == c->snd_una && pure_ack && c->rtx.head != c->rtx.tail)
+    {
+        if (++c->rtx.dupacks == DUPACK_THRESHOLD && !c->rtx.in_recovery)
+        {
+            c->rtx.in_recovery = true;
+            c->rtx.recover = c->snd_nxt;
+            cc_loss(c);
+            rtx_retransmit_head(c);
+        }
+    }
+    // anything older was reordered or duplicated and says nothing new
+}
+
+/*
+    This function returns whether the checksums of a received TCP frame of len bytes, whose lengths tcp_frame_ok has checked, are right.
+    With NIC_OFFLOAD_RX_CSUM the NIC has already checked them and discarded the frame if not, so the payload is not read again.
+*/
+static inline bool rx_csum_ok(const struct pkt_hdr *hdr, uint32_t len)
+{
+    if (nic_offloads & NIC_OFFLOAD_RX_CSUM)
+        return true;
+    return tcp_checksums_ok(hdr, len);
+}
+/*
+    This function drops a received frame the NIC discarded or whose lengths or checksums are wrong, counting it for ef_rx_discarded.
+*/
+static void rx_discard(uint32_t id)
+{
+    // the stack thread is the only writer
+    rx_discards.store(rx_discards.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    pkt_buf_free(id);
+    vi_refill_rx_ring();
+}
+/*
+ * Receive a packet and verify the seq, ack, and flags are as expected, but must free buffer after
+ */
+static std::tuple<struct pkt_hdr *, uint32_t, uint8_t> receive_packet(struct tcp_conn *c, uint8_t flags, uint32_t seq, uint32_t ack)
+{
+    struct nic_event evs[NIC_POLL_MAX_EVS];
+    uint8_t received_flags = 0;
+    while (true)
+    {
+        int n_ev = wait_events(evs, sizeof(evs) / sizeof(evs[0]), -1);
+        for (int i = 0; i < n_ev; ++i)
+        {
+            switch (evs[i].type)
+            {
+            case NIC_EVENT::TX:
+                tx_complete(&evs[i]);
+                break;
+            case NIC_EVENT::TX_ERROR:
+                throw std::runtime_error("Transmit failed");
+            case NIC_EVENT::RX:
+            {
+                auto id = evs[i].id;
+                uint32_t len = evs[i].len - pbs.rx_prefix_len;
+                struct pkt_hdr *hdr = (struct pkt_hdr *)rx_frame(id);
+                if (hdr->eth.ether_type != htons(ETH_P_IP) || !tcp_frame_ok(hdr, len) || hdr->ip.protocol != IPPROTO_TCP ||
+                    conn_lookup(hdr) != c)
+                {
+                    // other connections carry on as usual, and handle_rx drops what is not a valid TCP frame
+                    handle_rx(id, len);
+                    break;
+                }
+                if (!rx_csum_ok(hdr, len))
+                {
+                    rx_discard(id);
+                    break;
+                }
+                received_flags = received_flags | hdr->tcp.flags;
+                if ((received_flags & flags) == flags)
+                {
+                    return std::make_tuple(hdr, (uint32_t)ntohs(hdr->ip.tot_len) - (uint32_t)((hdr->ip.version_ihl & 0x0F) * 4) - (uint32_t)((hdr->tcp.data_off_reserved >> 4) * 4), id);
+                }
+                // keep loss recovery going while waiting
+                if (hdr->tcp.flags & (uint8_t)TCP_FLAGS::ACK)
+                    process_ack(c, ntohl(hdr->tcp.ack_num), false);
+                pkt_buf_free(id);
+                vi_refill_rx_ring();
+                break;
+                /*if ((flags & (uint8_t)TCP_FLAGS::SYN) && (hdr->tcp.flags & (uint8_t)TCP_FLAGS::SYN) == 0)
+                {
+                    throw std::runtime_error("SYN not received when expected");
+                }
+                if ((flags & (uint8_t)TCP_FLAGS::ACK) && (hdr->tcp.flags & (uint8_t)TCP_FLAGS::ACK) == 0)
+                {
+                    throw std::runtime_error("ACK not received when expected");
+                }*/
+            }
+            case NIC_EVENT::RX_DISCARD:
+                rx_discard(evs[i].id);
+                break;
+            default:
+                throw std::runtime_error("Unexpected event type: " + std::to_string((int)evs[i].type));
+                break;
+            }
+        }
+    }
+}
+
+static void send_connection_handshake(struct tcp_conn *c)
+{
+    // Send SYN packet, offering our MSS, window scaling and SACK. Timestamps are not offered, as they would have to
+    // go on every segment and move the payload that ef_send_acquire hands out
+    char *payload = NULL;
+    uint32_t payload_len = 0;
+    uint8_t flags = (uint8_t)TCP_FLAGS::SYN;
+    struct tcp_opts opts;
+    opts.mss = MAX_PAYLOAD_SIZE;
+    opts.wscale = RCV_WSCALE;
+    opts.sack_ok = true;
+    uint32_t buf_id = tx_buf_alloc(sizeof(struct pkt_hdr) + TCP_OPTS_MAX_LEN);
+    rcv_wnd_update(c);
+    build_tcp_packet_with_options(&c->tx_tmpl, &opts, flags, c->snd_nxt, c->rcv_nxt, tx_frame(buf_id));
+    tx_buf_post(c, buf_id, payload_len, flags, c->snd_nxt);
+    tx_kick();
+
+    // handle SYN-ACK
+    flags = (uint8_t)TCP_FLAGS::SYN | (uint8_t)TCP_FLAGS::ACK;
+    uint32_t s_seq = 0; // don't care
+    uint32_t s_ack = c->snd_nxt + 1;
+    std::cout << "Trying to receive SYN-ACK" << std::endl;
+    auto [tcp_pkt, len, id] = receive_packet(c, flags, s_seq, s_ack);
+    std::cout << "Received SYN-ACK" << std::endl;
+    uint32_t server_seq = ntohl(tcp_pkt->tcp.seq_num); // this is the seq number of the server
+    struct tcp_opts peer;
+    parse_tcp_options(&tcp_pkt->tcp, &peer);
+    c->snd_mss = peer.mss != 0 ? std::min<uint16_t>(peer.mss, MAX_PAYLOAD_SIZE) : TCP_DEFAULT_MSS;
+    // windows are only scaled when both sides ask for it, and never in the SYN-ACK itself
+    c->snd_wscale = peer.wscale >= 0 ? peer.wscale : 0;
+    c->rcv_wscale = peer.wscale >= 0 ? RCV_WSCALE : 0;
+    c->sack_ok = peer.sack_ok;
+    c->snd_wnd = ntohs(tcp_pkt->tcp.window);
+    c->snd_nxt += 1;
+    process_ack(c, ntohl(tcp_pkt->tcp.ack_num), false); // releases the SYN
+    // the window starts from the MSS the peer asked for
+    if (c->cc_ops)
+        c->cc_ops->init(&c->cc, c->snd_mss);
+    pkt_buf_free(id);
+    vi_refill_rx_ring();
+    std::cout << "Refilled RX ring" << std::endl;
+    c->rcv_nxt = server_seq + 1;
+    c->rcv_adv = c->rcv_nxt;
+
+    // send ACK
+    flags = (uint8_t)TCP_FLAGS::ACK;
+    send_packet(c, payload, payload_len, flags, c->snd_nxt, c->rcv_nxt);
+    c->established = true;
+
+    // send_hello_world(c);
+}
+
+static void send_tcp_teardown(struct tcp_conn *c)
+{
+    rtx_wait_space(c);
+
+    // send FIN-ACK
+    uint8_t flags = (uint8_t)TCP_FLAGS::FIN | (uint8_t)TCP_FLAGS::ACK;
+    char *payload = NULL;
+    uint32_t payload_len = 0;
+    send_packet(c, payload, payload_len, flags, c->snd_nxt, c->rcv_nxt);
+    c->snd_nxt += 1;
+
+    // receive FIN-ACK
+    flags = (uint8_t)TCP_FLAGS::ACK | (uint8_t)TCP_FLAGS::FIN;
+    auto [tcp_pkt, len, id] = receive_packet(c, flags, c->rcv_nxt, c->snd_nxt);
+    process_ack(c, ntohl(tcp_pkt->tcp.ack_num), false); // releases the FIN
+    pkt_buf_free(id);
+    vi_refill_rx_ring();
+    c->rcv_nxt += 1;
+
+    // send ACK
+    flags = (uint8_t)TCP_FLAGS::ACK;
+    payload = NULL;
+    payload_len = 0;
+    send_packet(c, payload, payload_len, flags, c->snd_nxt, c->rcv_nxt);
+    reset_variables(c);
+}
+
+static void send_hello_world(struct tcp_conn *c)
+{
+    uint8_t flags = (uint8_t)TCP_FLAGS::ACK;
+    char *payload = "Hello World\n";
+    size_t payload_len = strlen(payload);
+    send_packet(c, payload, payload_len, flags, c->snd_nxt, c->rcv_nxt);
+    c->snd_nxt += payload_len;
+    // rcv_next += TODO update rcv_next with response
+}
+
+void ef_init_tcp_client()
+{
+    ef_init_tcp_client(&ef_default_config);
+}
+
+void ef_init_tcp_client(const struct nic_backend *backend)
+{
+    nic = backend;
+    ef_init_tcp_client();
+}
+
+void ef_init_tcp_client(const struct ef_config *config)
+{
+    endpoint = *config;
+    tsc_calibrate();
+    TRY(init_pkts_memory(config));
+    TRY(init(endpoint.intf));
+    default_conn = ef_conn_open(endpoint.remote_addr, endpoint.local_port, endpoint.remote_port);
+    return;
+}
+
+void ef_init_tcp_client(const struct nic_backend *backend, const struct ef_config *config)
+{
+    nic = backend;
+    ef_init_tcp_client(config);
+}
+
+struct tcp_conn *ef_conn_open(uint16_t local_port, uint16_t remote_port)
+{
+    return ef_conn_open(endpoint.remote_addr, local_port, remote_port);
+}
+
+struct tcp_conn *ef_conn_open(uint32_t remote_addr, uint16_t local_port, uint16_t remote_port)
+{
+    static const uint8_t unresolved[ETH_ALEN] = {};
+    if (n_conns == MAX_CONNS)
+        throw std::runtime_error("Too many connections");
+    struct tcp_conn *c = &conns[n_conns];
+    init_pkt_hdr_template(&c->tx_tmpl, endpoint.mac, unresolved, endpoint.addr, remote_addr, local_port, remote_port);
+    const struct pkt_hdr *hdr = &c->tx_tmpl.hdr;
+    struct conn_key key = {hdr->ip.src_addr, hdr->ip.dst_addr, hdr->tcp.src_port, hdr->tcp.dst_port};
+    conn_insert(&key, n_conns);
+    // every connection gets its own filter on the shared VI
+    TRY(nic->filter_add(key.laddr, key.lport, key.raddr, key.rport));
+    c->next_hop = next_hop_for(key.raddr);
+    c->rtx.rto_ns = RTO_INITIAL_NS;
+    c->snd_mss = MAX_PAYLOAD_SIZE;
+    c->cc_ops = &cc_newreno;
+    c->cc_ops->init(&c->cc, c->snd_mss);
+    c->rxq.descs = pbs.rx_descs + (size_t)n_conns * RX_QUEUE_SIZE;
+    c->fixed_ops = NULL;
+    ++n_conns;
+    rx_share_update(nic->rx_space());
+    return c;
+}
+/*
+    This function returns the address frames to raddr are sent to, raddr itself on the local subnet or the gateway.
+    Addresses are in network byte order.
+*/
+static uint32_t next_hop_for(uint32_t raddr)
+{
+    uint32_t mask = htonl(endpoint.netmask);
+    if (endpoint.gateway == 0 || (raddr & mask) == (htonl(endpoint.addr) & mask))
+        return raddr;
+    return htonl(endpoint.gateway);
+}
+/*
+    This function sends an ARP request (broadcast) or reply from the local addresses.
+*/
+static void arp_send(uint16_t oper, const uint8_t *dst_mac, uint32_t dst_addr)
+{
+    uint32_t id = tx_buf_alloc(sizeof(struct arp_pkt));
+    size_t len = build_arp_packet(oper, endpoint.mac, htonl(endpoint.addr), dst_mac, dst_addr, tx_frame(id));
+    if (nic->transmit_init(pbs.cold[id].dma_addr, len, id) != 0)
+    {
+        throw std::runtime_error("Failed to transmit");
+    }
+    uint64_t now = tsc_now();
+    tx_ring_add(id, now);
+    capture_tx(id, len, now);
+    tx_kick();
+}
+/*
+    This function handles a received ARP frame.
+    It updates the neighbor cache from the sender, as RFC 826 merges it, and repoints connections whose next hop moved.
+    It answers requests for the local address.
+*/
+static void arp_input(const struct arp_pkt *pkt)
+{
+    const struct arp_hdr *arp = &pkt->arp;
+    if (arp->htype != htons(ARPHRD_ETHER) || arp->ptype != htons(ETH_P_IP) ||
+        arp->hlen != ETH_ALEN || arp->plen != 4)
+        return;
+    bool for_us = arp->tpa == htonl(endpoint.addr);
+    // a probe comes from 0.0.0.0 and says nothing about where anyone is
+    if (arp->spa != 0 && neigh_update(&neigh, arp->spa, arp->sha, for_us))
+        neigh_apply(arp->spa);
+    if (for_us && arp->oper == htons(ARPOP_REQUEST))
+        arp_send(ARPOP_REPLY, arp->sha, arp->spa);
+}
+/*
+    This function sends ARP requests for addr until it is in the neighbor cache, serving the NIC meanwhile.
+    It returns false if nothing answered after ARP_RETRIES requests.
+*/
+static bool arp_resolve(uint32_t addr)
+{
+    struct nic_event evs[NIC_POLL_MAX_EVS];
+    for (int i = 0; i < ARP_RETRIES; ++i)
+    {
+        arp_send(ARPOP_REQUEST, NULL, addr);
+        uint64_t deadline = now_ns() + ARP_TIMEOUT_NS;
+        uint64_t now;
+        while ((now = now_ns()) < deadline)
+        {
+            int n_ev = wait_events(evs, sizeof(evs) / sizeof(evs[0]), deadline - now);
+            handle_events(evs, n_ev);
+            if (neigh_lookup(&neigh, addr) != NULL)
+                return true;
+        }
+    }
+    return false;
+}
+/*
+    This function copies the MAC of addr from the neighbor cache into every connection sent through addr.
+    Frames waiting for retransmission are patched as well, so they follow the new next hop.
+*/
+static void neigh_apply(uint32_t addr)
+{
+    const struct neigh_entry *e = neigh_lookup(&neigh, addr);
+    if (e == NULL)
+        return;
+    for (int i = 0; i < n_conns; ++i)
+    {
+        struct tcp_conn *c = &conns[i];
+        if (c->next_hop != addr)
+            continue;
+        memcpy(c->tx_tmpl.hdr.eth.dst_mac, e->mac, ETH_ALEN);
+        // the MAC is outside every checksum, so built frames can be changed in place
+        for (unsigned j = c->rtx.head; j != c->rtx.tail; ++j)
+        {
+            struct pkt_hdr *hdr = (struct pkt_hdr *)tx_frame(c->rtx.segs[j & (RTX_QUEUE_SIZE - 1)].buf_id);
+            memcpy(hdr->eth.dst_mac, e->mac, ETH_ALEN);
+        }
+        if (c->fixed_ops != NULL && !fixed_matches(c, c->fixed_ops))
+        {
+            LOGW("WARNING: next hop of a fixed session moved, sending from the header template\n");
+            ef_set_fixed(c, NULL);
+        }
+    }
+}
+/*
+    This function returns whether a fixed session sends the header the connection's template holds, apart from the window.
+*/
+static bool fixed_matches(const struct tcp_conn *c, const struct fixed_ops *ops)
+{
+    struct pkt_hdr hdr = c->tx_tmpl.hdr;
+    hdr.tcp.window = 0;
+    return memcmp(ops->hdr, &hdr, sizeof(hdr)) == 0;
+}
+/*
+    This function returns whether the NIC fills in and checks the checksums of every frame.
+*/
+static bool nic_csum_offload(void)
+{
+    return (nic_offloads & (NIC_OFFLOAD_TX_CSUM | NIC_OFFLOAD_RX_CSUM)) == (NIC_OFFLOAD_TX_CSUM | NIC_OFFLOAD_RX_CSUM);
+}
+/*
+    This function makes sure the next hop of a connection is resolved and its MAC is in the header template.
+    If the gateway does not answer and a backup gateway is configured, it fails over to the backup.
+*/
+static void conn_resolve(struct tcp_conn *c)
+{
+    if (neigh_lookup(&neigh, c->next_hop) != NULL || arp_resolve(c->next_hop))
+    {
+        neigh_apply(c->next_hop);
+        return;
+    }
+    if (c->next_hop == htonl(endpoint.gateway) && endpoint.backup_gateway != 0)
+    {
+        LOGW("WARNING: gateway not answering ARP, failing over to the backup gateway\n");
+        ef_set_gateway(endpoint.backup_gateway);
+        return;
+    }
+    throw std::runtime_error("Could not resolve the next hop with ARP");
+}
+
+void ef_set_gateway(uint32_t gateway)
+{
+    uint32_t gw = htonl(gateway);
+    if (neigh_lookup(&neigh, gw) == NULL && !arp_resolve(gw))
+    {
+        throw std::runtime_error("Could not resolve the gateway with ARP");
+    }
+    // the old gateway becomes the backup, so a later failure can fail back
+    if (endpoint.backup_gateway == gateway)
+        endpoint.backup_gateway = endpoint.gateway;
+    endpoint.gateway = gateway;
+    for (int i = 0; i < n_conns; ++i)
+        conns[i].next_hop = next_hop_for(conns[i].tx_tmpl.hdr.ip.dst_addr);
+    neigh_apply(gw);
+}
+
+void ef_neigh_add(uint32_t addr, const uint8_t *mac)
+{
+    neigh_add_permanent(&neigh, htonl(addr), mac);
+    neigh_apply(htonl(addr));
+}
+
+void ef_connect()
+{
+    ef_connect(default_conn);
+}
+
+void ef_connect(struct tcp_conn *c)
+{
+    set_variables(c);
+    conn_resolve(c);
+    send_connection_handshake(c);
+    return;
+}
+
+void ef_disconnect()
+{
+    ef_disconnect(default_conn);
+}
+
+void ef_disconnect(struct tcp_conn *c)
+{
+    send_tcp_teardown(c);
+    return;
+}
+
+static void send_reset(struct tcp_conn *c)
+{
+    uint8_t flags = (uint8_t)TCP_FLAGS::RST;
+    char *payload = NULL;
+    uint32_t payload_len = 0;
+    send_packet(c, payload, payload_len, flags, c->snd_nxt, c->rcv_nxt);
+}
+/*
+    This function sends an ACK for everything received so far.
+*/
+static void send_ack(struct tcp_conn *c)
+{
+    uint8_t flags = (uint8_t)TCP_FLAGS::ACK;
+    char *payload = NULL;
+    uint32_t payload_len = 0;
+    send_packet(c, payload, payload_len, flags, c->snd_nxt, c->rcv_nxt);
+}
+/*
+    This function returns the bytes the connection can take in, from its share of the RX buffers free or on the ring,
+    set by rx_share_update, and the room left in its read queue.
+    Every segment takes a buffer and a read queue entry whatever its length, so both are counted in full segments.
+*/
+static inline uint32_t rcv_wnd_avail(struct tcp_conn *c)
+{
+    uint32_t bufs = pbs.rx_share;
+    uint32_t room = RX_QUEUE_SIZE - (c->rxq.tail - c->rxq.head) - c->ooo.n;
+    return std::min(bufs, room) * MAX_PAYLOAD_SIZE;
+}
+/*
+    This function sets the window advertised by the next frames built for the connection.
+    The right edge of the window never moves back, even when small segments used up more buffers than their bytes.
+    The template sum is only updated when the window field changes.
+*/
+static inline void rcv_wnd_update(struct tcp_conn *c)
+{
+    uint32_t wnd = rcv_wnd_avail(c);
+    if (seq_gt(c->rcv_adv, c->rcv_nxt + wnd))
+        wnd = c->rcv_adv - c->rcv_nxt;
+    // rounding up keeps the right edge where it was
+    uint32_t field = std::min<uint32_t>((wnd + (1u << c->rcv_wscale) - 1) >> c->rcv_wscale, UINT16_MAX);
+    c->rcv_adv = c->rcv_nxt + (field << c->rcv_wscale);
+    if (c->tx_tmpl.hdr.tcp.window != htons((uint16_t)field))
+        pkt_hdr_template_set_window(&c->tx_tmpl, (uint16_t)field);
+}
+/*
+    This function tells the peer the window has opened again, once the application has freed buffers
+    after the advertised window fell below one segment. Smaller openings are left for the next ACK (RFC 1122 SWS avoidance).
+*/
+static inline void rcv_wnd_reopen(struct tcp_conn *c)
+{
+    uint32_t adv = c->rcv_adv - c->rcv_nxt;
+    if (c->established && adv < MAX_PAYLOAD_SIZE && rcv_wnd_avail(c) >= adv + MAX_PAYLOAD_SIZE)
+        send_ack(c);
+}
+
+static inline void ack_hold(struct tcp_conn *c)
+{
+    if (++c->ack_pending >= ack.max_segs)
+    {
+        send_ack(c);
+        return;
+    }
+    if (c->ack_pending == 1)
+    {
+        ack.held |= 1u << (c - conns);
+        if (ack.delay_ns > 0)
+            c->ack_deadline_ns = now_ns() + ack.delay_ns;
+    }
+}
+
+static inline void ack_sent(struct tcp_conn *c)
+{
+    c->ack_pending = 0;
+    c->ack_deadline_ns = 0;
+    ack.held &= ~(1u << (c - conns));
+}
+
+static void ack_flush(bool timer)
+{
+    uint64_t now = timer ? now_ns() : 0;
+    uint32_t held = ack.held;
+    while (held != 0)
+    {
+        struct tcp_conn *c = &conns[__builtin_ctz(held)];
+        held &= held - 1;
+        if (!timer || now >= c->ack_deadline_ns)
+            send_ack(c);
+    }
+}
+
+void ef_set_ack_policy(uint32_t max_segs, uint64_t delay_ns)
+{
+    ack.max_segs = max_segs > 0 ? max_segs : 1;
+    ack.delay_ns = delay_ns;
+    // ACKs held under the old policy go out now
+    ack_flush(false);
+}
+
+void ef_set_congestion(const struct cc_ops *ops)
+{
+    ef_set_congestion(default_conn, ops);
+}
+
+void ef_set_congestion(struct tcp_conn *c, const struct cc_ops *ops)
+{
+    // the new algorithm starts from its initial window
+    c->cc_ops = ops;
+    if (ops)
+        ops->init(&c->cc, c->snd_mss);
+}
+
+void ef_set_pacing(bool on)
+{
+    ef_set_pacing(default_conn, on);
+}
+
+void ef_set_pacing(struct tcp_conn *c, bool on)
+{
+    c->pacing = on;
+    c->pace_next_tsc = tsc_now();
+}
+
+void ef_set_fixed(const struct fixed_ops *ops)
+{
+    ef_set_fixed(default_conn, ops);
+}
+
+void ef_set_fixed(struct tcp_conn *c, const struct fixed_ops *ops)
+{
+    if (ops != NULL)
+    {
+        if (!fixed_matches(c, ops))
+            throw std::runtime_error("Fixed session does not match the endpoints of the connection");
+        if (ops->mss > c->snd_mss)
+            throw std::runtime_error("Fixed session MSS is larger than the peer takes");
+        if (ops->csum == CSUM_MODE::OFFLOAD && !nic_csum_offload())
+            throw std::runtime_error("Fixed session leaves the checksums to a NIC that does not compute them");
+    }
+    for (int i = 0; i < fixed.n; ++i)
+    {
+        if (fixed.conns[i] == c)
+        {
+            fixed.conns[i] = fixed.conns[--fixed.n];
+            break;
+        }
+    }
+    c->fixed_ops = ops;
+    if (ops != NULL)
+        fixed.conns[fixed.n++] = c;
+}
+/*
+    This function hands in-order payload to the application.
+    With an on_data handler the payload is passed straight from the RX buffer, which is then freed.
+    Otherwise it is queued for ef_read.
+*/
+static void deliver(struct tcp_conn *c, char *payload, ssize_t len, uint32_t id)
+{
+    if (c->cbs.on_data)
+    {
+        lat_record(LAT_STAGE::RX_TO_DELIVER, tsc_now() - pbs.cold[id].rx_tsc);
+        c->cbs.on_data(c->cbs.arg, payload, len);
+        pkt_buf_free(id);
+        vi_refill_rx_ring();
+        return;
+    }
+    rxq_push(c, payload, len, id);
+}
+
+static inline void rxq_push(struct tcp_conn *c, char *payload, uint32_t len, uint32_t id)
+{
+    assert(c->rxq.tail - c->rxq.head < RX_QUEUE_SIZE);
+    struct rx_desc *d = &c->rxq.descs[c->rxq.tail++ & (RX_QUEUE_SIZE - 1)];
+    d->id = id;
+    d->off = (uint16_t)(payload - pkt_buf_dma(id));
+    d->len = (uint16_t)len;
+}
+
+static inline char *rxq_payload(const struct rx_desc *d)
+{
+    return pkt_buf_dma(d->id) + d->off;
+}
+
+static void rxq_clear(struct tcp_conn *c)
+{
+    // the queue used to be left as it was, keeping its buffers off the pool for good
+    for (; c->rxq.head != c->rxq.tail; ++c->rxq.head)
+        pkt_buf_free(c->rxq.descs[c->rxq.head & (RX_QUEUE_SIZE - 1)].id);
+    c->rxq.head = c->rxq.tail = 0;
+}
+/*
+    This function holds a segment that arrived ahead of rcv_nxt in the reassembly queue, without copying it out of its RX buffer.
+    Bytes already held by a neighbouring segment are trimmed off, and held segments the new one covers are dropped.
+    It returns false if nothing of the segment was kept, in which case the caller frees the buffer.
+*/
+static bool ooo_insert(struct tcp_conn *c, uint32_t seq, uint32_t end, char *payload, uint32_t id)
+{
+    if (c->ooo.n == OOO_MAX_SEGS)
+        return false;
+    int i = 0;
+    while (i < c->ooo.n && seq_leq(c->ooo.segs[i].seq, seq))
+        ++i;
+    if (i > 0 && seq_gt(c->ooo.segs[i - 1].end, seq))
+    {
+        if (seq_geq(c->ooo.segs[i - 1].end, end))
+            return false;
+        payload += c->ooo.segs[i - 1].end - seq;
+        seq = c->ooo.segs[i - 1].end;
+    }
+    while (i < c->ooo.n && seq_geq(end, c->ooo.segs[i].end))
+    {
+        pkt_buf_free(c->ooo.segs[i].buf_id);
+        memmove(&c->ooo.segs[i], &c->ooo.segs[i + 1], (c->ooo.n - i - 1) * sizeof(c->ooo.segs[0]));
+        --c->ooo.n;
+    }
+    if (i < c->ooo.n && seq_gt(end, c->ooo.segs[i].seq))
+        end = c->ooo.segs[i].seq;
+    // trimmed to nothing between its neighbours, holding it would only tie up a buffer and a slot
+    if (!seq_lt(seq, end))
+        return false;
+    memmove(&c->ooo.segs[i + 1], &c->ooo.segs[i], (c->ooo.n - i) * sizeof(c->ooo.segs[0]));
+    c->ooo.segs[i] = {seq, end, id, payload};
+    ++c->ooo.n;
+    return true;
+}
+/*
+    This function moves held segments to the read queue once rcv_nxt has reached them.
+    Segments that turned out to be duplicates are freed.
+*/
+static void ooo_release(struct tcp_conn *c)
+{
+    int i = 0;
+    while (i < c->ooo.n && seq_leq(c->ooo.segs[i].seq, c->rcv_nxt))
+    {
+        struct ooo_seg *seg = &c->ooo.segs[i++];
+        if (seq_leq(seg->end, c->rcv_nxt))
+        {
+            pkt_buf_free(seg->buf_id);
+            continue;
+        }
+        uint32_t seq = c->rcv_nxt;
+        c->rcv_nxt = seg->end;
+        deliver(c, seg->payload + (seq - seg->seq), (ssize_t)(seg->end - seq), seg->buf_id);
+    }
+    memmove(&c->ooo.segs[0], &c->ooo.segs[i], (c->ooo.n - i) * sizeof(c->ooo.segs[0]));
+    c->ooo.n -= i;
+}
+/*
+    This function frees every segment held in the reassembly queue.
+*/
+static void ooo_clear(struct tcp_conn *c)
+{
+    for (int i = 0; i < c->ooo.n; ++i)
+        pkt_buf_free(c->ooo.segs[i].buf_id);
+    c->ooo.n = 0;
+}
+/*
+    This function handles one received frame of len bytes on an established connection.
+    ARP frames go to the ARP responder.
+    It finds the connection from the 4-tuple and drops frames that belong to none.
+    It drops frames whose IP total length does not fit in len, or whose checksums are wrong, before reading any payload.
+    It processes RST, FIN and the acknowledgment number.
+    In-order data goes to the read queue, data ahead of rcv_nxt to the reassembly queue.
+    Data that could not be queued, as the read queue is full, is dropped without an acknowledgment.
+    In-order data is acknowledged as the ACK policy says, while duplicates and data ahead of rcv_nxt are answered with an immediate ACK.
+*/
+static void handle_rx(uint32_t id, uint32_t len)
+{
+    struct pkt_hdr *hdr = (struct pkt_hdr *)rx_frame(id);
+    pbs.cold[id].rx_tsc = tsc_now();
+    if (endpoint.hw_timestamps)
+    {
+        uint64_t hw_ns = nic->rx_timestamp(pkt_buf_dma(id));
+        uint64_t polled = tsc_to_realtime_ns(pbs.cold[id].rx_tsc);
+        if (hw_ns != 0 && polled > hw_ns)
+        {
+            lat_record(LAT_STAGE::WIRE_TO_RX, polled - hw_ns);
+            if (waiter.woken)
+                lat_record(LAT_STAGE::WIRE_TO_WAKE, polled - hw_ns);
+        }
+    }
+    waiter.woken = false;
+    // the sessions fixed at compile time are recognised by their constant header fields alone
+    struct tcp_conn *c = fixed_lookup(hdr, len);
+    if (c != NULL && c->established)
+    {
+        handle_segment(c, hdr, id, sizeof(struct ip_hdr) + sizeof(struct tcp_hdr));
+        return;
+    }
+    if (hdr->eth.ether_type == htons(ETH_P_ARP))
+    {
+        if (len >= sizeof(struct arp_pkt))
+            arp_input((const struct arp_pkt *)hdr);
+        pkt_buf_free(id);
+        vi_refill_rx_ring();
+        return;
+    }
+    if (hdr->eth.ether_type != htons(ETH_P_IP) || len < sizeof(struct pkt_hdr) || hdr->ip.protocol != IPPROTO_TCP)
+    {
+        // not TCP over IPv4, nothing here is for the stack
+        pkt_buf_free(id);
+        vi_refill_rx_ring();
+        return;
+    }
+    // the connection is looked up by the addresses and ports, so they are only read once the headers are known to fit
+    if (!tcp_frame_ok(hdr, len))
+    {
+        rx_discard(id);
+        return;
+    }
+    c = conn_lookup(hdr);
+    if (c == NULL || !c->established)
+    {
+        // unknown, or left over from a connection that has been reset or closed in this batch
+        pkt_buf_free(id);
+        vi_refill_rx_ring();
+        return;
+    }
+    if (!rx_csum_ok(hdr, len))
+    {
+        rx_discard(id);
+        return;
+    }
+    handle_segment(c, hdr, id, ((hdr->ip.version_ihl & 0x0F) * 4) + ((hdr->tcp.data_off_reserved >> 4) * 4));
+}
+/*
+    This function handles a segment of an established connection whose headers, hdr_len bytes from the IP header on,
+    have been checked. The buffer is freed, queued or handed to the application.
+*/
+static void handle_segment(struct tcp_conn *c, struct pkt_hdr *hdr, uint32_t id, uint32_t hdr_len)
+{
+    if (hdr->tcp.flags & (uint8_t)TCP_FLAGS::RST)
+    {
+        pkt_buf_free(id);
+        vi_refill_rx_ring();
+        reset_variables(c);
+        if (c->cbs.on_reset)
+        {
+            c->cbs.on_reset(c->cbs.arg);
+            return;
+        }
+        throw TcpResetException();
+    }
+    if (hdr->tcp.flags & (uint8_t)TCP_FLAGS::FIN)
+    {
+        pkt_buf_free(id);
+        vi_refill_rx_ring();
+        send_reset(c);
+        reset_variables(c);
+        if (c->cbs.on_close)
+        {
+            c->cbs.on_close(c->cbs.arg);
+            return;
+        }
+        throw TcpResetException();
+    }
+    // the congestion window and the window of the peer only limit what is sent, see send_wait
+    uint32_t seq_num = ntohl(hdr->tcp.seq_num);
+    ssize_t pay_len = (size_t)ntohs(hdr->ip.tot_len) - hdr_len;
+    char *payload = (char *)&hdr->ip + hdr_len;
+    if (hdr->tcp.flags & (uint8_t)TCP_FLAGS::ACK)
+    {
+        bool pure_ack = pay_len == 0 && !(hdr->tcp.flags & (uint8_t)TCP_FLAGS::SYN);
+        process_ack(c, ntohl(hdr->tcp.ack_num), pure_ack);
+        c->snd_wnd = (uint32_t)ntohs(hdr->tcp.window) << c->snd_wscale;
+    }
+    uint32_t seq_len = pay_len + ((hdr->tcp.flags & (uint8_t)TCP_FLAGS::SYN) ? 1 : 0);
+    uint32_t seq_end = seq_num + seq_len;
+    if (seq_len == 0)
+    {
+        // nothing to deliver, so the buffer goes straight back to the pool
+        pkt_buf_free(id);
+        vi_refill_rx_ring();
+        return;
+    }
+    if (seq_leq(seq_end, c->rcv_nxt) || seq_gt(seq_end, c->rcv_adv))
+    {
+        // retransmitted (our ACK was lost, e.g. a repeated SYN-ACK) or outside the window
+        pkt_buf_free(id);
+        vi_refill_rx_ring();
+        send_ack(c);
+        return;
+    }
+    if (hdr->tcp.flags & (uint8_t)TCP_FLAGS::SYN)
+    {
+        throw std::runtime_error("Did not expect SYN since handshake was completed");
+    }
+    if (c->cbs.on_data == NULL && RX_QUEUE_SIZE - (c->rxq.tail - c->rxq.head) < 1 + (uint32_t)c->ooo.n)
+    {
+        // the application is not reading, drop the segment unacknowledged so the peer sends it again
+        pkt_buf_free(id);
+        vi_refill_rx_ring();
+        return;
+    }
+    if (seq_gt(seq_num, c->rcv_nxt))
+    {
+        if (!ooo_insert(c, seq_num, seq_end, payload, id))
+        {
+            pkt_buf_free(id);
+            vi_refill_rx_ring();
+        }
+        // a duplicate ACK right away tells the sender about the hole
+        send_ack(c);
+        return;
+    }
+    // in order, trimming anything already received
+    uint32_t trim = c->rcv_nxt - seq_num;
+    c->rcv_nxt = seq_end;
+    deliver(c, payload + trim, pay_len - (ssize_t)trim, id);
+    if (c->ooo.n > 0)
+        ooo_release(c);
+    ack_hold(c);
+}
+/*
+    This function handles a batch of events from the NIC, holding the doorbell until all of them are handled.
+    Held ACKs are sent at the end of the batch, unless the ACK policy delays them.
+*/
+static void handle_events(struct nic_event *evs, int n_ev)
+{
+    // ACKs and replies generated by the whole batch go out with one doorbell
+    ef_batch_begin();
+    try
+    {
+        handle_events_batch(evs, n_ev);
+        // one cumulative ACK per connection for the data of the batch
+        if (ack.held != 0 && ack.delay_ns == 0)
+            ack_flush(false);
+    }
+    catch (...)
+    {
+        ef_batch_end();
+        throw;
+    }
+    ef_batch_end();
+}
+/*
+    This function handles each event of a batch from the NIC.
+*/
+static void handle_events_batch(struct nic_event *evs, int n_ev)
+{
+    for (int i = 0; i < n_ev; ++i)
+    {
+        switch (evs[i].type)
+        {
+        case NIC_EVENT::TX:
+            tx_complete(&evs[i]);
+            break;
+        case NIC_EVENT::TX_ERROR:
+            throw std::runtime_error("Transmit failed");
+        case NIC_EVENT::RX:
+            handle_rx(evs[i].id, evs[i].len - pbs.rx_prefix_len);
+            break;
+        case NIC_EVENT::RX_DISCARD:
+            rx_discard(evs[i].id);
+            break;
+        default:
+            throw std::runtime_error("Unexpected event type: " + std::to_string((int)evs[i].type));
+            break;
+        }
+    }
+}
+/*
+    This function copies up to len bytes from the read queue into buf.
+    It frees every buffer that has been copied out completely.
+*/
+static ssize_t read_queue(struct tcp_conn *c, char *buf, ssize_t len)
+{
+    ssize_t read = 0;
+    while (read < len && c->rxq.head != c->rxq.tail)
+    {
+        struct rx_desc *d = &c->rxq.descs[c->rxq.head & (RX_QUEUE_SIZE - 1)];
+        ssize_t n = std::min((ssize_t)d->len, len - read);
+        memcpy(buf + read, rxq_payload(d), n);
+        read += n;
+        d->off += n;
+        d->len -= n;
+        if (d->len == 0)
+        {
+            lat_record(LAT_STAGE::RX_TO_DELIVER, tsc_now() - pbs.cold[d->id].rx_tsc);
+            pkt_buf_free(d->id);
+            ++c->rxq.head;
+            vi_refill_rx_ring();
+        }
+    }
+    if (read > 0)
+        rcv_wnd_reopen(c);
+    return read;
+}
+/*
+    Futures changes: Event driven system specifically updating state and using a callback to allow strategy to process
+*/
+static void poll_events(struct tcp_conn *c, char *buf, ssize_t &read, int len)
+{
+    struct nic_event evs[NIC_POLL_MAX_EVS];
+    while (read < len)
+    {
+        check_timers();
+        int n_ev = poll_nic(evs, sizeof(evs) / sizeof(evs[0]));
+        if (n_ev == 0)
+        {
+            break;
+        }
+        handle_events(evs, n_ev);
+        read += read_queue(c, buf + read, len - read);
+    }
+}
+
+static void poll_events()
+{
+    struct nic_event evs[NIC_POLL_MAX_EVS];
+    while (true)
+    {
+        check_timers();
+        int n_ev = poll_nic(evs, sizeof(evs) / sizeof(evs[0]));
+        if (n_ev == 0)
+        {
+            break;
+        }
+        handle_events(evs, n_ev);
+    }
+}
+
+int ef_read_zc(struct ef_rx_view *views, int max_views)
+{
+    return ef_read_zc(default_conn, views, max_views);
+}
+
+int ef_read_zc(struct tcp_conn *c, struct ef_rx_view *views, int max_views)
+{
+    if (c->rxq.head == c->rxq.tail)
+    {
+        struct nic_event evs[NIC_POLL_MAX_EVS];
+        check_timers();
+        int n_ev = poll_nic(evs, sizeof(evs) / sizeof(evs[0]));
+        handle_events(evs, n_ev);
+    }
+    int n = 0;
+    while (n < max_views && c->rxq.head != c->rxq.tail)
+    {
+        const struct rx_desc *d = &c->rxq.descs[c->rxq.head++ & (RX_QUEUE_SIZE - 1)];
+        views[n].data = rxq_payload(d);
+        views[n].len = d->len;
+        views[n].handle = d->id;
+        lat_record(LAT_STAGE::RX_TO_DELIVER, tsc_now() - pbs.cold[d->id].rx_tsc);
+        ++n;
+    }
+    return n;
+}
+
+void ef_read_release(const struct ef_rx_view *view)
+{
+    pkt_buf_free(view->handle);
+    vi_refill_rx_ring();
+    // the view does not say which connection it came from
+    for (int i = 0; i < n_conns; ++i)
+        rcv_wnd_reopen(&conns[i]);
+}
+
+void ef_set_callbacks(const struct ef_callbacks *callbacks)
+{
+    ef_set_callbacks(default_conn, callbacks);
+}
+
+void ef_set_callbacks(struct tcp_conn *c, const struct ef_callbacks *callbacks)
+{
+    c->cbs = callbacks ? *callbacks : ef_callbacks{};
+    // anything ef_read has not consumed yet comes first
+    while (c->cbs.on_data && c->rxq.head != c->rxq.tail)
+    {
+        struct rx_desc d = c->rxq.descs[c->rxq.head++ & (RX_QUEUE_SIZE - 1)];
+        deliver(c, rxq_payload(&d), d.len, d.id);
+    }
+}
+
+int ef_poll()
+{
+    struct nic_event evs[NIC_POLL_MAX_EVS];
+    check_timers();
+    int n_ev = poll_nic(evs, sizeof(evs) / sizeof(evs[0]));
+    handle_events(evs, n_ev);
+    return n_ev;
+}
+
+void ef_set_wait_mode(WAIT_MODE mode, uint64_t spin_ns)
+{
+    waiter.mode = mode;
+    waiter.spin_ns = spin_ns;
+    waiter.budget_ns = spin_ns;
+}
+
+int ef_wait(int64_t timeout_ns)
+{
+    struct nic_event evs[NIC_POLL_MAX_EVS];
+    int n_ev = wait_events(evs, sizeof(evs) / sizeof(evs[0]), timeout_ns);
+    handle_events(evs, n_ev);
+    return n_ev;
+}
+
+ssize_t ef_read(char *buf, int len)
+{
+    return ef_read(default_conn, buf, len);
+}
+
+ssize_t ef_read(struct tcp_conn *c, char *buf, int len)
+{ // in theory can use a parser to read the packet and apply a callback to strategy, but beyond scope here
+
+    ssize_t read = read_queue(c, buf, len);
+    poll_events(c, buf, read, len);
+    return read;
+}
+
+ssize_t ef_send(char *buf, int len)
+{
+    return ef_send(default_conn, buf, len);
+}
+
+ssize_t ef_send(struct tcp_conn *c, char *buf, int len)
+{
+    if (len > c->snd_mss)
+    {
+        throw std::runtime_error("Payload length too large");
+    }
+    send_tsc = tsc_now();
+    send_wait(c, len);
+    uint8_t flags = (uint8_t)TCP_FLAGS::ACK | (uint8_t)TCP_FLAGS::PSH;
+    char *payload = buf;
+    uint32_t payload_len = len;
+    send_packet(c, payload, payload_len, flags, c->snd_nxt, c->rcv_nxt);
+    send_tsc = 0;
+    c->snd_nxt += payload_len;
+    poll_events();
+    return 0;
+}
+
+void ef_batch_begin()
+{
+    ++batch.depth;
 }
 
-void set_variables()
+void ef_batch_end()
 {
-    data_queue.empty();
-    snd_nxt = 16000000;
-    rcv_nxt = 0;
-    snd_una = 0;
+    if (--batch.depth == 0)
+        tx_flush();
 }
-/*
-    This function initializes the packet buffers.
-    It sets the number of packet buffers to the sum of the RX and TX ring sizes.
-    It then sets the memory size to the number of packet buffers times the size of each packet buffer.
-    It then maps the memory to the packet buffers.
-    It then initializes the packet buffers.
-*/
-static int init_pkts_memory(void)
-{
-    int64_t i;
-    pbs.num = RX_RING_SIZE + TX_RING_SIZE;
-    pbs.mem_size = pbs.num * PKT_BUF_SIZE;
-    pbs.mem_size = ROUND_UP(pbs.mem_size, huge_page_size);
 
-    pbs.mem = mmap(NULL, pbs.mem_size, PROT_READ | PROT_WRITE,
-                   MAP_ANONYMOUS | MAP_PRIVATE | MAP_HUGETLB, -1, 0);
-    if (pbs.mem == MAP_FAILED)
+ssize_t ef_send_batch(const struct ef_send_req *reqs, int n)
+{
+    uint8_t flags = (uint8_t)TCP_FLAGS::ACK | (uint8_t)TCP_FLAGS::PSH;
+    ssize_t sent = 0;
+    send_tsc = tsc_now();
+    for (int i = 0; i < n; ++i)
+        if (reqs[i].len < 0 || reqs[i].len > (reqs[i].conn ? reqs[i].conn : default_conn)->snd_mss)
+            throw std::runtime_error("Payload length too large");
+    ef_batch_begin();
+    try
     {
-        fprintf(stderr, "mmap() failed. Are huge pages configured?\n");
-        TEST(posix_memalign(&pbs.mem, huge_page_size, pbs.mem_size) == 0);
+        for (int i = 0; i < n; ++i)
+        {
+            struct tcp_conn *c = reqs[i].conn ? reqs[i].conn : default_conn;
+            send_wait(c, reqs[i].len);
+            tx_buf_send(c, tx_buf_alloc(sizeof(struct pkt_hdr) + reqs[i].len), reqs[i].buf, reqs[i].len, flags, c->snd_nxt, c->rcv_nxt);
+            c->snd_nxt += reqs[i].len;
+            sent += reqs[i].len;
+        }
     }
-
-    for (i = 0; i < pbs.num; ++i)
+    catch (...)
     {
-        struct pkt_buf *pkt_buf = pkt_buf_from_id(i);
-        pkt_buf->id = i;
-        pkt_buf_free(pkt_buf);
+        send_tsc = 0;
+        ef_batch_end();
+        throw;
     }
-    return 0;
+    send_tsc = 0;
+    ef_batch_end();
+    poll_events();
+    return sent;
 }
-/*
-    This function initializes the virtual interface.
-    It sets the flags to the default flags.
-    It then opens the driver.
-    It then allocates the PD.
-    It then allocates the VI.
-    It then allocates the memory register.
-    It then initializes the packet buffers.
-    It then sets the filters to receive TCP packets.
-    It then returns 0.
-*/
-static int init()
-{
-    int i;
-    unsigned int vi_flags = EF_VI_FLAGS_DEFAULT;
-
-    TRY(ef_driver_open(&vi.dh));
-    TRY(ef_pd_alloc_by_name(&vi.pd, vi.dh, "enp1s0f1", EF_PD_DEFAULT));
-    TRY(ef_vi_alloc_from_pd(&vi.vi, vi.dh, &vi.pd, vi.dh, -1,
-                            RX_RING_SIZE, TX_RING_SIZE, NULL, -1,
-                            (enum ef_vi_flags)vi_flags));
 
-    TRY(ef_memreg_alloc(&vi.memreg, vi.dh, &vi.pd, vi.dh,
-                        pbs.mem, pbs.mem_size));
+ssize_t ef_sendv(const struct iovec *iov, int iovcnt)
+{
+    return ef_sendv(default_conn, iov, iovcnt);
+}
 
-    for (i = 0; i < pbs.num; ++i)
+ssize_t ef_sendv(struct tcp_conn *c, const struct iovec *iov, int iovcnt)
+{
+    send_tsc = tsc_now();
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; ++i)
+        total += iov[i].iov_len;
+    uint8_t flags = (uint8_t)TCP_FLAGS::ACK | (uint8_t)TCP_FLAGS::PSH;
+    int v = 0;
+    size_t v_off = 0;
+    size_t sent = 0;
+    while (sent < total)
     {
-        struct pkt_buf *pkt_buf = pkt_buf_from_id(i);
-        pkt_buf->rx_ef_addr = ef_memreg_dma_addr(&vi.memreg, i * PKT_BUF_SIZE + RX_DMA_OFF + addr_offset_from_id(i));
-        pkt_buf->tx_ef_addr = ef_memreg_dma_addr(&vi.memreg, i * PKT_BUF_SIZE + RX_DMA_OFF + ef_vi_receive_prefix_len(&vi.vi) + addr_offset_from_id(i));
+        size_t seg_len = std::min<size_t>(total - sent, c->snd_mss);
+        send_wait(c, seg_len);
+        uint32_t id = tx_buf_alloc(sizeof(struct pkt_hdr) + seg_len);
+        char *payload = tx_frame(id) + sizeof(struct pkt_hdr);
+        // gather the segment from the application buffers, summing as it is copied unless the NIC does
+        uint32_t sum = 0;
+        size_t off = 0;
+        while (off < seg_len)
+        {
+            size_t n = std::min(iov[v].iov_len - v_off, seg_len - off);
+            if (tx_csum_sw(c))
+                sum = csum_block_add(sum, csum_copy_partial(payload + off, (const char *)iov[v].iov_base + v_off, n, 0), off);
+            else
+                memcpy(payload + off, (const char *)iov[v].iov_base + v_off, n);
+            off += n;
+            v_off += n;
+            if (v_off == iov[v].iov_len)
+            {
+                ++v;
+                v_off = 0;
+            }
+        }
+        rcv_wnd_update(c);
+        if (c->fixed_ops != NULL)
+            c->fixed_ops->tx_build(tx_frame(id), sum, seg_len, flags, c->snd_nxt, c->rcv_nxt, c->tx_tmpl.hdr.tcp.window);
+        else if (nic_offloads & NIC_OFFLOAD_TX_CSUM)
+            build_tcp_header_offload(&c->tx_tmpl, seg_len, flags, c->snd_nxt, c->rcv_nxt, tx_frame(id));
+        else
+            build_tcp_header_from_template(&c->tx_tmpl, sum, seg_len, flags, c->snd_nxt, c->rcv_nxt, tx_frame(id));
+        tx_buf_post(c, id, seg_len, flags, c->snd_nxt);
+        c->snd_nxt += seg_len;
+        sent += seg_len;
     }
+    send_tsc = 0;
+    tx_kick();
+    poll_events();
+    return sent;
+}
 
-    assert(ef_vi_receive_capacity(&vi.vi) == RX_RING_SIZE - 1);
-    assert(ef_vi_transmit_capacity(&vi.vi) == TX_RING_SIZE - 1);
-
-    while (ef_vi_receive_space(&vi.vi) > REFILL_BATCH_SIZE)
-        vi_refill_rx_ring();
-
-    // Set up filters to receive all TCP packets
-    ef_filter_spec fs;
-    ef_filter_spec_init(&fs, EF_FILTER_FLAG_NONE);
-    TRY(ef_filter_spec_set_ip4_full(&fs, IPPROTO_TCP, htonl(0xc0a80d17), htons(1234), htonl(0xc0a80d0a), htons(12345)));
-    TRY(ef_vi_filter_add(&vi.vi, vi.dh, &fs, NULL));
-
-    return 0;
+void ef_send_acquire(struct ef_tx_slot *slot)
+{
+    // the payload length is not known yet, so it takes a full buffer
+    uint32_t id = tx_buf_alloc(PKT_BUF_MIN_SIZE);
+    slot->data = tx_frame(id) + sizeof(struct pkt_hdr);
+    slot->max_len = MAX_PAYLOAD_SIZE;
+    slot->handle = id;
 }
 
-/**
- * @brief Send a packet with the given payload, payload length, flags, sequence number, and acknowledgment number and frees the buffer
- * Note: seq and ack are numbers to be sent with the packet
- * @param payload
- * @param payload_len
- * @param flags
- * @param seq
- * @param ack
- */
+ssize_t ef_send_commit(struct ef_tx_slot *slot, int len)
+{
+    return ef_send_commit(default_conn, slot, len);
+}
 
-static void send_packet(char *payload, int payload_len, uint8_t flags, uint32_t seq, uint32_t ack)
+ssize_t ef_send_commit(struct tcp_conn *c, struct ef_tx_slot *slot, int len)
 {
-    // initialize packet buffer
-    struct pkt_buf *pkt_buf = pbs.free_pool;
-    pbs.free_pool = pbs.free_pool->next;
-    --pbs.free_pool_n;
-    // build packet
-    build_tcp_packet(payload, payload_len, flags, seq, ack, (char *)pkt_buf + RX_DMA_OFF + addr_offset_from_id(pkt_buf->id) + ef_vi_receive_prefix_len(&vi.vi));
-    // initialize transmit
-    int rc = ef_vi_transmit(&vi.vi, pkt_buf->tx_ef_addr, RX_DMA_OFF + addr_offset_from_id(pkt_buf->id) + ef_vi_receive_prefix_len(&vi.vi) + payload_len + sizeof(struct pkt_hdr), pkt_buf->id);
-    if (rc != 0)
+    if (len < 0 || len > (int)slot->max_len || len > c->snd_mss)
     {
-        throw std::runtime_error("Failed to transmit");
-        return;
+        throw std::runtime_error("Payload length too large");
     }
-    pkt_buf_free(pkt_buf);
+    send_tsc = tsc_now();
+    send_wait(c, len);
+    uint8_t flags = (uint8_t)TCP_FLAGS::ACK | (uint8_t)TCP_FLAGS::PSH;
+    tx_buf_send(c, slot->handle, slot->data, len, flags, c->snd_nxt, c->rcv_nxt);
+    send_tsc = 0;
+    c->snd_nxt += len;
+    slot->data = NULL;
+    poll_events();
+    return 0;
+}
 
-    return;
+void ef_send_abort(struct ef_tx_slot *slot)
+{
+    pkt_buf_free(slot->handle);
+    slot->data = NULL;
 }
 
-static void verify_incoming_checksums(struct pkt_hdr *hdr)
+void ef_pool_dump(FILE *out)
 {
-    uint16_t ip_checksum = ntohs(hdr->ip.check);
-    uint16_t tcpchecksum = ntohs(hdr->tcp.check);
-    hdr->ip.check = 0;
-    hdr->tcp.check = 0;
-    assert(ip_checksum == compute_checksum((unsigned short *)&hdr->ip, ((hdr->ip.version_ihl & 0x0F) * 4)));
-    assert(tcpchecksum == tcp_checksum(hdr, ntohs(hdr->ip.tot_len) - (uint32_t)((hdr->ip.version_ihl & 0x0F) * 4) - (uint32_t)((hdr->tcp.data_off_reserved >> 4) * 4), ntohs(hdr->ip.tot_len)));
-    hdr->ip.check = htons(ip_checksum);
-    hdr->tcp.check = htons(tcpchecksum);
+    fprintf(out, "packet pool %zu KiB, %s\n", pbs.mem_size >> 10,
+            pbs.huge_pages ? "huge pages" : "posix_memalign fallback, transparent huge pages if enabled");
+    fprintf(out, "rx ring %d, tx ring %d\n", pbs.rx_ring_size, pbs.tx_ring_size);
+    fprintf(out, "full buffers %d x %u bytes, %d free\n", pbs.num, pbs.buf_size, pbs.free_pool_n);
+    fprintf(out, "small buffers %d x %d bytes, %d free\n", pbs.num_small, PKT_BUF_SMALL_SIZE, pbs.free_small_n);
+    fprintf(out, "metadata %zu + %zu bytes per buffer\n", sizeof(struct pkt_buf), sizeof(struct pkt_buf_cold));
 }
-/*
- * Receive a packet and verify the seq, ack, and flags are as expected, but must free buffer after
- */
-static std::tuple<struct pkt_hdr *, uint32_t, uint8_t> receive_packet(uint8_t flags, uint32_t seq, uint32_t ack)
+
+void ef_latency_dump(FILE *out)
 {
-    ef_event evs[EF_VI_EVENT_POLL_MIN_EVS];
-    uint8_t received_flags = 0;
-    while (true)
+    fprintf(out, "%-18s %12s %10s %10s %10s %10s\n", "stage", "count", "p50_ns", "p99_ns", "p99.9_ns", "max_ns");
+    for (int i = 0; i < (int)LAT_STAGE::COUNT; ++i)
     {
-        int n_ev = ef_eventq_poll(&vi.vi, evs, sizeof(evs) / sizeof(evs[0]));
-        for (int i = 0; i < n_ev; ++i)
-        {
-            switch (EF_EVENT_TYPE(evs[i]))
-            {
-            case EF_EVENT_TYPE_TX:
-                break;
-            case EF_EVENT_TYPE_TX_WITH_TIMESTAMP:
-                break;
-            case EF_EVENT_TYPE_TX_ERROR:
-                throw std::runtime_error("Transmit failed");
-            case EF_EVENT_TYPE_RX:
-            {
-                auto id = EF_EVENT_RX_RQ_ID(evs[i]);
-                struct pkt_buf *pkt_buf = pkt_buf_from_id(id);
-                char *tcp_pkt = (char *)pkt_buf + RX_DMA_OFF + addr_offset_from_id(pkt_buf->id) + ef_vi_receive_prefix_len(&vi.vi);
-                struct pkt_hdr *hdr = (struct pkt_hdr *)tcp_pkt;
-                verify_incoming_checksums(hdr);
-                received_flags = received_flags | hdr->tcp.flags;
-                if ((received_flags & flags) == flags)
-                {
-                    return std::make_tuple(hdr, (uint32_t)ntohs(hdr->ip.tot_len) - (uint32_t)((hdr->ip.version_ihl & 0x0F) * 4) - (uint32_t)((hdr->tcp.data_off_reserved >> 4) * 4), id);
-                }
-                break;
-                /*if ((flags & (uint8_t)TCP_FLAGS::SYN) && (hdr->tcp.flags & (uint8_t)TCP_FLAGS::SYN) == 0)
-                {
-                    throw std::runtime_error("SYN not received when expected");
-                }
-                if ((flags & (uint8_t)TCP_FLAGS::ACK) && (hdr->tcp.flags & (uint8_t)TCP_FLAGS::ACK) == 0)
-                {
-                    throw std::runtime_error("ACK not received when expected");
-                }*/
-            }
-            default:
-                throw std::runtime_error("Unexpected event type: " + std::to_string(EF_EVENT_TYPE(evs[i])));
-                break;
-            }
-        }
+        const struct hdr_hist *h = &lat[i];
+        // software stages are in TSC ticks, wire stages already in ns
+        bool ticks = i < (int)LAT_STAGE::POST_TO_WIRE;
+        uint64_t v[4] = {hdr_percentile(h, 50.0), hdr_percentile(h, 99.0), hdr_percentile(h, 99.9), h->max.load(std::memory_order_relaxed)};
+        for (uint64_t &x : v)
+            x = ticks ? tsc_to_ns(x) : x;
+        fprintf(out, "%-18s %12llu %10llu %10llu %10llu %10llu\n", lat_names[i],
+                (unsigned long long)h->total.load(std::memory_order_relaxed),
+                (unsigned long long)v[0], (unsigned long long)v[1], (unsigned long long)v[2], (unsigned long long)v[3]);
     }
+    fprintf(out, "wait spins %llu blocks %llu wakeups %llu timeouts %llu\n",
+            (unsigned long long)wait_stats.spins.load(std::memory_order_relaxed),
+            (unsigned long long)wait_stats.blocks.load(std::memory_order_relaxed),
+            (unsigned long long)wait_stats.wakeups.load(std::memory_order_relaxed),
+            (unsigned long long)wait_stats.timeouts.load(std::memory_order_relaxed));
 }
 
-static void send_connection_handshake()
+void ef_latency_reset()
 {
-    // Send SYN packet
-    char *payload = NULL;
-    uint32_t payload_len = 0;
-    uint8_t flags = 0b00000010;
-    send_packet(payload, payload_len, flags, snd_nxt, rcv_nxt);
-
-    // handle SYN-ACK
-    flags = (uint8_t)TCP_FLAGS::SYN | (uint8_t)TCP_FLAGS::ACK;
-    uint32_t s_seq = 0; // don't care
-    uint32_t s_ack = snd_nxt + 1;
-    std::cout << "Trying to receive SYN-ACK" << std::endl;
-    auto [tcp_pkt, len, id] = receive_packet(flags, s_seq, s_ack);
-    std::cout << "Received SYN-ACK" << std::endl;
-    uint32_t server_seq = ntohl(tcp_pkt->tcp.seq_num); // this is the seq number of the server
-    pkt_buf_free(pkt_buf_from_id(id));
-    vi_refill_rx_ring();
-    std::cout << "Refilled RX ring" << std::endl;
-    snd_nxt += 1;
-    rcv_nxt = server_seq + 1;
-
-    // send ACK
-    flags = (uint8_t)TCP_FLAGS::ACK;
-    snd_una = snd_nxt;
-    send_packet(payload, payload_len, flags, snd_nxt, rcv_nxt);
-
-    // send_hello_world();
+    for (int i = 0; i < (int)LAT_STAGE::COUNT; ++i)
+        hdr_reset(&lat[i]);
+    wait_stats.spins.store(0, std::memory_order_relaxed);
+    wait_stats.blocks.store(0, std::memory_order_relaxed);
+    wait_stats.wakeups.store(0, std::memory_order_relaxed);
+    wait_stats.timeouts.store(0, std::memory_order_relaxed);
 }
 
-static void send_tcp_teardown()
+void ef_capture_start(const char *path)
 {
+    ef_capture_start(path, CAPTURE_SNAPLEN);
+}
 
-    // send FIN-ACK
-    uint8_t flags = (uint8_t)TCP_FLAGS::FIN | (uint8_t)TCP_FLAGS::ACK;
-    char *payload = NULL;
-    uint32_t payload_len = 0;
-    send_packet(payload, payload_len, flags, snd_nxt, rcv_nxt);
-    snd_nxt += 1;
+void ef_capture_start(const char *path, uint32_t snaplen)
+{
+    if (capturing)
+        ef_capture_stop();
+    if (capture_open(&cap, path, snaplen) != 0)
+    {
+        throw std::runtime_error(std::string("Failed to open capture file ") + path + ": " + strerror(errno));
+    }
+    capturing = true;
+}
 
-    // receive FIN-ACK
-    flags = (uint8_t)TCP_FLAGS::ACK | (uint8_t)TCP_FLAGS::FIN;
-    auto [tcp_pkt, len, id] = receive_packet(flags, rcv_nxt, snd_nxt);
-    pkt_buf_free(pkt_buf_from_id(id));
-    vi_refill_rx_ring();
-    rcv_nxt += 1;
+void ef_capture_stop()
+{
+    if (!capturing)
+        return;
+    capturing = false;
+    capture_close(&cap);
+}
 
-    // send ACK
-    flags = (uint8_t)TCP_FLAGS::ACK;
-    payload = NULL;
-    payload_len = 0;
-    send_packet(payload, payload_len, flags, snd_nxt, rcv_nxt);
-    reset_variables();
+uint64_t ef_capture_dropped()
+{
+    return cap.dropped.load(std::memory_order_relaxed);
 }
 
-static void send_hello_world()
+uint64_t ef_rx_discarded()
 {
-    uint8_t flags = (uint8_t)TCP_FLAGS::ACK;
-    char *payload = "Hello World\n";
-    size_t payload_len = strlen(payload);
-    send_packet(payload, payload_len, flags, snd_nxt, rcv_nxt);
-    snd_nxt += payload_len;
-    // rcv_next += TODO update rcv_next with response
+    return rx_discards.load(std::memory_order_relaxed);
 }
 
-void ef_init_tcp_client()
+struct ef_net_chan *ef_net_open()
 {
+    if (net.n_chans == NET_MAX_CHANS)
+    {
+        throw std::runtime_error("Too many channels");
+    }
+    // channels live as long as the process, like connections
+    struct ef_net_chan *chan = new struct ef_net_chan;
+    spsc_init(&chan->cmds);
+    spsc_init(&chan->events);
+    net.chans[net.n_chans++] = chan;
+    return chan;
+}
 
-    TRY(init_pkts_memory());
-    TRY(init());
-    return;
+void ef_net_subscribe(struct ef_net_chan *chan, struct tcp_conn *c)
+{
+    if (net.n_subs == MAX_CONNS + 1)
+    {
+        throw std::runtime_error("Too many subscriptions");
+    }
+    struct net_sub *sub = &net.subs[net.n_subs++];
+    sub->chan = chan;
+    sub->conn = c;
+    struct ef_callbacks cbs = {net_on_data, net_on_reset, net_on_close, sub};
+    ef_set_callbacks(c ? c : default_conn, &cbs);
 }
 
-void ef_connect()
+void ef_net_start(int cpu)
 {
-    set_variables();
-    send_connection_handshake();
-    return;
+    if (net.thread.joinable())
+    {
+        throw std::runtime_error("Network thread already running");
+    }
+    net.running.store(true, std::memory_order_release);
+    net.thread = std::thread(net_run, cpu);
 }
 
-void ef_disconnect()
+void ef_net_stop()
 {
-    send_tcp_teardown();
-    return;
+    if (!net.thread.joinable())
+        return;
+    net.running.store(false, std::memory_order_release);
+    net.thread.join();
 }
 
-static void send_reset()
+ssize_t ef_net_send(struct ef_net_chan *chan, struct tcp_conn *c, const char *buf, int len)
 {
-    uint8_t flags = (uint8_t)TCP_FLAGS::RST;
-    char *payload = NULL;
-    uint32_t payload_len = 0;
-    send_packet(payload, payload_len, flags, snd_nxt, rcv_nxt);
+    if (len < 0 || len > (c ? c : default_conn)->snd_mss)
+    {
+        throw std::runtime_error("Payload length too large");
+    }
+    struct ef_net_cmd *cmd = spsc_claim(&chan->cmds);
+    if (cmd == NULL)
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+    cmd->conn = c;
+    cmd->len = len;
+    memcpy(cmd->data, buf, len);
+    spsc_push(&chan->cmds);
+    spsc_publish(&chan->cmds);
+    return len;
 }
-/*
-    Don't use for buf > 15000
-    Futures changes: Event driven system specifically updating state and using a callback to allow strategy to process
-*/
 
-static void poll_events(char *buf, ssize_t &read, int len)
+int ef_net_send_batch(struct ef_net_chan *chan, const struct ef_send_req *reqs, int n)
 {
-    ef_event evs[EF_VI_EVENT_POLL_MIN_EVS];
-    while (true)
+    int queued = 0;
+    for (; queued < n; ++queued)
     {
-        int n_ev = ef_eventq_poll(&vi.vi, evs, sizeof(evs) / sizeof(evs[0]));
-        if (n_ev == 0 || read == len)
-        {
-            break;
-        }
-        for (int i = 0; i < n_ev; ++i)
+        if (reqs[queued].len < 0 || reqs[queued].len > (reqs[queued].conn ? reqs[queued].conn : default_conn)->snd_mss)
         {
-            switch (EF_EVENT_TYPE(evs[i]))
-            {
-            case EF_EVENT_TYPE_TX:
-                break;
-            case EF_EVENT_TYPE_TX_WITH_TIMESTAMP:
-                break;
-            case EF_EVENT_TYPE_TX_ERROR:
-                throw std::runtime_error("Transmit failed");
-            case EF_EVENT_TYPE_RX:
-            {
-                auto id = EF_EVENT_RX_RQ_ID(evs[i]);
-                struct pkt_buf *pkt_buf = pkt_buf_from_id(id);
-                uint32_t offset = RX_DMA_OFF + addr_offset_from_id(id) + ef_vi_receive_prefix_len(&vi.vi);
-                struct pkt_hdr *hdr = (struct pkt_hdr *)((char *)pkt_buf + offset);
-                verify_incoming_checksums(hdr);
-                if (hdr->tcp.flags & (uint8_t)TCP_FLAGS::RST)
-                {
-                    reset_variables();
-                    throw TcpResetException();
-                }
-                if (hdr->tcp.flags & (uint8_t)TCP_FLAGS::FIN)
-                {
-                    send_reset();
-                    reset_variables();
-                    throw TcpResetException();
-                }
-                if (hdr->tcp.flags & (uint8_t)TCP_FLAGS::ACK)
-                {
-                    uint32_t ack_num = ntohl(hdr->tcp.ack_num);
-                    if (ack_num > snd_una && ack_num <= snd_nxt)
-                        snd_una = ack_num;
-                    if (ack_num < snd_una)
-                    {
-                        throw std::runtime_error("Duplicate ACK received");
-                    }
-                    if (ack_num > snd_nxt)
-                    {
-                        throw std::runtime_error("Invalid or malicious ACK received");
-                    }
-                }
-                // not factoring in congestion window or window scaling, but this is another check
-                uint32_t seq_num = ntohl(hdr->tcp.seq_num);
-                ssize_t pay_len = (size_t)ntohs(hdr->ip.tot_len) - (size_t)((hdr->ip.version_ihl & 0x0F) * 4) - (uint32_t)((hdr->tcp.data_off_reserved >> 4) * 4);
-                if (seq_num == rcv_nxt)
-                {
-                    if (hdr->tcp.flags & (uint8_t)TCP_FLAGS::SYN)
-                    {
-                        throw std::runtime_error("Did not expect SYN since handshake was completed");
-                        rcv_nxt += 1;
-                    }
-                    if (pay_len > 0)
-                    {
-                        rcv_nxt += pay_len;
-                        char *payload = NULL;
-                        int payload_len = 0;
-                        uint8_t flags = (uint8_t)TCP_FLAGS::ACK;
-                        send_packet(payload, payload_len, flags, snd_nxt, rcv_nxt);
-                    }
-                }
-                else if (seq_num > rcv_nxt)
-                {
-                    throw std::runtime_error("Lost packets somewhere, seeing packet in the future");
-                }
-                else
-                {
-                    throw std::runtime_error("Seeing packet from past, sender is retransmitting");
-                }
-                if (len == read)
-                {
-                    data_queue.push(std::make_tuple((char *)hdr + sizeof(struct pkt_hdr), pay_len, id));
-                }
-                else if (read > len)
-                {
-                    throw std::runtime_error("Read more than len, should not be reachable state");
-                }
-                else
-                {
-                    if (len < pay_len + read)
-                    {
-                        memcpy(buf, (char *)hdr + sizeof(struct pkt_hdr), len - read);
-                        read = len;
-                        data_queue.push(std::make_tuple((char *)hdr + sizeof(struct pkt_hdr) + len - read, pay_len - (len - read), id));
-                        // rest is pay_len - (len - read)
-                    }
-                    else
-                    {
-                        memcpy(buf, (char *)hdr + sizeof(struct pkt_hdr), pay_len);
-                        read += pay_len;
-                        pkt_buf_free(pkt_buf);
-                        vi_refill_rx_ring();
-                    }
-                }
-                break;
-            }
-            default:
-                throw std::runtime_error("Unexpected event type: " + std::to_string(EF_EVENT_TYPE(evs[i])));
-                break;
-            }
+            throw std::runtime_error("Payload length too large");
         }
+        struct ef_net_cmd *cmd = spsc_claim(&chan->cmds);
+        if (cmd == NULL)
+            break;
+        cmd->conn = reqs[queued].conn;
+        cmd->len = reqs[queued].len;
+        memcpy(cmd->data, reqs[queued].buf, reqs[queued].len);
+        spsc_push(&chan->cmds);
     }
+    spsc_publish(&chan->cmds);
+    return queued;
 }
 
-static void poll_events()
+int ef_net_poll(struct ef_net_chan *chan, const struct ef_net_event **evs, int max_evs)
 {
-    ef_event evs[EF_VI_EVENT_POLL_MIN_EVS];
-    while (true)
+    // the events returned last time are done with
+    spsc_release(&chan->events);
+    int n = 0;
+    const struct ef_net_event *ev;
+    while (n < max_evs && (ev = spsc_peek(&chan->events)) != NULL)
     {
-        int n_ev = ef_eventq_poll(&vi.vi, evs, sizeof(evs) / sizeof(evs[0]));
-        if (n_ev == 0)
-        {
-            break;
-        }
-        for (int i = 0; i < n_ev; ++i)
+        evs[n++] = ev;
+        spsc_pop(&chan->events);
+    }
+    return n;
+}
+
+static void net_run(int cpu)
+{
+    if (cpu >= 0)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+            fprintf(stderr, "Could not pin the network thread to CPU %d\n", cpu);
+    }
+    try
+    {
+        bool running = true;
+        while (running)
         {
-            switch (EF_EVENT_TYPE(evs[i]))
+            // read before draining, so everything queued before ef_net_stop is still sent
+            running = net.running.load(std::memory_order_acquire);
+            // sends from every channel go out with one doorbell
+            ef_batch_begin();
+            try
             {
-            case EF_EVENT_TYPE_TX:
-                break;
-            case EF_EVENT_TYPE_TX_WITH_TIMESTAMP:
-                break;
-            case EF_EVENT_TYPE_TX_ERROR:
-                throw std::runtime_error("Transmit failed");
-            case EF_EVENT_TYPE_RX:
+                for (int i = 0; i < net.n_chans; ++i)
+                    net_drain_cmds(net.chans[i]);
+            }
+            catch (...)
             {
-                auto id = EF_EVENT_RX_RQ_ID(evs[i]);
-                struct pkt_buf *pkt_buf = pkt_buf_from_id(id);
-                uint32_t offset = RX_DMA_OFF + addr_offset_from_id(id) + ef_vi_receive_prefix_len(&vi.vi);
-                struct pkt_hdr *hdr = (struct pkt_hdr *)((char *)pkt_buf + offset);
-                verify_incoming_checksums(hdr);
-                if (hdr->tcp.flags & (uint8_t)TCP_FLAGS::RST)
-                {
-                    reset_variables();
-                    throw TcpResetException();
-                }
-                if (hdr->tcp.flags & (uint8_t)TCP_FLAGS::FIN)
-                {
-                    send_reset();
-                    reset_variables();
-                    throw TcpResetException();
-                }
-                if (hdr->tcp.flags & (uint8_t)TCP_FLAGS::ACK)
-                {
-                    uint32_t ack_num = ntohl(hdr->tcp.ack_num);
-                    if (ack_num > snd_una && ack_num <= snd_nxt)
-                        snd_una = ack_num;
-                    if (ack_num < snd_una)
-                    {
-                        throw std::runtime_error("Duplicate ACK received");
-                    }
-                    if (ack_num > snd_nxt)
-                    {
-                        throw std::runtime_error("Invalid or malicious ACK received");
-                    }
-                }
-                // not factoring in congestion window or window scaling, but this is another check
-                uint32_t seq_num = ntohl(hdr->tcp.seq_num);
-                ssize_t pay_len = (size_t)ntohs(hdr->ip.tot_len) - (size_t)((hdr->ip.version_ihl & 0x0F) * 4) - (size_t)((hdr->tcp.data_off_reserved >> 4) * 4);
-                if (seq_num == rcv_nxt)
-                {
-                    if (hdr->tcp.flags & (uint8_t)TCP_FLAGS::SYN)
-                    {
-                        throw std::runtime_error("Did not expect SYN since handshake was completed");
-                        rcv_nxt += 1;
-                    }
-                    if (pay_len > 0)
-                    {
-                        rcv_nxt += pay_len;
-                        char *payload = NULL;
-                        int payload_len = 0;
-                        uint8_t flags = (uint8_t)TCP_FLAGS::ACK;
-                        send_packet(payload, payload_len, flags, snd_nxt, rcv_nxt);
-                    }
-                }
-                else if (seq_num > rcv_nxt)
-                {
-                    throw std::runtime_error("Lost packets somewhere, seeing packet in the future");
-                }
-                else
-                {
-                    throw std::runtime_error("Seeing packet from past, sender is retransmitting");
-                }
-                data_queue.push(std::make_tuple((char *)hdr + sizeof(struct pkt_hdr), pay_len, id));
-                break;
+                ef_batch_end();
+                throw;
             }
-            default:
-                throw std::runtime_error("Unexpected event type: " + std::to_string(EF_EVENT_TYPE(evs[i])));
-                break;
+            ef_batch_end();
+            ef_poll();
+            for (int i = 0; i < net.n_chans; ++i)
+                spsc_publish(&net.chans[i]->events);
+        }
+    }
+    catch (const std::exception &e)
+    {
+        for (int i = 0; i < net.n_chans; ++i)
+        {
+            struct ef_net_event *ev = spsc_claim(&net.chans[i]->events);
+            if (ev != NULL)
+            {
+                ev->type = NET_EVENT::ERROR;
+                ev->conn = NULL;
+                snprintf(ev->data, sizeof(ev->data), "%s", e.what());
+                ev->len = strlen(ev->data);
+                spsc_push(&net.chans[i]->events);
             }
+            spsc_publish(&net.chans[i]->events);
         }
     }
 }
 
-ssize_t ef_read(char *buf, int len)
-{ // in theory can use a parser to read the packet and apply a callback to strategy, but beyond scope here
-
-    ssize_t read = 0;
-    while (read < len && !data_queue.empty())
+static void net_drain_cmds(struct ef_net_chan *chan)
+{
+    struct ef_send_req reqs[TX_BATCH_MAX];
+    int n;
+    do
     {
-        auto [payload, payload_len, id] = data_queue.front();
-        if (payload_len > len - read)
-        {
-            memcpy(buf + read, payload, len - read);
-            read = len;
-            std::get<1>(data_queue.front()) -= len - read;
-            std::get<0>(data_queue.front()) += len - read;
-        }
-        else
+        struct ef_net_cmd *cmd;
+        n = 0;
+        while (n < TX_BATCH_MAX && (cmd = spsc_peek(&chan->cmds)) != NULL)
         {
-            memcpy(buf + read, payload, payload_len);
-            read += payload_len;
-            data_queue.pop();
-            pkt_buf_free(pkt_buf_from_id(id));
-            vi_refill_rx_ring();
+            reqs[n++] = {cmd->conn, cmd->data, cmd->len};
+            spsc_pop(&chan->cmds);
         }
-    }
-
-    poll_events(buf, read, len);
-    return read;
+        if (n == 0)
+            return;
+        ef_send_batch(reqs, n);
+        // the payloads have been copied into TX buffers
+        spsc_release(&chan->cmds);
+    } while (n == TX_BATCH_MAX);
 }
 
-ssize_t ef_send(char *buf, int len)
+static void net_push_event(struct ef_net_chan *chan, NET_EVENT type, struct tcp_conn *conn, const char *data, size_t len)
 {
-    if (len >= 1460)
+    struct ef_net_event *ev;
+    while ((ev = spsc_claim(&chan->events)) == NULL)
     {
-        throw std::runtime_error("Payload length too large");
+        // let the application see what is queued, and drop the event if it stopped polling for good
+        spsc_publish(&chan->events);
+        if (!net.running.load(std::memory_order_relaxed))
+            return;
     }
-    uint8_t flags = (uint8_t)TCP_FLAGS::ACK | (uint8_t)TCP_FLAGS::PSH;
-    char *payload = buf;
-    uint32_t payload_len = len;
-    send_packet(payload, payload_len, flags, snd_nxt, rcv_nxt);
-    snd_nxt += payload_len;
-    poll_events();
-    return 0;
+    ev->type = type;
+    ev->conn = conn;
+    ev->len = len;
+    if (len > 0)
+        memcpy(ev->data, data, len);
+    spsc_push(&chan->events);
+    // without the network thread nobody else publishes
+    if (!net.running.load(std::memory_order_relaxed))
+        spsc_publish(&chan->events);
+}
+
+static void net_on_data(void *arg, const char *data, size_t len)
+{
+    struct net_sub *sub = (struct net_sub *)arg;
+    for (size_t off = 0; off < len; off += MAX_PAYLOAD_SIZE)
+        net_push_event(sub->chan, NET_EVENT::DATA, sub->conn, data + off, std::min(len - off, (size_t)MAX_PAYLOAD_SIZE));
+}
+
+static void net_on_reset(void *arg)
+{
+    struct net_sub *sub = (struct net_sub *)arg;
+    net_push_event(sub->chan, NET_EVENT::RESET, sub->conn, NULL, 0);
+}
+
+static void net_on_close(void *arg)
+{
+    struct net_sub *sub = (struct net_sub *)arg;
+    net_push_event(sub->chan, NET_EVENT::CLOSE, sub->conn, NULL, 0);
 }
 
 /*
@@ -0,0 +1,89 @@
+#include "latency.hpp"
+#include <time.h>
+
+static double tsc_ns_per_tick = 1.0;
+static uint64_t tsc_base;
+static uint64_t realtime_base_ns;
+
+static uint64_t clock_ns(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+    This function counts TSC ticks over about 10 ms of the monotonic clock.
+    It then takes a TSC and realtime pair, to place TSC reads on the clock of the hardware timestamps.
+*/
+void tsc_calibrate(void)
+{
+    uint64_t ns0 = clock_ns(CLOCK_MONOTONIC);
+    uint64_t tsc0 = tsc_now();
+    uint64_t ns1;
+    do
+        ns1 = clock_ns(CLOCK_MONOTONIC);
+    while (ns1 - ns0 < 10000000);
+    uint64_t tsc1 = tsc_now();
+    tsc_ns_per_tick = (double)(ns1 - ns0) / (double)(tsc1 - tsc0);
+    realtime_base_ns = clock_ns(CLOCK_REALTIME);
+    tsc_base = tsc_now();
+}
+
+uint64_t tsc_to_ns(uint64_t ticks)
+{
+    return (uint64_t)((double)ticks * tsc_ns_per_tick);
+}
+
+uint64_t ns_to_tsc(uint64_t ns)
+{
+    return (uint64_t)((double)ns / tsc_ns_per_tick);
+}
+
+uint64_t tsc_to_realtime_ns(uint64_t tsc)
+{
+    return realtime_base_ns + (uint64_t)((double)(int64_t)(tsc - tsc_base) * tsc_ns_per_tick);
+}
+
+/* Lowest value counted in a bucket */
+static uint64_t hdr_value(unsigned i)
+{
+    if (i < HDR_SUB_COUNT)
+        return i;
+    unsigned k = i - HDR_SUB_COUNT;
+    unsigned shift = k / (HDR_SUB_COUNT / 2) + 1;
+    return (uint64_t)(k % (HDR_SUB_COUNT / 2) + HDR_SUB_COUNT / 2) << shift;
+}
+
+uint64_t hdr_percentile(const struct hdr_hist *h, double p)
+{
+    uint64_t total = 0;
+    for (unsigned i = 0; i < HDR_BUCKETS; ++i)
+        total += h->counts[i].load(std::memory_order_relaxed);
+    if (total == 0)
+        return 0;
+    uint64_t rank = (uint64_t)(p / 100.0 * (double)total + 0.5);
+    if (rank == 0)
+        rank = 1;
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < HDR_BUCKETS; ++i)
+    {
+        seen += h->counts[i].load(std::memory_order_relaxed);
+        if (seen >= rank)
+        {
+            // report the top of the bucket, never above the largest sample
+            uint64_t top = i + 1 < HDR_BUCKETS ? hdr_value(i + 1) - 1 : hdr_value(i);
+            uint64_t max = h->max.load(std::memory_order_relaxed);
+            return top < max ? top : max;
+        }
+    }
+    return h->max.load(std::memory_order_relaxed);
+}
+
+void hdr_reset(struct hdr_hist *h)
+{
+    for (unsigned i = 0; i < HDR_BUCKETS; ++i)
+        h->counts[i].store(0, std::memory_order_relaxed);
+    h->total.store(0, std::memory_order_relaxed);
+    h->max.store(0, std::memory_order_relaxed);
+}
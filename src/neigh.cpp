@@ -0,0 +1,57 @@
+#include "neigh.hpp"
+#include <string.h>
+
+const struct neigh_entry *neigh_lookup(const struct neigh_cache *cache, uint32_t addr)
+{
+    for (int i = 0; i < NEIGH_CACHE_SIZE; ++i)
+        if (cache->entries[i].addr == addr && addr != 0)
+            return &cache->entries[i];
+    return NULL;
+}
+
+/*
+    This function takes a free entry, or replaces the entries in turn once the cache is full.
+    Permanent entries are skipped, unless every entry is permanent.
+*/
+static struct neigh_entry *neigh_alloc(struct neigh_cache *cache)
+{
+    for (int i = 0; i < NEIGH_CACHE_SIZE; ++i)
+        if (cache->entries[i].addr == 0)
+            return &cache->entries[i];
+    for (int i = 0; i < NEIGH_CACHE_SIZE; ++i)
+    {
+        struct neigh_entry *e = &cache->entries[cache->victim++ % NEIGH_CACHE_SIZE];
+        if (!e->permanent)
+            return e;
+    }
+    return &cache->entries[cache->victim++ % NEIGH_CACHE_SIZE];
+}
+
+bool neigh_update(struct neigh_cache *cache, uint32_t addr, const uint8_t *mac, bool create)
+{
+    struct neigh_entry *e = (struct neigh_entry *)neigh_lookup(cache, addr);
+    if (e != NULL)
+    {
+        if (e->permanent || memcmp(e->mac, mac, ETH_ALEN) == 0)
+            return false;
+        memcpy(e->mac, mac, ETH_ALEN);
+        return true;
+    }
+    if (!create || addr == 0)
+        return false;
+    e = neigh_alloc(cache);
+    e->addr = addr;
+    memcpy(e->mac, mac, ETH_ALEN);
+    e->permanent = false;
+    return true;
+}
+
+void neigh_add_permanent(struct neigh_cache *cache, uint32_t addr, const uint8_t *mac)
+{
+    struct neigh_entry *e = (struct neigh_entry *)neigh_lookup(cache, addr);
+    if (e == NULL)
+        e = neigh_alloc(cache);
+    e->addr = addr;
+    memcpy(e->mac, mac, ETH_ALEN);
+    e->permanent = true;
+}
@@ -0,0 +1,239 @@
+#include <etherfabric/vi.h>
+#include <etherfabric/pd.h>
+#include <etherfabric/memreg.h>
+#include <etherfabric/capabilities.h>
+#include "utils.h"
+#include "nic_backend.hpp"
+#include <netinet/in.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <stdexcept>
+#include <string>
+
+/*
+    ef_vi implementation of the NIC backend, driving a Solarflare card directly from user space.
+*/
+
+BUILD_ASSERT(NIC_DMA_ALIGN == EF_VI_DMA_ALIGN);
+BUILD_ASSERT(NIC_POLL_MAX_EVS >= EF_VI_EVENT_POLL_MIN_EVS);
+
+struct vi
+{
+    ef_driver_handle dh;
+    ef_pd pd;
+    ef_vi vi;
+    ef_memreg memreg;
+    bool timestamps;
+    unsigned offloads; /* NIC_OFFLOAD_* */
+};
+
+static struct vi vi;
+
+/*
+    This function opens the driver, allocates the PD and the VI, and registers mem with the NIC.
+    It tells the VI how long the RX buffers are.
+    Unless the stack asks for software checksums, the VI fills in the IP and TCP checksums of every frame it sends, and
+    discards received frames whose checksums are wrong, so the stack never reads a payload for them.
+*/
+static int efvi_init(const char *intf, void *mem, size_t mem_size, int rxq_size, int txq_size, int rx_buf_len, unsigned flags)
+{
+    unsigned int vi_flags = EF_VI_FLAGS_DEFAULT;
+    if (flags & NIC_INIT_TIMESTAMPS)
+        vi_flags |= EF_VI_RX_TIMESTAMPS | EF_VI_TX_TIMESTAMPS;
+    vi.timestamps = flags & NIC_INIT_TIMESTAMPS;
+    if (flags & NIC_INIT_SW_CSUM)
+        vi_flags |= EF_VI_TX_IP_CSUM_DIS | EF_VI_TX_TCPUDP_CSUM_DIS;
+
+    TRY(ef_driver_open(&vi.dh));
+    TRY(ef_pd_alloc_by_name(&vi.pd, vi.dh, intf, EF_PD_DEFAULT));
+    TRY(ef_vi_alloc_from_pd(&vi.vi, vi.dh, &vi.pd, vi.dh, -1,
+                            rxq_size, txq_size, NULL, -1,
+                            (enum ef_vi_flags)vi_flags));
+    // buffers are not all 2 KiB any more, the NIC must not write past the end of one
+    ef_vi_receive_set_buffer_len(&vi.vi, rx_buf_len);
+    vi.offloads = 0;
+    if (!(flags & NIC_INIT_SW_CSUM))
+    {
+        vi.offloads |= NIC_OFFLOAD_TX_CSUM;
+        // frames with a bad checksum then come as RX_DISCARD, a NIC that cannot tell leaves the stack to check them
+        if (ef_vi_receive_set_discards(&vi.vi, EF_VI_DISCARD_RX_L3_CSUM_ERR | EF_VI_DISCARD_RX_L4_CSUM_ERR |
+                                                   EF_VI_DISCARD_RX_ETH_FCS_ERR | EF_VI_DISCARD_RX_ETH_LEN_ERR) == 0)
+            vi.offloads |= NIC_OFFLOAD_RX_CSUM;
+    }
+    else
+    {
+        // the stack counts and drops frames with a bad checksum itself
+        ef_vi_receive_set_discards(&vi.vi, EF_VI_DISCARD_RX_ETH_FCS_ERR | EF_VI_DISCARD_RX_ETH_LEN_ERR);
+    }
+
+    TRY(ef_memreg_alloc(&vi.memreg, vi.dh, &vi.pd, vi.dh,
+                        mem, mem_size));
+
+    assert(ef_vi_receive_capacity(&vi.vi) == rxq_size - 1);
+    assert(ef_vi_transmit_capacity(&vi.vi) == txq_size - 1);
+    return 0;
+}
+
+static nic_addr efvi_dma_addr(size_t offset)
+{
+    return ef_memreg_dma_addr(&vi.memreg, offset);
+}
+
+static int efvi_rx_prefix_len(void)
+{
+    return ef_vi_receive_prefix_len(&vi.vi);
+}
+
+static unsigned efvi_offloads(void)
+{
+    return vi.offloads;
+}
+
+/*
+    This function reads the timestamp the NIC put in the receive prefix.
+    It returns 0 when the VI does not timestamp, or the NIC clock was not in sync when the frame arrived.
+*/
+static uint64_t efvi_rx_timestamp(const void *dma)
+{
+    ef_timespec ts;
+    if (!vi.timestamps || ef_vi_receive_get_timestamp(&vi.vi, dma, &ts) != 0)
+        return 0;
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int efvi_rx_space(void)
+{
+    return ef_vi_receive_space(&vi.vi);
+}
+
+static int efvi_rx_post(nic_addr addr, uint32_t id)
+{
+    return ef_vi_receive_init(&vi.vi, addr, id);
+}
+
+static void efvi_rx_push(void)
+{
+    ef_vi_receive_push(&vi.vi);
+}
+
+static int efvi_transmit(nic_addr addr, int len, uint32_t id)
+{
+    return ef_vi_transmit(&vi.vi, addr, len, id);
+}
+
+static int efvi_transmit_init(nic_addr addr, int len, uint32_t id)
+{
+    return ef_vi_transmit_init(&vi.vi, addr, len, id);
+}
+
+static void efvi_transmit_push(void)
+{
+    ef_vi_transmit_push(&vi.vi);
+}
+
+/*
+    This function polls the event queue and translates ef_vi events into backend events.
+*/
+static int efvi_poll(struct nic_event *evs, int max_evs)
+{
+    ef_event raw[EF_VI_EVENT_POLL_MIN_EVS];
+    ef_request_id ids[EF_VI_TRANSMIT_BATCH];
+    int n_ids;
+    int n_ev = ef_eventq_poll(&vi.vi, raw, max_evs < EF_VI_EVENT_POLL_MIN_EVS ? max_evs : EF_VI_EVENT_POLL_MIN_EVS);
+    for (int i = 0; i < n_ev; ++i)
+    {
+        struct nic_event *ev = &evs[i];
+        ev->flags = 0;
+        ev->id = 0;
+        ev->len = 0;
+        ev->hw_ns = 0;
+        switch (EF_EVENT_TYPE(raw[i]))
+        {
+        case EF_EVENT_TYPE_RX:
+            ev->type = NIC_EVENT::RX;
+            ev->id = EF_EVENT_RX_RQ_ID(raw[i]);
+            ev->len = EF_EVENT_RX_BYTES(raw[i]);
+            break;
+        case EF_EVENT_TYPE_TX:
+            // one TX event can complete a batch of descriptors
+            ev->type = NIC_EVENT::TX;
+            n_ids = ef_vi_transmit_unbundle(&vi.vi, &raw[i], ids);
+            ev->len = n_ids;
+            ev->id = n_ids > 0 ? ids[n_ids - 1] : 0;
+            break;
+        case EF_EVENT_TYPE_TX_WITH_TIMESTAMP:
+            ev->type = NIC_EVENT::TX;
+            ev->len = 1;
+            ev->id = EF_EVENT_TX_WITH_TIMESTAMP_RQ_ID(raw[i]);
+            ev->hw_ns = (uint64_t)EF_EVENT_TX_WITH_TIMESTAMP_SEC(raw[i]) * 1000000000ull + EF_EVENT_TX_WITH_TIMESTAMP_NSEC(raw[i]);
+            break;
+        case EF_EVENT_TYPE_TX_ERROR:
+            ev->type = NIC_EVENT::TX_ERROR;
+            break;
+        case EF_EVENT_TYPE_RX_DISCARD:
+            ev->type = NIC_EVENT::RX_DISCARD;
+            ev->id = EF_EVENT_RX_DISCARD_RQ_ID(raw[i]);
+            ev->flags = EF_EVENT_RX_DISCARD_TYPE(raw[i]);
+            break;
+        default:
+            throw std::runtime_error("Unexpected event type: " + std::to_string(EF_EVENT_TYPE(raw[i])));
+        }
+    }
+    return n_ev;
+}
+
+/*
+    This function blocks in the driver until the event queue has an event past the one poll would read next.
+    ef_eventq_wait primes the interrupt itself, so an event arriving between the last poll and the wait is not missed.
+*/
+static int efvi_wait(uint64_t timeout_ns)
+{
+    struct timeval tv = {(time_t)(timeout_ns / 1000000000ull), (suseconds_t)(timeout_ns % 1000000000ull / 1000)};
+    int rc = ef_eventq_wait(&vi.vi, vi.dh, ef_eventq_current(&vi.vi), &tv);
+    if (rc == -ETIMEDOUT)
+        return 0;
+    return rc < 0 ? rc : 1;
+}
+
+static int efvi_filter_add(uint32_t laddr, uint16_t lport, uint32_t raddr, uint16_t rport)
+{
+    ef_filter_spec fs;
+    ef_filter_spec_init(&fs, EF_FILTER_FLAG_NONE);
+    TRY(ef_filter_spec_set_ip4_full(&fs, IPPROTO_TCP, laddr, lport, raddr, rport));
+    return ef_vi_filter_add(&vi.vi, vi.dh, &fs, NULL);
+}
+
+/*
+    This function installs a MAC filter narrowed to one ethertype.
+    Not every firmware variant supports it, so failures are returned rather than fatal.
+*/
+static int efvi_filter_add_eth(const uint8_t *mac, uint16_t ether_type)
+{
+    ef_filter_spec fs;
+    int rc;
+    ef_filter_spec_init(&fs, EF_FILTER_FLAG_NONE);
+    if ((rc = ef_filter_spec_set_eth_local(&fs, EF_FILTER_VLAN_ID_ANY, mac)) < 0)
+        return rc;
+    if ((rc = ef_filter_spec_set_eth_type(&fs, ether_type)) < 0)
+        return rc;
+    return ef_vi_filter_add(&vi.vi, vi.dh, &fs, NULL);
+}
+
+const struct nic_backend nic_efvi = {
+    "efvi",
+    efvi_init,
+    efvi_dma_addr,
+    efvi_rx_prefix_len,
+    efvi_offloads,
+    efvi_rx_timestamp,
+    efvi_rx_space,
+    efvi_rx_post,
+    efvi_rx_push,
+    efvi_transmit,
+    efvi_transmit_init,
+    efvi_transmit_push,
+    efvi_poll,
+    efvi_wait,
+    efvi_filter_add,
+    efvi_filter_add_eth,
+};
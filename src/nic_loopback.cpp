@@ -0,0 +1,497 @@
+#include "utils.h"
+#include "nic_backend.hpp"
+#include "pkt_headers.hpp"
+#include <time.h>
+
+/*
+    In-memory loopback implementation of the NIC backend.
+    Frames handed to transmit are parsed by a simulated TCP peer living in the same process,
+    and the peer's replies are copied into the posted RX buffers on the next poll.
+    DMA addresses are plain offsets into the registered memory region.
+    Unless the stack asks for software checksums, the loopback NIC offloads them like ef_vi: the peer takes the frames
+    it is sent as having right checksums, and the frames the peer has corrupted come back as RX_DISCARD.
+*/
+
+#define LB_RXQ_SIZE 4096    /* Upper bound on the RX ring size */
+#define LB_WIRE_FRAMES 256  /* Frames the peer can have in flight towards the stack */
+#define LB_FRAME_SIZE 1600  /* Largest frame the peer builds */
+#define LB_PEER_ISS 7000000 /* Initial sequence number of the peer */
+#define LB_OOO_RANGES 64    /* Out-of-order ranges the peer remembers */
+#define LB_MAX_PEERS 16     /* Connections the peer can serve at once */
+#define LB_PEER_MSS 1460    /* MSS the peer announces */
+#define LB_PEER_WSCALE 7    /* Window scale the peer announces, as Linux does with default buffers */
+
+struct lb_rx_desc
+{
+    nic_addr addr;
+    uint32_t id;
+};
+
+struct lb_tx_desc
+{
+    nic_addr addr;
+    int len;
+    uint32_t id;
+};
+
+struct lb_frame
+{
+    uint16_t len;
+    bool bad;     /* Corrupted by the peer after its checksums were computed */
+    char data[LB_FRAME_SIZE];
+};
+
+struct lb_range
+{
+    uint32_t seq;
+    uint32_t end;
+};
+
+struct lb_peer
+{
+    uint16_t port;      /* Local port of the stack's connection, network byte order */
+    bool established;
+    struct lb_range ooo[LB_OOO_RANGES]; /* Future data held back, like a real receiver would (payload is not echoed) */
+    int ooo_n;
+    uint32_t snd_nxt;
+    uint32_t rcv_nxt;
+    struct pkt_hdr hdr; /* Header of the last frame from the stack, with addresses swapped */
+};
+
+struct loopback
+{
+    char *mem;
+    size_t mem_size;
+    int rxq_size;
+    struct lb_rx_desc rxq[LB_RXQ_SIZE];
+    unsigned rxq_added;   /* Descriptors posted by the stack */
+    unsigned rxq_pushed;  /* Descriptors made visible by rx_push */
+    unsigned rxq_removed; /* Descriptors filled with a frame */
+    struct lb_frame wire[LB_WIRE_FRAMES];
+    unsigned wire_head;
+    unsigned wire_tail;
+    uint32_t *tx_done;    /* Completed transmit ids not yet reported */
+    int tx_done_n;
+    struct lb_tx_desc *tx_pending; /* Transmits queued by transmit_init, sent by transmit_push */
+    int tx_pending_n;
+    int txq_size;
+    struct lb_peer peers[LB_MAX_PEERS]; /* One per connection of the stack */
+    int n_peers;
+    bool echo;
+    unsigned drop_every; /* Drop every nth data segment from the stack, 0 for none */
+    unsigned data_segs;
+    bool reorder;        /* Swap every pair of segments injected towards the stack */
+    unsigned injected;
+    uint32_t arp_ignore; /* Address the peer does not answer ARP requests for, network byte order */
+    unsigned corrupt_every; /* Corrupt every nth data segment from the peer, 0 for none */
+    unsigned peer_segs;
+    unsigned offloads;   /* NIC_OFFLOAD_* */
+};
+
+static struct loopback lb;
+static const uint8_t peer_mac[ETH_ALEN] = NIC_LOOPBACK_PEER_MAC;
+
+static int lb_init(const char *intf, void *mem, size_t mem_size, int rxq_size, int txq_size, int rx_buf_len, unsigned flags)
+{
+    (void)intf;
+    TEST(rxq_size <= LB_RXQ_SIZE && IS_POW2(rxq_size));
+    // every frame the peer builds has to fit in one RX buffer
+    TEST(rx_buf_len >= LB_FRAME_SIZE);
+    lb.mem = (char *)mem;
+    lb.mem_size = mem_size;
+    lb.rxq_size = rxq_size;
+    lb.rxq_added = lb.rxq_pushed = lb.rxq_removed = 0;
+    lb.wire_head = lb.wire_tail = 0;
+    lb.txq_size = txq_size;
+    lb.tx_done = (uint32_t *)calloc(txq_size, sizeof(uint32_t));
+    TEST(lb.tx_done != NULL);
+    lb.tx_done_n = 0;
+    lb.tx_pending = (struct lb_tx_desc *)calloc(txq_size, sizeof(struct lb_tx_desc));
+    TEST(lb.tx_pending != NULL);
+    lb.tx_pending_n = 0;
+    lb.n_peers = 0;
+    lb.offloads = (flags & NIC_INIT_SW_CSUM) ? 0 : NIC_OFFLOAD_TX_CSUM | NIC_OFFLOAD_RX_CSUM;
+    return 0;
+}
+
+static nic_addr lb_dma_addr(size_t offset)
+{
+    assert(offset < lb.mem_size);
+    return offset;
+}
+
+static int lb_rx_prefix_len(void)
+{
+    return 0;
+}
+
+static unsigned lb_offloads(void)
+{
+    return lb.offloads;
+}
+
+static uint64_t lb_rx_timestamp(const void *dma)
+{
+    (void)dma;
+    return 0;
+}
+
+static int lb_rx_space(void)
+{
+    return lb.rxq_size - 1 - (int)(lb.rxq_added - lb.rxq_removed);
+}
+
+static int lb_rx_post(nic_addr addr, uint32_t id)
+{
+    if (lb_rx_space() <= 0)
+        return -EAGAIN;
+    struct lb_rx_desc *desc = &lb.rxq[lb.rxq_added++ & (lb.rxq_size - 1)];
+    desc->addr = addr;
+    desc->id = id;
+    return 0;
+}
+
+static void lb_rx_push(void)
+{
+    lb.rxq_pushed = lb.rxq_added;
+}
+
+static struct lb_peer *peer_find(uint16_t port)
+{
+    for (int i = 0; i < lb.n_peers; ++i)
+        if (lb.peers[i].port == port)
+            return &lb.peers[i];
+    return NULL;
+}
+
+/*
+    This function builds a frame from the peer to the stack, with options in the header if opts is not NULL,
+    and puts it on the wire. If the wire is full the frame is dropped, just as a real switch would.
+*/
+static void peer_send_opts(struct lb_peer *p, uint8_t flags, const struct tcp_opts *opts, const char *payload, size_t payload_len)
+{
+    if (lb.wire_tail - lb.wire_head == LB_WIRE_FRAMES ||
+        sizeof(struct pkt_hdr) + TCP_OPTS_MAX_LEN + payload_len > LB_FRAME_SIZE)
+        return;
+    struct lb_frame *frame = &lb.wire[lb.wire_tail++ % LB_WIRE_FRAMES];
+    struct pkt_hdr *hdr = (struct pkt_hdr *)frame->data;
+    memcpy(hdr, &p->hdr, sizeof(struct pkt_hdr));
+    size_t opts_len = opts ? build_tcp_options(opts, (uint8_t *)frame->data + sizeof(struct pkt_hdr)) : 0;
+    memcpy(frame->data + sizeof(struct pkt_hdr) + opts_len, payload, payload_len);
+    hdr->ip.tot_len = htons((uint16_t)(sizeof(struct ip_hdr) + sizeof(struct tcp_hdr) + opts_len + payload_len));
+    hdr->ip.check = 0;
+    hdr->ip.check = (uint16_t)~csum_fold(csum_partial(&hdr->ip, sizeof(struct ip_hdr), 0));
+    hdr->tcp.data_off_reserved = (uint8_t)(((sizeof(struct tcp_hdr) + opts_len) / 4) << 4);
+    // the peer has room for anything
+    hdr->tcp.window = htons(UINT16_MAX);
+    hdr->tcp.urg_ptr = 0;
+    hdr->tcp.seq_num = htonl(p->snd_nxt);
+    hdr->tcp.ack_num = htonl(p->rcv_nxt);
+    hdr->tcp.flags = flags;
+    uint16_t tcp_len = (uint16_t)(sizeof(struct tcp_hdr) + opts_len + payload_len);
+    uint32_t pseudo = csum_partial(&hdr->ip.src_addr, 2 * sizeof(uint32_t), htons(IPPROTO_TCP) + htons(tcp_len));
+    hdr->tcp.check = 0;
+    hdr->tcp.check = (uint16_t)~csum_fold(csum_partial(&hdr->tcp, tcp_len, pseudo));
+    frame->len = (uint16_t)(sizeof(struct pkt_hdr) + opts_len + payload_len);
+    frame->bad = payload_len > 0 && lb.corrupt_every > 0 && ++lb.peer_segs % lb.corrupt_every == 0;
+    if (frame->bad)
+        frame->data[frame->len - 1] ^= 1;
+    p->snd_nxt += payload_len;
+}
+
+static void peer_send(struct lb_peer *p, uint8_t flags, const char *payload, size_t payload_len)
+{
+    peer_send_opts(p, flags, NULL, payload, payload_len);
+}
+
+/*
+    This function answers an ARP request from the stack, as if every address were reachable through the peer.
+*/
+static void peer_arp_input(const char *frame, int len)
+{
+    const struct arp_pkt *in = (const struct arp_pkt *)frame;
+    if (len < (int)sizeof(struct arp_pkt) || in->arp.oper != htons(ARPOP_REQUEST) ||
+        in->arp.tpa == in->arp.spa || in->arp.tpa == lb.arp_ignore ||
+        lb.wire_tail - lb.wire_head == LB_WIRE_FRAMES)
+        return;
+    struct lb_frame *out = &lb.wire[lb.wire_tail++ % LB_WIRE_FRAMES];
+    out->len = (uint16_t)build_arp_packet(ARPOP_REPLY, peer_mac, in->arp.tpa, in->arp.sha, in->arp.spa, out->data);
+    out->bad = false;
+}
+
+/*
+    This function runs the simulated peer on a frame transmitted by the stack.
+*/
+static void peer_input(const char *frame, int len)
+{
+    const struct pkt_hdr *in = (const struct pkt_hdr *)frame;
+    if (len >= (int)sizeof(struct eth_hdr) && in->eth.ether_type == htons(ETH_P_ARP))
+    {
+        peer_arp_input(frame, len);
+        return;
+    }
+    if (!tcp_frame_ok(in, len) || in->eth.ether_type != htons(ETH_P_IP) || in->ip.protocol != IPPROTO_TCP)
+        return;
+    // frames sent to an unresolved or stale MAC never reach the peer
+    if (memcmp(in->eth.dst_mac, peer_mac, ETH_ALEN) != 0)
+        return;
+    size_t hdr_len = ((in->ip.version_ihl & 0x0F) * 4) + ((in->tcp.data_off_reserved >> 4) * 4);
+    size_t pay_len = ntohs(in->ip.tot_len) - hdr_len;
+    const char *payload = frame + sizeof(struct eth_hdr) + hdr_len;
+    uint32_t seq = ntohl(in->tcp.seq_num);
+    // like a real host, the peer silently drops frames with a bad checksum. With TX offload the NIC has filled them in
+    if (!(lb.offloads & NIC_OFFLOAD_TX_CSUM) && !tcp_checksums_ok(in, len))
+        return;
+    if (pay_len > 0 && lb.drop_every > 0 && ++lb.data_segs % lb.drop_every == 0)
+        return;
+    struct lb_peer *p = peer_find(in->tcp.src_port);
+    if (p == NULL)
+    {
+        if (!(in->tcp.flags & (uint8_t)TCP_FLAGS::SYN) || lb.n_peers == LB_MAX_PEERS)
+            return;
+        p = &lb.peers[lb.n_peers++];
+        p->port = in->tcp.src_port;
+        p->established = false;
+    }
+
+    struct pkt_hdr *hdr = &p->hdr;
+    memcpy(hdr, in, sizeof(struct pkt_hdr));
+    memcpy(hdr->eth.dst_mac, in->eth.src_mac, ETH_ALEN);
+    memcpy(hdr->eth.src_mac, in->eth.dst_mac, ETH_ALEN);
+    hdr->ip.src_addr = in->ip.dst_addr;
+    hdr->ip.dst_addr = in->ip.src_addr;
+    hdr->tcp.src_port = in->tcp.dst_port;
+    hdr->tcp.dst_port = in->tcp.src_port;
+
+    if (in->tcp.flags & (uint8_t)TCP_FLAGS::RST)
+    {
+        p->established = false;
+        return;
+    }
+    if (in->tcp.flags & (uint8_t)TCP_FLAGS::SYN)
+    {
+        // answer the options the stack offered, like Linux would
+        struct tcp_opts offered, opts;
+        parse_tcp_options(&in->tcp, &offered);
+        opts.mss = LB_PEER_MSS;
+        opts.wscale = offered.wscale >= 0 ? LB_PEER_WSCALE : -1;
+        opts.sack_ok = offered.sack_ok;
+        opts.ts_ok = offered.ts_ok;
+        opts.ts_val = LB_PEER_ISS;
+        opts.ts_ecr = offered.ts_val;
+        p->snd_nxt = LB_PEER_ISS;
+        p->rcv_nxt = seq + 1;
+        p->ooo_n = 0;
+        peer_send_opts(p, (uint8_t)TCP_FLAGS::SYN | (uint8_t)TCP_FLAGS::ACK, &opts, NULL, 0);
+        p->snd_nxt += 1;
+        p->established = true;
+        return;
+    }
+    if (!p->established)
+        return;
+    if (seq != p->rcv_nxt)
+    {
+        // out of order or retransmitted, remember future data and ask again for what is missing
+        if (pay_len > 0 && (int32_t)(seq - p->rcv_nxt) > 0 && p->ooo_n < LB_OOO_RANGES)
+            p->ooo[p->ooo_n++] = {seq, (uint32_t)(seq + pay_len)};
+        if (pay_len > 0 || (in->tcp.flags & (uint8_t)TCP_FLAGS::FIN))
+            peer_send(p, (uint8_t)TCP_FLAGS::ACK, NULL, 0);
+        return;
+    }
+    if (pay_len > 0)
+    {
+        p->rcv_nxt += pay_len;
+        // pull in any held back data the segment made contiguous
+        for (int i = 0; i < p->ooo_n;)
+        {
+            if ((int32_t)(p->ooo[i].seq - p->rcv_nxt) <= 0)
+            {
+                if ((int32_t)(p->ooo[i].end - p->rcv_nxt) > 0)
+                    p->rcv_nxt = p->ooo[i].end;
+                p->ooo[i] = p->ooo[--p->ooo_n];
+                i = 0;
+                continue;
+            }
+            ++i;
+        }
+        if (lb.echo)
+            peer_send(p, (uint8_t)TCP_FLAGS::ACK | (uint8_t)TCP_FLAGS::PSH, payload, pay_len);
+        else
+            peer_send(p, (uint8_t)TCP_FLAGS::ACK, NULL, 0);
+    }
+    if (in->tcp.flags & (uint8_t)TCP_FLAGS::FIN)
+    {
+        p->rcv_nxt += 1;
+        peer_send(p, (uint8_t)TCP_FLAGS::FIN | (uint8_t)TCP_FLAGS::ACK, NULL, 0);
+        p->snd_nxt += 1;
+        p->established = false;
+    }
+}
+
+static int lb_transmit_init(nic_addr addr, int len, uint32_t id)
+{
+    if (lb.tx_done_n + lb.tx_pending_n >= lb.txq_size - 1)
+        return -EAGAIN;
+    assert(addr + len <= lb.mem_size);
+    lb.tx_pending[lb.tx_pending_n++] = {addr, len, id};
+    return 0;
+}
+
+/*
+    This function sends every queued frame to the peer, in the order they were queued.
+*/
+static void lb_transmit_push(void)
+{
+    for (int i = 0; i < lb.tx_pending_n; ++i)
+    {
+        struct lb_tx_desc *desc = &lb.tx_pending[i];
+        lb.tx_done[lb.tx_done_n++] = desc->id;
+        peer_input(lb.mem + desc->addr, desc->len);
+    }
+    lb.tx_pending_n = 0;
+}
+
+static int lb_transmit(nic_addr addr, int len, uint32_t id)
+{
+    int rc = lb_transmit_init(addr, len, id);
+    if (rc == 0)
+        lb_transmit_push();
+    return rc;
+}
+
+/*
+    This function reports transmit completions, then moves frames from the wire into posted RX buffers.
+    With RX offload a corrupted frame is reported as RX_DISCARD. The peer builds every other frame with right checksums,
+    so those are the frames a real NIC would discard.
+*/
+static int lb_poll(struct nic_event *evs, int max_evs)
+{
+    int n_ev = 0;
+    if (max_evs > NIC_POLL_MAX_EVS)
+        max_evs = NIC_POLL_MAX_EVS;
+    if (lb.tx_done_n > 0 && n_ev < max_evs)
+    {
+        struct nic_event *ev = &evs[n_ev++];
+        ev->type = NIC_EVENT::TX;
+        ev->flags = 0;
+        ev->id = lb.tx_done[lb.tx_done_n - 1];
+        ev->len = lb.tx_done_n;
+        ev->hw_ns = 0;
+        lb.tx_done_n = 0;
+    }
+    while (n_ev < max_evs && lb.wire_head != lb.wire_tail && lb.rxq_removed != lb.rxq_pushed)
+    {
+        struct lb_frame *frame = &lb.wire[lb.wire_head++ % LB_WIRE_FRAMES];
+        struct lb_rx_desc *desc = &lb.rxq[lb.rxq_removed++ & (lb.rxq_size - 1)];
+        memcpy(lb.mem + desc->addr, frame->data, frame->len);
+        struct nic_event *ev = &evs[n_ev++];
+        ev->type = (frame->bad && (lb.offloads & NIC_OFFLOAD_RX_CSUM)) ? NIC_EVENT::RX_DISCARD : NIC_EVENT::RX;
+        ev->flags = 0;
+        ev->id = desc->id;
+        ev->len = frame->len;
+        ev->hw_ns = 0;
+    }
+    return n_ev;
+}
+
+/*
+    This function stands in for blocking on an interrupt. Nothing reaches the wire while the stack sleeps,
+    as the peer only answers from transmit, so it returns at once if poll has something and sleeps out the timeout otherwise.
+*/
+static int lb_wait(uint64_t timeout_ns)
+{
+    if (lb.tx_done_n > 0 || (lb.wire_head != lb.wire_tail && lb.rxq_removed != lb.rxq_pushed))
+        return 1;
+    struct timespec ts = {(time_t)(timeout_ns / 1000000000ull), (long)(timeout_ns % 1000000000ull)};
+    nanosleep(&ts, NULL);
+    return 0;
+}
+
+static int lb_filter_add(uint32_t laddr, uint16_t lport, uint32_t raddr, uint16_t rport)
+{
+    (void)laddr;
+    (void)lport;
+    (void)raddr;
+    (void)rport;
+    return 0;
+}
+
+static int lb_filter_add_eth(const uint8_t *mac, uint16_t ether_type)
+{
+    (void)mac;
+    (void)ether_type;
+    return 0;
+}
+
+void nic_loopback_inject(const char *payload, size_t len)
+{
+    if (lb.n_peers > 0)
+        nic_loopback_inject(ntohs(lb.peers[0].port), payload, len);
+}
+
+void nic_loopback_inject(uint16_t local_port, const char *payload, size_t len)
+{
+    struct lb_peer *p = peer_find(htons(local_port));
+    if (p == NULL || !p->established)
+        return;
+    unsigned tail = lb.wire_tail;
+    peer_send(p, (uint8_t)TCP_FLAGS::ACK | (uint8_t)TCP_FLAGS::PSH, payload, len);
+    // the previous injected segment must still be on the wire, right in front of this one
+    if (lb.reorder && lb.wire_tail != tail && ++lb.injected % 2 == 0 &&
+        lb.wire_tail - lb.wire_head >= 2)
+    {
+        struct lb_frame tmp;
+        struct lb_frame *a = &lb.wire[(lb.wire_tail - 2) % LB_WIRE_FRAMES];
+        struct lb_frame *b = &lb.wire[(lb.wire_tail - 1) % LB_WIRE_FRAMES];
+        memcpy(&tmp, a, sizeof(tmp));
+        memcpy(a, b, sizeof(tmp));
+        memcpy(b, &tmp, sizeof(tmp));
+    }
+}
+
+void nic_loopback_set_echo(bool echo)
+{
+    lb.echo = echo;
+}
+
+void nic_loopback_set_reorder(bool reorder)
+{
+    lb.reorder = reorder;
+    lb.injected = 0;
+}
+
+void nic_loopback_set_drop(unsigned every)
+{
+    lb.drop_every = every;
+    lb.data_segs = 0;
+}
+
+void nic_loopback_set_corrupt(unsigned every)
+{
+    lb.corrupt_every = every;
+    lb.peer_segs = 0;
+}
+
+void nic_loopback_set_arp_ignore(uint32_t addr)
+{
+    lb.arp_ignore = htonl(addr);
+}
+
+const struct nic_backend nic_loopback = {
+    "loopback",
+    lb_init,
+    lb_dma_addr,
+    lb_rx_prefix_len,
+    lb_offloads,
+    lb_rx_timestamp,
+    lb_rx_space,
+    lb_rx_post,
+    lb_rx_push,
+    lb_transmit,
+    lb_transmit_init,
+    lb_transmit_push,
+    lb_poll,
+    lb_wait,
+    lb_filter_add,
+    lb_filter_add_eth,
+};
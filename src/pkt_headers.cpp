@@ -87,33 +87,287 @@ uint16_t tcp_checksum(struct pkt_hdr *pkt, size_t payload_len, size_t total_len)
  * Builds a TCP packet with the given payload and payload length.
  * The packet is built in the buffer passed as argument. The passed buffer is populated with the complete packet.
  *
- * @param pkt_hdr: Pointer to the packet header.
+ * @param addrs: Header the MACs, IPs and ports are taken from.
  * @param payload: Pointer to the payload.
  * @param payload_len: Length of the payload.
  * @param buffer: Buffer to store the packet.
  * */
-void build_tcp_packet(const char *payload, size_t payload_len, uint8_t flags, uint32_t seq, uint32_t ack, char *buffer)
+void build_tcp_packet(const struct pkt_hdr *addrs, const char *payload, size_t payload_len, uint8_t flags, uint32_t seq, uint32_t ack, char *buffer)
 {
     struct pkt_hdr pkt_hdr;
-    std::cout << "ack: " << ack << std::endl;
+    memcpy(&pkt_hdr.eth, &addrs->eth, sizeof(struct eth_hdr));
+    pkt_hdr.ip.src_addr = addrs->ip.src_addr;
+    pkt_hdr.ip.dst_addr = addrs->ip.dst_addr;
     pkt_hdr.ip.tot_len = htons((uint16_t)(sizeof(struct ip_hdr) + sizeof(struct tcp_hdr) + payload_len));
-    std::cout << "IP TOTAL LEN: " << payload_len << std::endl;
-    compute_ip_checksum(&pkt_hdr.ip);
+    pkt_hdr.ip.check = 0;
+    pkt_hdr.ip.check = (uint16_t)~csum_fold(csum_partial(&pkt_hdr.ip, sizeof(struct ip_hdr), 0));
 
-    pkt_hdr.tcp.src_port = htons(1234);  // MANUAL
-    pkt_hdr.tcp.dst_port = htons(12345); // MANUAL
+    pkt_hdr.tcp.src_port = addrs->tcp.src_port;
+    pkt_hdr.tcp.dst_port = addrs->tcp.dst_port;
     pkt_hdr.tcp.seq_num = htonl(seq);    // MANUAL
     pkt_hdr.tcp.ack_num = htonl(ack);    // MANUAL
     pkt_hdr.tcp.flags = flags;           // MANUAL
-    pkt_hdr.tcp.check = tcp_checksum(&pkt_hdr, payload_len, sizeof(struct pkt_hdr) + payload_len);
-
-    std::cout << "TCP ACK NUM: " << ntohl(pkt_hdr.tcp.ack_num) << std::endl;
 
+    // tcp_checksum walks the payload right after the header, so checksum the packet in place
     memcpy(buffer, &pkt_hdr, sizeof(struct pkt_hdr));
     if (payload_len > 0)
     {
         memcpy(buffer + sizeof(struct pkt_hdr), payload, payload_len);
     }
+    struct pkt_hdr *hdr = (struct pkt_hdr *)buffer;
+    hdr->tcp.check = htons(tcp_checksum(hdr, payload_len, sizeof(struct pkt_hdr) + payload_len));
 
     return;
 }
+
+bool tcp_frame_ok(const struct pkt_hdr *hdr, size_t len)
+{
+    if (len < sizeof(struct pkt_hdr))
+        return false;
+    // the stack reads the TCP header at hdr->tcp, so a frame carrying IP options is dropped rather than misread
+    if ((hdr->ip.version_ihl & 0x0F) * 4 != sizeof(struct ip_hdr))
+        return false;
+    uint32_t tot_len = ntohs(hdr->ip.tot_len);
+    // short frames are padded on the wire, so the frame may be longer than tot_len but never shorter
+    if (tot_len > len - sizeof(struct eth_hdr) || tot_len < sizeof(struct ip_hdr) + sizeof(struct tcp_hdr))
+        return false;
+    uint32_t tcp_hdr_len = (hdr->tcp.data_off_reserved >> 4) * 4;
+    return tcp_hdr_len >= sizeof(struct tcp_hdr) && tot_len >= sizeof(struct ip_hdr) + tcp_hdr_len;
+}
+
+bool tcp_checksums_ok(const struct pkt_hdr *hdr, size_t len)
+{
+    if (!tcp_frame_ok(hdr, len))
+        return false;
+    // a correct header or segment sums to 0xFFFF with its checksum field included
+    uint32_t tcp_len = ntohs(hdr->ip.tot_len) - sizeof(struct ip_hdr);
+    if (csum_fold(csum_partial(&hdr->ip, sizeof(struct ip_hdr), 0)) != 0xFFFF)
+        return false;
+    uint32_t pseudo = csum_partial(&hdr->ip.src_addr, 2 * sizeof(uint32_t), htons(IPPROTO_TCP) + htons(tcp_len));
+    return csum_fold(csum_partial(&hdr->tcp, tcp_len, pseudo)) == 0xFFFF;
+}
+
+void init_pkt_hdr_template(struct pkt_hdr_template *tmpl, const uint8_t *src_mac, const uint8_t *dst_mac,
+                           uint32_t src_addr, uint32_t dst_addr, uint16_t src_port, uint16_t dst_port)
+{
+    struct pkt_hdr *hdr = &tmpl->hdr;
+    *hdr = pkt_hdr();
+    memcpy(hdr->eth.src_mac, src_mac, ETH_ALEN);
+    memcpy(hdr->eth.dst_mac, dst_mac, ETH_ALEN);
+    hdr->ip.tot_len = 0;
+    hdr->ip.check = 0;
+    hdr->ip.src_addr = htonl(src_addr);
+    hdr->ip.dst_addr = htonl(dst_addr);
+    hdr->tcp.src_port = htons(src_port);
+    hdr->tcp.dst_port = htons(dst_port);
+    hdr->tcp.seq_num = 0;
+    hdr->tcp.ack_num = 0;
+    hdr->tcp.flags = 0;
+    hdr->tcp.check = 0;
+
+    // zeroed fields add nothing, so these are the sums over the constant fields only
+    // data offset shares a word with the flags, so it is summed per packet
+    tmpl->ip_sum = csum_partial(&hdr->ip, sizeof(struct ip_hdr), 0);
+    tmpl->tcp_sum = csum_partial(&hdr->tcp.src_port, 2 * sizeof(uint16_t), 0);
+    tmpl->tcp_sum = csum_partial(&hdr->tcp.window, 3 * sizeof(uint16_t), tmpl->tcp_sum);
+    tmpl->tcp_sum = csum_partial(&hdr->ip.src_addr, 2 * sizeof(uint32_t), tmpl->tcp_sum);
+    tmpl->tcp_sum += htons(IPPROTO_TCP);
+}
+
+void build_tcp_packet_from_template(const struct pkt_hdr_template *tmpl, const char *payload, size_t payload_len, uint8_t flags, uint32_t seq, uint32_t ack, char *buffer)
+{
+    uint32_t sum = 0;
+    if (payload == buffer + sizeof(struct pkt_hdr))
+    {
+        sum = csum_partial(payload, payload_len, 0);
+    }
+    else if (payload_len > 0)
+    {
+        sum = csum_copy_partial(buffer + sizeof(struct pkt_hdr), payload, payload_len, 0);
+    }
+    build_tcp_header_from_template(tmpl, sum, payload_len, flags, seq, ack, buffer);
+}
+
+void build_tcp_header_from_template(const struct pkt_hdr_template *tmpl, uint32_t payload_sum, size_t payload_len, uint8_t flags, uint32_t seq, uint32_t ack, char *buffer)
+{
+    struct pkt_hdr *hdr = (struct pkt_hdr *)buffer;
+    uint16_t tcp_len = (uint16_t)(sizeof(struct tcp_hdr) + payload_len);
+    uint32_t seq_n = htonl(seq);
+    uint32_t ack_n = htonl(ack);
+    uint16_t off_flags;
+
+    memcpy(hdr, &tmpl->hdr, sizeof(struct pkt_hdr));
+    hdr->ip.tot_len = htons((uint16_t)(sizeof(struct ip_hdr) + tcp_len));
+    hdr->ip.check = (uint16_t)~csum_fold(tmpl->ip_sum + hdr->ip.tot_len);
+
+    hdr->tcp.seq_num = seq_n;
+    hdr->tcp.ack_num = ack_n;
+    hdr->tcp.flags = flags;
+    memcpy(&off_flags, &hdr->tcp.data_off_reserved, sizeof(off_flags));
+
+    uint32_t sum = tmpl->tcp_sum + htons(tcp_len) + off_flags;
+    sum += (seq_n >> 16) + (seq_n & 0xFFFF) + (ack_n >> 16) + (ack_n & 0xFFFF);
+    sum += payload_sum;
+    hdr->tcp.check = (uint16_t)~csum_fold(sum);
+}
+
+void build_tcp_header_offload(const struct pkt_hdr_template *tmpl, size_t payload_len, uint8_t flags, uint32_t seq, uint32_t ack, char *buffer)
+{
+    struct pkt_hdr *hdr = (struct pkt_hdr *)buffer;
+
+    // the template keeps both checksums zero, which is what the NIC expects to find
+    memcpy(hdr, &tmpl->hdr, sizeof(struct pkt_hdr));
+    hdr->ip.tot_len = htons((uint16_t)(sizeof(struct ip_hdr) + sizeof(struct tcp_hdr) + payload_len));
+    hdr->tcp.seq_num = htonl(seq);
+    hdr->tcp.ack_num = htonl(ack);
+    hdr->tcp.flags = flags;
+}
+
+size_t build_tcp_options(const struct tcp_opts *opts, uint8_t *buf)
+{
+    uint8_t *p = buf;
+    if (opts->mss != 0)
+    {
+        uint16_t mss = htons(opts->mss);
+        *p++ = TCPOPT_MAXSEG;
+        *p++ = TCPOLEN_MAXSEG;
+        memcpy(p, &mss, sizeof(mss));
+        p += sizeof(mss);
+    }
+    // SACK permitted fills the two bytes in front of the timestamps, NOPs do otherwise
+    if (opts->sack_ok)
+    {
+        if (!opts->ts_ok)
+        {
+            *p++ = TCPOPT_NOP;
+            *p++ = TCPOPT_NOP;
+        }
+        *p++ = TCPOPT_SACK_PERMITTED;
+        *p++ = TCPOLEN_SACK_PERMITTED;
+    }
+    if (opts->ts_ok)
+    {
+        uint32_t val = htonl(opts->ts_val);
+        uint32_t ecr = htonl(opts->ts_ecr);
+        if (!opts->sack_ok)
+        {
+            *p++ = TCPOPT_NOP;
+            *p++ = TCPOPT_NOP;
+        }
+        *p++ = TCPOPT_TIMESTAMP;
+        *p++ = TCPOLEN_TIMESTAMP;
+        memcpy(p, &val, sizeof(val));
+        memcpy(p + sizeof(val), &ecr, sizeof(ecr));
+        p += sizeof(val) + sizeof(ecr);
+    }
+    if (opts->wscale >= 0)
+    {
+        *p++ = TCPOPT_NOP;
+        *p++ = TCPOPT_WINDOW;
+        *p++ = TCPOLEN_WINDOW;
+        *p++ = (uint8_t)opts->wscale;
+    }
+    return p - buf;
+}
+
+void parse_tcp_options(const struct tcp_hdr *tcp, struct tcp_opts *opts)
+{
+    const uint8_t *p = (const uint8_t *)tcp + sizeof(struct tcp_hdr);
+    const uint8_t *end = (const uint8_t *)tcp + (tcp->data_off_reserved >> 4) * 4;
+    *opts = tcp_opts();
+    while (p < end)
+    {
+        if (*p == TCPOPT_EOL)
+            break;
+        if (*p == TCPOPT_NOP)
+        {
+            ++p;
+            continue;
+        }
+        if (end - p < 2 || p[1] < 2 || p[1] > end - p)
+            break;
+        switch (p[0])
+        {
+        case TCPOPT_MAXSEG:
+            if (p[1] == TCPOLEN_MAXSEG)
+                opts->mss = (uint16_t)(p[2] << 8 | p[3]);
+            break;
+        case TCPOPT_WINDOW:
+            if (p[1] == TCPOLEN_WINDOW)
+                opts->wscale = p[2] < TCP_MAX_WSCALE ? p[2] : TCP_MAX_WSCALE;
+            break;
+        case TCPOPT_SACK_PERMITTED:
+            if (p[1] == TCPOLEN_SACK_PERMITTED)
+                opts->sack_ok = true;
+            break;
+        case TCPOPT_TIMESTAMP:
+            if (p[1] == TCPOLEN_TIMESTAMP)
+            {
+                uint32_t val, ecr;
+                memcpy(&val, p + 2, sizeof(val));
+                memcpy(&ecr, p + 6, sizeof(ecr));
+                opts->ts_ok = true;
+                opts->ts_val = ntohl(val);
+                opts->ts_ecr = ntohl(ecr);
+            }
+            break;
+        }
+        p += p[1];
+    }
+}
+
+size_t build_tcp_packet_with_options(const struct pkt_hdr_template *tmpl, const struct tcp_opts *opts, uint8_t flags, uint32_t seq, uint32_t ack, char *buffer)
+{
+    struct pkt_hdr *hdr = (struct pkt_hdr *)buffer;
+    size_t opts_len = build_tcp_options(opts, (uint8_t *)buffer + sizeof(struct pkt_hdr));
+
+    uint16_t tcp_len = (uint16_t)(sizeof(struct tcp_hdr) + opts_len);
+    uint32_t seq_n = htonl(seq);
+    uint32_t ack_n = htonl(ack);
+    uint16_t off_flags;
+
+    memcpy(hdr, &tmpl->hdr, sizeof(struct pkt_hdr));
+    hdr->ip.tot_len = htons((uint16_t)(sizeof(struct ip_hdr) + tcp_len));
+    hdr->ip.check = (uint16_t)~csum_fold(tmpl->ip_sum + hdr->ip.tot_len);
+
+    hdr->tcp.seq_num = seq_n;
+    hdr->tcp.ack_num = ack_n;
+    hdr->tcp.flags = flags;
+    hdr->tcp.data_off_reserved = (uint8_t)((tcp_len / 4) << 4);
+    memcpy(&off_flags, &hdr->tcp.data_off_reserved, sizeof(off_flags));
+
+    // the options are whole words, so they sum like the payload of build_tcp_header_from_template
+    uint32_t sum = tmpl->tcp_sum + htons(tcp_len) + off_flags;
+    sum += (seq_n >> 16) + (seq_n & 0xFFFF) + (ack_n >> 16) + (ack_n & 0xFFFF);
+    sum = csum_partial(buffer + sizeof(struct pkt_hdr), opts_len, sum);
+    hdr->tcp.check = (uint16_t)~csum_fold(sum);
+    return sizeof(struct pkt_hdr) + opts_len;
+}
+
+void pkt_hdr_template_set_window(struct pkt_hdr_template *tmpl, uint16_t window)
+{
+    uint16_t old = tmpl->hdr.tcp.window;
+    tmpl->hdr.tcp.window = htons(window);
+    // adding the complement takes the old value out of a one's complement sum
+    tmpl->tcp_sum = csum_fold(tmpl->tcp_sum + (uint16_t)~old + tmpl->hdr.tcp.window);
+}
+
+size_t build_arp_packet(uint16_t oper, const uint8_t *src_mac, uint32_t src_addr, const uint8_t *dst_mac, uint32_t dst_addr, char *buffer)
+{
+    struct arp_pkt *pkt = (struct arp_pkt *)buffer;
+    memset(buffer, 0, ARP_FRAME_LEN);
+    *pkt = arp_pkt();
+    pkt->eth.ether_type = htons(ETH_P_ARP);
+    memcpy(pkt->eth.src_mac, src_mac, ETH_ALEN);
+    if (oper == ARPOP_REQUEST)
+        memset(pkt->eth.dst_mac, 0xff, ETH_ALEN);
+    else
+        memcpy(pkt->eth.dst_mac, dst_mac, ETH_ALEN);
+    pkt->arp.oper = htons(oper);
+    memcpy(pkt->arp.sha, src_mac, ETH_ALEN);
+    pkt->arp.spa = src_addr;
+    if (oper != ARPOP_REQUEST)
+        memcpy(pkt->arp.tha, dst_mac, ETH_ALEN);
+    pkt->arp.tpa = dst_addr;
+    return ARP_FRAME_LEN;
+}
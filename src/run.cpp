@@ -17,12 +17,19 @@ int main(int argc, char *argv[])
 
     // 1. Sample Client to Server Communication
     
-    ef_init_tcp_client();
+    if (argc > 1 && strcmp(argv[1], "loopback") == 0)
+        ef_init_tcp_client(&nic_loopback);
+    else
+        ef_init_tcp_client();
+    // optionally capture the session to a pcap file
+    if (argc > 2)
+        ef_capture_start(argv[2]);
     ef_connect();
     ef_send("Hello HFTT Class\n", 17);
     ef_send("My name is Kevin\n", 17);
     ef_send("What is your name?\n", 19);
     ef_disconnect();
+    ef_capture_stop();
     return 0;
     
 
@@ -32,8 +39,11 @@ int main(int argc, char *argv[])
     signal(SIGINT, signal_handler);
     ef_init_tcp_client();
     ef_connect();
+    // spin while messages keep coming, sleep on the NIC interrupt when the session goes quiet
+    ef_set_wait_mode(WAIT_MODE::ADAPTIVE, WAIT_SPIN_NS);
     char buf[1500];
     while (true) {
+        ef_wait(-1);
         ssize_t bytes = ef_read(buf, 1500);
         if (bytes > 0) {
             buf[bytes] = '\0';